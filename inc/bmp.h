@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+struct pnm_reader_struct;
+
 #pragma pack(push)
 #pragma pack(1)
 
@@ -17,7 +19,7 @@ typedef struct {
 typedef struct {
     uint32_t dib_size;
     uint32_t width;
-    uint32_t height;
+    int32_t  height;   /**< Image height, negative if rows are stored top-down */
     uint16_t n_planes;
     uint16_t bpp;
 #define BMP_COMPRESSION_RGB            ( 0)
@@ -47,29 +49,132 @@ typedef struct {
 
 #pragma pack(pop)
 
+/**
+ * @brief Where a row of an RLE compressed image starts, @see bmp_hand_t
+ */
+typedef struct {
+#define BMP_RLE_BLANK (UINT32_MAX) /**< Row holds nothing but palette index 0 */
+    uint32_t off; /**< Offset of row's first code within compressed data, or BMP_RLE_BLANK */
+    uint32_t x;   /**< Column the row's first code starts at */
+} bmp_rle_row_t;
+
 typedef struct {
     bmp_file_header_t  file_head; /**< File header */
     bmp_dib_header_t   dib_head;  /**< DIB header */
-    bmp_color_entry_t *palette;   /**< Color palette */
-    uint8_t           *data;      /**< Pixel data */
+    bmp_color_entry_t *palette;   /**< Color palette, NULL for truecolor images without one */
+    uint8_t           *data;      /**< Pixel data, either the current band or the entire image */
+
+    int                fd;        /**< File descriptor image is read from */
+    uint32_t           height;    /**< Image height, in rows */
+    uint8_t            flags;     /**< Flags */
+#define BMP_FLAG_TOPDOWN  (1U << 0) /**< Rows are stored top to bottom */
+#define BMP_FLAG_SEEKABLE (1U << 1) /**< Rows can be read with pread() */
+#define BMP_FLAG_BUFFERED (1U << 2) /**< Entire pixel array is held in data */
+#define BMP_FLAG_MAPPED   (1U << 3) /**< File is memory-mapped, data points into the mapping */
+#define BMP_FLAG_RLE      (1U << 4) /**< Pixel data is RLE compressed, rows are decoded into data one band at a time */
+#define BMP_FLAG_PNM      (1U << 5) /**< Image is actually in Netpbm format, @see pnm_open */
 
     size_t             row_sz;    /**< Size of single row of data, in bytes */
     size_t             data_sz;   /**< Size of data region, in bytes, including padding */
+    size_t             data_cap;  /**< Number of rows allocated for data */
+    uint32_t           band_fy;   /**< First row (in file order) held in data */
+    uint32_t           band_n;    /**< Number of rows held in data */
+    uint32_t           next_fy;   /**< Next row (in file order) to be read from a non-seekable file */
+
+    void              *map;       /**< Read-only mapping of entire file, if BMP_FLAG_MAPPED */
+    size_t             map_sz;    /**< Size of mapping, in bytes */
+
+    const uint8_t     *rle;       /**< Compressed pixel data, if BMP_FLAG_RLE */
+    size_t             rle_sz;    /**< Size of compressed pixel data, in bytes */
+    bmp_rle_row_t     *rle_rows;  /**< Start of each row (in file order) within rle */
+
+    struct pnm_reader_struct *pnm; /**< Netpbm reader state, if BMP_FLAG_PNM */
 } bmp_hand_t;
 
-int bmp_load_file(bmp_hand_t *hand, int fd);
+/**
+ * @brief Read BMP headers and palette, and prepare to read pixel data
+ *
+ * The file is only ever read sequentially, so pipes are supported. Pixel
+ * data is read one band at a time via bmp_load_band(). Only non-seekable
+ * bottom-up images require buffering the entire pixel array.
+ *
+ * Regular files are instead memory-mapped, and rows are accessed directly
+ * from the mapping without being copied.
+ *
+ * Netpbm images are also accepted, @see pnm_open
+ *
+ * RLE8 and RLE4 compressed images are indexed when opened, and only the rows
+ * of the requested band are decoded. The compressed data is mapped, or held
+ * in memory if the file is not seekable.
+ *
+ * @param hand BMP handle
+ * @param fd File descriptor of BMP image
+ * @return 0 on success, else < 0
+ */
+int bmp_open(bmp_hand_t *hand, int fd);
 
 void bmp_destroy(bmp_hand_t *hand);
 
+/**
+ * @brief Make a band of rows available via bmp_get_row() and bmp_get_pixel()
+ *
+ * Loading a band invalidates previously returned row pointers. Bands should
+ * be loaded top to bottom, though a band may overlap the end of the one
+ * before it.
+ *
+ * @param hand BMP handle
+ * @param y First row of band (top = 0)
+ * @param rows Number of rows in band
+ * @return 0 on success, else < 0
+ */
+int bmp_load_band(bmp_hand_t *hand, uint32_t y, uint32_t rows);
+
+/**
+ * @brief Get raw pixel data for a single row
+ *
+ * @param hand BMP handle
+ * @param y Y position (top = 0), must be within the currently loaded band
+ * @return Pointer to row data, NULL if row is not loaded
+ */
+const uint8_t *bmp_get_row(const bmp_hand_t *hand, uint32_t y);
+
+/**
+ * @brief Check whether every pixel of a row is palette index 0, without looking at its pixels
+ *
+ * Only RLE compressed images record this, rows of other images are never
+ * reported as blank.
+ *
+ * @param hand BMP handle
+ * @param y Y position (top = 0)
+ * @return 1 if row is blank, else 0
+ */
+int bmp_row_blank(const bmp_hand_t *hand, uint32_t y);
+
 /**
  * @brief Get a single pixel from a bitmap image
  *
  * @param hand BMP handle
  * @param x X position (left = 0)
- * @param y Y position (top = 0)
- * @return < 0 on failure, palette index on success
+ * @param y Y position (top = 0), must be within the currently loaded band
+ * @return < 0 on failure, palette index (or 0xRRGGBB value for 24 and 32 bpp images) on success
+ */
+int bmp_get_pixel(const bmp_hand_t *hand, uint32_t x, uint32_t y);
+
+/**
+ * @brief Write an indexed image as an uncompressed BMP file
+ *
+ * Images with up to 16 colors are written as 4 bpp, otherwise as 8 bpp.
+ *
+ * @param fd File descriptor to write to
+ * @param data Pixel data, one palette index per byte, top row first
+ * @param width Image width, in pixels
+ * @param height Image height, in pixels
+ * @param palette Color palette
+ * @param n_colors Number of entries in palette (1-256)
+ * @return 0 on success, else < 0
  */
-int bmp_get_pixel(bmp_hand_t *hand, uint32_t x, uint32_t y);
+int bmp_write(int fd, const uint8_t *data, uint32_t width, uint32_t height,
+              const bmp_color_entry_t *palette, uint32_t n_colors);
 
 #endif
 
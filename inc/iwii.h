@@ -1,6 +1,10 @@
 #ifndef IWII_H
 #define IWII_H
 
+#include <stdint.h>
+
+#include "iwii_out.h"
+
 typedef enum iwii_font_enum {
     IWII_FONT_EXTENDED = 0,
     IWII_FONT_PICA,
@@ -32,6 +36,20 @@ typedef enum iwii_color_enum {
     IWII_COLOR_MAX    = 7
 } iwii_color_e;
 
+/**
+ * @brief Ribbon color bands
+ *
+ * Ordered as they are normally printed, starting with yellow following the
+ * recommendation from the manual to prevent staining the yellow band.
+ */
+typedef enum iwii_ribbon_enum {
+    IWII_RIBBON_YELLOW = 0,
+    IWII_RIBBON_RED,
+    IWII_RIBBON_BLUE,
+    IWII_RIBBON_BLACK,
+    IWII_RIBBON_MAX
+} iwii_ribbon_e;
+
 typedef enum iwii_flow_enum {
     IWII_FLOW_NONE = 0,
     IWII_FLOW_XONXOFF,
@@ -40,35 +58,74 @@ typedef enum iwii_flow_enum {
 
 int iwii_serial_init(int fd, iwii_flow_e flow, unsigned baud);
 
+/**
+ * @brief Get the number of argument bytes following `ESC <cmd>`
+ *
+ * Graphics data following the arguments of `ESC G`/`ESC g` is not included.
+ *
+ * @param cmd Command character
+ * @return Number of argument bytes, < 0 for `.`-terminated lists
+ */
+int iwii_esc_args(uint8_t cmd);
+
+/**
+ * @brief Forget everything known about the printer's state
+ *
+ * Must be called after writing anything directly to the stream that could
+ * change settings tracked by the functions below, so they are sent again.
+ *
+ * @param out Output stream
+ */
+void iwii_state_invalidate(iwii_out_t *out);
+
+/**
+ * @brief Return the head to the left margin, unless it is known to be there
+ *
+ * @param out Output stream
+ * @return 0 on success, else < 0
+ */
+int iwii_carriage_return(iwii_out_t *out);
+
 /**
  * @brief Set current font
  *
- * @param fd File descriptor to which to write escape codes
+ * @param out Output stream to which to write escape codes
  * @param font Font to use, @see iwii_font_e
  * @return 0 on success, else < 0
  */
-int iwii_set_font(int fd, unsigned font);
+int iwii_set_font(iwii_out_t *out, unsigned font);
 
-int iwii_set_quality(int fd, unsigned quality);
+int iwii_set_quality(iwii_out_t *out, unsigned quality);
 
-int iwii_set_color(int fd, unsigned color);
+int iwii_set_color(iwii_out_t *out, unsigned color);
 
-int iwii_set_ansicolor(int fd, unsigned color);
+int iwii_set_ansicolor(iwii_out_t *out, unsigned color);
 
-int iwii_set_tabs(int fd, unsigned tab_size, unsigned font);
+int iwii_set_tabs(iwii_out_t *out, unsigned tab_size, unsigned font);
 
-int iwii_set_lpi(int fd, unsigned lpi);
+int iwii_set_lpi(iwii_out_t *out, unsigned lpi);
 
-int iwii_set_line_spacing(int fd, unsigned line_spacing);
+int iwii_set_line_spacing(iwii_out_t *out, unsigned line_spacing);
 
 
-int iwii_set_left_margin(int fd, unsigned left_margin);
+int iwii_set_left_margin(iwii_out_t *out, unsigned left_margin);
 
-int iwii_set_pagelen(int fd, unsigned pagelen);
+int iwii_set_pagelen(iwii_out_t *out, unsigned pagelen);
 
-int iwii_set_prop_spacing(int fd, unsigned prop_spacing);
+int iwii_set_prop_spacing(iwii_out_t *out, unsigned prop_spacing);
 
-int iwii_move_up_lines(int fd, unsigned lines);
+/**
+ * @brief Move the paper by a distance, using as few line feeds as possible
+ *
+ * Line spacing is changed as needed, up to the longest the printer allows
+ * (ESC T99), and is left changed. Runs of line feeds are sent as a single
+ * command each.
+ *
+ * @param out Output stream
+ * @param dist Distance to move paper, in 144ths of an inch, negative to move it up (reverse feed)
+ * @return 0 on success, else < 0
+ */
+int iwii_feed(iwii_out_t *out, int dist);
 
 #endif
 
@@ -0,0 +1,65 @@
+#ifndef IWII_ENC_H
+#define IWII_ENC_H
+
+#include <stdint.h>
+
+#include "iwii_out.h"
+
+/**
+ * @brief Graphics encoding operation
+ */
+typedef struct {
+#define IWII_ENC_OP_RAW    (0) /**< Send columns as-is, `ESC G nnnn <data>` */
+#define IWII_ENC_OP_REPEAT (1) /**< Repeat a single column byte, `ESC V nnnn <byte>` */
+    uint8_t  op;    /**< Operation, IWII_ENC_OP_* */
+    uint8_t  val;   /**< Column byte to repeat, for IWII_ENC_OP_REPEAT */
+    uint16_t start; /**< First column covered by operation */
+    uint16_t len;   /**< Number of columns covered by operation */
+} iwii_enc_op_t;
+
+/**
+ * @brief Line encoder state
+ */
+typedef struct {
+    unsigned  width; /**< Maximum line width */
+    void     *runs;  /**< Scratch space for run detection and cost model */
+} iwii_enc_t;
+
+int iwii_enc_init(iwii_enc_t *enc, unsigned width);
+
+void iwii_enc_destroy(iwii_enc_t *enc);
+
+/**
+ * @brief Encode a single line of column bytes
+ *
+ * The line is split into runs of identical column bytes, each of which is
+ * either sent raw, sent using the repeat command, or skipped over entirely
+ * by repositioning the carriage (blank runs only). The combination that
+ * results in the fewest bytes sent is chosen.
+ *
+ * Operations that do not immediately follow the previous operation require
+ * the carriage to be repositioned.
+ *
+ * @param enc Encoder
+ * @param ops Where to store operations, must have room for (end - start) + 1 entries
+ * @param cols Column bytes
+ * @param start First non-empty column
+ * @param end Last non-empty column
+ * @return Number of operations
+ */
+unsigned iwii_enc_line(iwii_enc_t *enc, iwii_enc_op_t *ops, const uint8_t *cols, unsigned start, unsigned end);
+
+/**
+ * @brief Write out encoded line, in a single (pre-set) color
+ *
+ * @param out Output stream to write to
+ * @param ops Encoded operations
+ * @param n_ops Number of operations
+ * @param cols Column bytes the operations were encoded from
+ * @param h_pos Horizontal offset of column 0, in dots
+ * @return 0 on success, else < 0
+ */
+int iwii_enc_emit(iwii_out_t *out, const iwii_enc_op_t *ops, unsigned n_ops, const uint8_t *cols, unsigned h_pos);
+
+#endif
+
@@ -0,0 +1,138 @@
+#ifndef IWII_EST_H
+#define IWII_EST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "iwii.h"
+
+/** Head positions are tracked in 1440ths of an inch, divisible by most horizontal resolutions */
+#define IWII_EST_HEAD_UNITS (1440)
+
+/**
+ * @brief Print job statistics, gathered by parsing the command stream
+ */
+typedef struct {
+    uint64_t bytes;          /**< Total bytes sent */
+    uint64_t raw_runs;       /**< Number of `ESC G`/`ESC g` graphics runs */
+    uint64_t repeat_runs;    /**< Number of `ESC V` repeated columns */
+    uint64_t positions;      /**< Number of `ESC F` carriage positions */
+    uint64_t color_switches; /**< Number of color changes */
+    uint64_t line_feeds;     /**< Number of forward line feeds */
+    uint64_t reverse_feeds;  /**< Number of reverse line feeds */
+    uint64_t returns;        /**< Number of carriage returns */
+    uint64_t chars;          /**< Number of text characters */
+
+    uint64_t tx_us;          /**< Time spent sending data, in microseconds */
+    uint64_t mech_us;        /**< Time spent on mechanical operations, in microseconds */
+    uint64_t total_us;       /**< Estimated wall time, in microseconds */
+} iwii_est_stats_t;
+
+/**
+ * @brief Command held in the printer's input buffer
+ */
+typedef struct {
+    uint64_t end;  /**< Offset of the end of command in the stream */
+    uint64_t done; /**< Time at which command completes, in microseconds */
+} iwii_est_pend_t;
+
+struct iwii_est_struct;
+
+/**
+ * @brief Callback receiving each column of graphics data as it is printed
+ *
+ * @param arg Value of render_arg
+ * @param est Estimator, holding the current printer state (color, v_pos, h_dpi)
+ * @param x Horizontal position of column, in IWII_EST_HEAD_UNITS from the left margin
+ * @param col Column byte, bit n being the dot n/72 of an inch below v_pos
+ */
+typedef void (*iwii_est_render_t)(void *arg, const struct iwii_est_struct *est, uint64_t x, uint8_t col);
+
+/**
+ * @brief Callback receiving each command once it has been fully received
+ *
+ * @param arg Value of cmd_arg
+ * @param est Estimator, with the command already applied to its printer state
+ * @param hdr Command header: the command character(s) and arguments, not including graphics data or list contents
+ * @param len Length of hdr, in bytes
+ */
+typedef void (*iwii_est_cmd_t)(void *arg, const struct iwii_est_struct *est, const uint8_t *hdr, unsigned len);
+
+/**
+ * @brief Print time estimator
+ */
+typedef struct iwii_est_struct {
+    unsigned         flow;      /**< Flow control method, @see iwii_flow_e */
+    unsigned         baud;      /**< Baud rate of serial link */
+
+    /* Command parser */
+    uint8_t          hdr[8];    /**< Command header collected so far */
+    unsigned         hdr_len;   /**< Number of bytes in hdr */
+    unsigned         hdr_need;  /**< Number of header bytes required by current command */
+    unsigned         data;      /**< Number of data bytes remaining in current command */
+    int              in_list;   /**< Currently within a `.`-terminated list */
+    unsigned         cmd_len;   /**< Total length of current command, in bytes */
+    unsigned         data_col;  /**< Number of data bytes of current command already received */
+
+    /* Printer state */
+    unsigned         h_dpi;     /**< Horizontal resolution of current font */
+    unsigned         quality;   /**< Current print quality, @see iwii_quality_e */
+    unsigned         color;     /**< Current color, @see iwii_color_e */
+    unsigned         spacing;   /**< Current line spacing, in 144ths of an inch */
+    int              reverse;   /**< Line feeds are currently reversed */
+    int              last_dir;  /**< Direction of last paper feed, < 0 if none yet */
+    uint64_t         head;      /**< Print head position, in IWII_EST_HEAD_UNITS */
+    int64_t          v_pos;     /**< Paper position, in 144ths of an inch below where it started */
+
+    /* Printer input buffer model */
+    uint64_t         tx_time;   /**< Time at which the last byte was sent */
+    uint64_t         busy_time; /**< Time at which the printer finishes its last command */
+    uint64_t         offset;    /**< Offset of the end of the last command in the stream */
+    iwii_est_pend_t *pending;   /**< Commands that may still be held in the printer's buffer */
+    unsigned         pend_head; /**< Oldest entry in pending */
+    unsigned         pend_cnt;  /**< Number of entries in pending */
+
+    iwii_est_stats_t stats;     /**< Statistics gathered so far */
+
+    iwii_est_render_t render;     /**< Optional callback receiving graphics data, may be set after init */
+    void             *render_arg; /**< Argument passed to render */
+
+    iwii_est_cmd_t    cmd;        /**< Optional callback receiving each command, may be set after init */
+    void             *cmd_arg;    /**< Argument passed to cmd */
+} iwii_est_t;
+
+/**
+ * @brief Initialize estimator
+ *
+ * @param est Estimator
+ * @param baud Baud rate of serial link
+ * @param flow Flow control method, @see iwii_flow_e
+ * @return 0 on success, else < 0
+ */
+int iwii_est_init(iwii_est_t *est, unsigned baud, unsigned flow);
+
+void iwii_est_destroy(iwii_est_t *est);
+
+/**
+ * @brief Feed part of the command stream through the estimator
+ *
+ * Matches iwii_out_sink_t, so it can be used directly as an output sink.
+ *
+ * @param arg Estimator
+ * @param data Command stream data
+ * @param len Length of data, in bytes
+ * @return 0 on success, else < 0
+ */
+int iwii_est_feed(void *arg, const void *data, size_t len);
+
+/**
+ * @brief Write a summary of the estimate
+ *
+ * @param est Estimator
+ * @param file File to write to
+ */
+void iwii_est_report(const iwii_est_t *est, FILE *file);
+
+#endif
+
@@ -3,29 +3,48 @@
 
 #include <stdint.h>
 
+#include "iwii.h"
+#include "iwii_out.h"
+
+/** Ribbons needed to print each color (bit n for iwii_ribbon_e n), with IWII_COLOR_MAX being white */
+extern const uint8_t iwii_gfx_color_ribbons[IWII_COLOR_MAX + 1];
+
+/** RGB value of each color, as found in images/palette.bmp, with IWII_COLOR_MAX being white */
+extern const uint32_t iwii_gfx_color_rgb[IWII_COLOR_MAX + 1];
+
+/** Largest horizontal offset plus width of graphics, in dots, as positions are sent as 4 digits */
+#define IWII_GFX_MAX_DOTS (9999)
+
 /**
  * @brief IWII graphics parameters/config
  */
 typedef struct {
 #define IWII_GFX_FLAG_RETURNTOTOP (1UL << 0) /**< Return to top of image after printing */
 #define IWII_GFX_FLAG_SEQCOLORS   (1UL << 1) /**< Print entire image one color at a time */
+#define IWII_GFX_FLAG_RELAXYELLOW (1UL << 2) /**< Only print yellow first in bands where it touches other inks, freeing the pass order elsewhere */
     uint16_t flags; /**< Flags */
     uint8_t  h_dpi; /**< Horizontal dots per inch */
     uint8_t  v_dpi; /**< Vertical dots per inch */
     unsigned h_pos; /**< Horizontal position/offset from left margin */
+    uint8_t  dither; /**< Dithering used for colors that cannot be printed directly, @see iwii_dither_e */
+    unsigned width;  /**< Width to print images at, in dots, 0 for the image's own width (or to keep aspect ratio) */
+    unsigned height; /**< Height to print images at, in dots, 0 for the image's own height (or to keep aspect ratio) */
+    uint8_t  resample; /**< Resampling kernel used to scale images, @see iwii_resample_e */
+    uint8_t  verbose; /**< Verbosity, reporting ribbon usage and how images are printed to stderr */
+    uint8_t  threads; /**< Number of threads converting images, 0 to pick based on the number of CPUs */
 } iwii_gfx_params_t;
 
 /**
  * @brief Initialize graphics portion of IWII driver
  *
- * @param fd File descriptor to write to
+ * @param out Output stream to write to
  * @param params 
  * @param h_dpi Desired horizontal DPI (72, 80, 96, 107, 120, 136, 144, or 160)
  * @param v_dpi Desired vertical DPI (72 or 144)
  *
  * @return 0 on success, else < 0
  */
-int iwii_gfx_init(int fd, const iwii_gfx_params_t *params);
+int iwii_gfx_init(iwii_out_t *out, const iwii_gfx_params_t *params);
 
 /**
  * @brief Print an image
@@ -33,35 +52,40 @@ int iwii_gfx_init(int fd, const iwii_gfx_params_t *params);
  * Image data must ordered column then row, and each byte will contain a single
  * pixel who's value matches an available ImageWriter II color. @see iwii_color_e
  *
- * @param fd File descriptor to write to
+ * @param out Output stream to write to
  * @param data Pointer to image data
  * @param width Width of image in pixels
  * @param height Height of image in pixels
  *
  * @return 0 on success, else < 0
  */
-int iwii_gfx_print_image(int fd, const uint8_t *data, unsigned width, unsigned height);
+int iwii_gfx_print_image(iwii_out_t *out, const uint8_t *data, unsigned width, unsigned height);
 
 /**
- * @brief Print an image from a BMP file
+ * @brief Print an image from a BMP (or Netpbm) file
+ *
+ * Images may be uncompressed, or RLE8/RLE4 compressed. Indexed images drawn
+ * only in the 8 printable colors are printed as-is, anything else (including
+ * 24 and 32 bpp images) is first quantized to those colors, @see iwii_quant_t
  *
- * Image can only use the 8 allowed colors, and must not use compression
+ * If a width or height is set in the parameters, the image is resampled to
+ * it one band at a time as it is printed, @see iwii_scale_t
  *
- * @param fd File descriptor to write to
+ * @param out Output stream to write to
  * @param bmp_fd File descriptor of BMP image
  *
  * @return 0 on success, else < 0
  */
-int iwii_gfx_print_bmp(int fd, int bmp_fd);
+int iwii_gfx_print_bmp(iwii_out_t *out, int bmp_fd);
 
 /**
  * @brief Prints small test image (8x8 color pattern)
  *
- * @param fd File descriptor to write to
+ * @param out Output stream to write to
  *
  * @return 0 on success, else < 0
  */
-int iwii_gfx_test(int fd);
+int iwii_gfx_test(iwii_out_t *out);
 
 #endif
 
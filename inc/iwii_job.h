@@ -0,0 +1,60 @@
+#ifndef IWII_JOB_H
+#define IWII_JOB_H
+
+#include <stdint.h>
+
+/*
+ * Jobs are submitted to iwiid over a Unix domain socket. The client sends an
+ * iwii_job_header_t followed by the printer data, then shuts down its side of
+ * the connection. Once the whole job has been received and queued, iwiid
+ * answers with an iwii_job_reply_t.
+ */
+
+#define IWII_JOB_MAGIC            (0x4a574949UL) /**< Job header signature, "IIWJ" */
+#define IWII_JOB_VERSION          (1)            /**< Job protocol version */
+#define IWII_JOB_PRIORITY_DEFAULT (5)            /**< Priority of jobs unless otherwise specified */
+#define IWII_JOB_PRIORITY_MAX     (9)            /**< Highest priority, printed before all others */
+
+typedef struct {
+    uint32_t magic;    /**< IWII_JOB_MAGIC */
+    uint16_t version;  /**< IWII_JOB_VERSION */
+    uint8_t  priority; /**< Jobs with higher priority are printed first, FIFO within the same priority */
+    uint8_t  flags;    /**< Reserved, must be 0 */
+} iwii_job_header_t;
+
+typedef struct {
+    int32_t  status;   /**< 0 if job was queued, else < 0 */
+    uint32_t id;       /**< ID assigned to job */
+} iwii_job_reply_t;
+
+/**
+ * @brief Get the default path of the iwiid socket
+ *
+ * Uses $IWII_SOCKET if set, otherwise $XDG_RUNTIME_DIR/iwiid.sock or
+ * /tmp/iwiid-<uid>.sock.
+ *
+ * @return Newly allocated path, NULL on failure
+ */
+char *iwii_job_socket_path(void);
+
+/**
+ * @brief Connect to iwiid and start submitting a job
+ *
+ * The returned socket can be written to like the printer's serial port.
+ *
+ * @param path Path of iwiid socket, NULL for default
+ * @param priority Priority of job, 0 to IWII_JOB_PRIORITY_MAX
+ * @return Socket file descriptor, < 0 on error
+ */
+int iwii_job_connect(const char *path, unsigned priority);
+
+/**
+ * @brief Finish submitting a job, and wait for it to be queued
+ *
+ * @param fd Socket returned by iwii_job_connect(), remains open
+ * @param id Where to store the ID assigned to the job, may be NULL
+ * @return 0 on success, else < 0
+ */
+int iwii_job_finish(int fd, uint32_t *id);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef IWII_MODEL_H
+#define IWII_MODEL_H
+
+/*
+ * Rough mechanical timing model of the ImageWriter II, in microseconds.
+ *
+ * These are estimates rather than measured figures, they are only intended
+ * to be good enough to compare one way of printing something against
+ * another.
+ */
+
+#define IWII_MODEL_SLEW_US_PER_INCH  (40000) /**< Carriage travel, ~25 inches per second */
+#define IWII_MODEL_MOVE_US           (20000) /**< Carriage start/stop overhead, for each move */
+#define IWII_MODEL_SHIFT_US         (150000) /**< Fixed cost of a ribbon shift */
+#define IWII_MODEL_SHIFT_STEP_US     (50000) /**< Ribbon shift, for each color band traversed */
+#define IWII_MODEL_FEED_US           (30000) /**< Paper feed start/stop overhead, for each line feed */
+#define IWII_MODEL_FEED_US_PER_INCH (300000) /**< Paper feed, ~3.3 inches per second */
+#define IWII_MODEL_REVERSE_US        (50000) /**< Additional overhead when changing paper feed direction */
+
+#define IWII_MODEL_PRINT_US_PER_INCH (50000) /**< Carriage travel while printing graphics, ~20 inches per second */
+#define IWII_MODEL_CHAR_US_DRAFT      (4000) /**< Time to print a character in draft quality, 250 cps */
+#define IWII_MODEL_CHAR_US_STANDARD   (5556) /**< Time to print a character in standard quality, 180 cps */
+#define IWII_MODEL_CHAR_US_NLQ       (22222) /**< Time to print a character in near letter quality, 45 cps */
+
+#define IWII_MODEL_BUFFER_SZ          (2048) /**< Size of the printer's input buffer, in bytes */
+
+#endif
+
@@ -0,0 +1,213 @@
+#ifndef IWII_OUT_H
+#define IWII_OUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IWII_OUT_DEFAULT_SZ   (4096) /**< Default output buffer size, in bytes */
+#define IWII_OUT_DEFAULT_BUFS (32)   /**< Default number of buffers in writer thread's ring */
+
+struct iwii_out_pipe_struct;
+
+/**
+ * @brief Output sink, receiving data in place of the file descriptor
+ *
+ * @param arg Argument supplied to iwii_out_init_sink()
+ * @param data Data to consume
+ * @param len Length of data, in bytes
+ * @return 0 on success, else < 0
+ */
+typedef int (*iwii_out_sink_t)(void *arg, const void *data, size_t len);
+
+/**
+ * @brief Callback marking the end of each unit of output, @see iwii_out_yield
+ *
+ * @param arg Value of mark_arg
+ * @param pos Position in the stream at the end of the unit, @see iwii_out_tell
+ */
+typedef void (*iwii_out_mark_t)(void *arg, uint64_t pos);
+
+/**
+ * @brief Printer settings tracked in iwii_out_state_t
+ */
+typedef enum iwii_setting_enum {
+    IWII_SETTING_FONT = 0,     /**< Font, @see iwii_font_e */
+    IWII_SETTING_QUALITY,      /**< Print quality, @see iwii_quality_e */
+    IWII_SETTING_COLOR,        /**< Color, @see iwii_color_e */
+    IWII_SETTING_SPACING,      /**< Line spacing, in 144ths of an inch */
+    IWII_SETTING_LEFT_MARGIN,  /**< Left margin */
+    IWII_SETTING_PAGELEN,      /**< Page length */
+    IWII_SETTING_PROP_SPACING, /**< Proportional character spacing */
+    IWII_SETTING_MAX
+} iwii_setting_e;
+
+/**
+ * @brief Known state of the printer, as left by the stream so far
+ *
+ * Maintained by the iwii.c command functions, which skip commands that would
+ * not change anything. Data written directly is not looked at, so anything
+ * that may change tracked settings behind their back must be followed by
+ * iwii_state_invalidate().
+ */
+typedef struct {
+    unsigned known;                      /**< Bit n set if values[n] holds setting n, @see iwii_setting_e */
+    unsigned values[IWII_SETTING_MAX];   /**< Value of each known setting */
+    int      at_margin;                  /**< Head was at the left margin at margin_pos */
+    uint64_t margin_pos;                 /**< Stream position up to which the head is known to be at the left margin */
+} iwii_out_state_t;
+
+/**
+ * @brief Buffered output stream
+ *
+ * All escape codes and graphics data are appended to this buffer, which is
+ * only written out to the underlying file descriptor once full, or when
+ * explicitly flushed.
+ */
+typedef struct {
+    int             fd;       /**< File descriptor to flush to */
+    iwii_out_sink_t sink;     /**< If set, data is passed to this rather than written to fd */
+    void           *sink_arg; /**< Argument passed to sink */
+    uint8_t        *buf;      /**< Output buffer */
+    size_t          sz;       /**< Size of output buffer, in bytes */
+    size_t          len;      /**< Number of bytes currently held in buffer */
+    int             err;      /**< Set once a write fails, all further writes are dropped */
+    uint64_t        flushed;  /**< Number of bytes passed on from the buffer so far */
+
+    iwii_out_mark_t mark;     /**< Optional callback for iwii_out_yield(), may be set after init */
+    void           *mark_arg; /**< Argument passed to mark */
+    iwii_out_sink_t tee;      /**< Optional sink also receiving a copy of all data as it is flushed, may be set after init */
+    void           *tee_arg;  /**< Argument passed to tee */
+
+    iwii_out_state_t state;   /**< Known printer state, @see iwii_out_state_t */
+
+    struct iwii_out_pipe_struct *pipe; /**< Writer thread, if started, @see iwii_out_start_writer */
+} iwii_out_t;
+
+/**
+ * @brief Initialize output stream
+ *
+ * @param out Output stream
+ * @param fd File descriptor to flush to
+ * @param sz Size of buffer to allocate, 0 to use IWII_OUT_DEFAULT_SZ
+ * @return 0 on success, else < 0
+ */
+int iwii_out_init(iwii_out_t *out, int fd, size_t sz);
+
+/**
+ * @brief Initialize output stream that passes its data to a sink rather than a file descriptor
+ *
+ * @param out Output stream
+ * @param sink Function receiving data as it is flushed
+ * @param arg Argument to pass to sink
+ * @param sz Size of buffer to allocate, 0 to use IWII_OUT_DEFAULT_SZ
+ * @return 0 on success, else < 0
+ */
+int iwii_out_init_sink(iwii_out_t *out, iwii_out_sink_t sink, void *arg, size_t sz);
+
+/**
+ * @brief Hand output off to a dedicated writer thread
+ *
+ * The output buffer becomes one of a bounded ring of buffers. Each flush
+ * queues the current buffer for the writer thread and carries on filling the
+ * next free one, only blocking once every buffer is queued. This lets data
+ * be produced while previously produced data is still being sent.
+ *
+ * Backpressure comes from the writer's blocking writes: XON/XOFF or RTS/CTS
+ * flow control is handled by the terminal driver, which stops accepting data
+ * while the printer is busy. The writer then blocks, the ring fills up, and
+ * the producer waits in turn. The file status flags, which may be shared
+ * with stderr and the shell, are left untouched.
+ *
+ * @param out Output stream, must not have any data buffered
+ * @param n_bufs Number of buffers in ring (at least 2), 0 to use IWII_OUT_DEFAULT_BUFS
+ * @return 0 on success, else < 0
+ */
+int iwii_out_start_writer(iwii_out_t *out, unsigned n_bufs);
+
+/**
+ * @brief Flush, then free resources used by output stream
+ *
+ * Waits for the writer thread, if any, to send all queued data.
+ *
+ * @note This does not close the underlying file descriptor
+ *
+ * @param out Output stream
+ * @return 0 if all data was successfully written, else < 0
+ */
+int iwii_out_destroy(iwii_out_t *out);
+
+/**
+ * @brief Write all buffered data to the underlying file descriptor
+ *
+ * With a writer thread, data is instead queued for the writer, which may not
+ * have sent it yet when this returns.
+ *
+ * @param out Output stream
+ * @return 0 on success, else < 0
+ */
+int iwii_out_flush(iwii_out_t *out);
+
+/**
+ * @brief Get the number of bytes written to the stream so far, including those still buffered
+ *
+ * @param out Output stream
+ * @return Position in stream
+ */
+uint64_t iwii_out_tell(const iwii_out_t *out);
+
+/**
+ * @brief Mark the end of a unit of output, such as a band of graphics
+ *
+ * The mark callback, if set, is called with the current position.
+ *
+ * If a writer thread is running, buffered data is passed on so it can be
+ * sent right away. Otherwise, data stays buffered until the buffer is full.
+ *
+ * @param out Output stream
+ * @return 0 on success, else < 0
+ */
+int iwii_out_yield(iwii_out_t *out);
+
+/**
+ * @brief Append data to the output stream
+ *
+ * Data that would not fit in the buffer is written out along with the
+ * buffered data in a single writev() call, rather than being copied.
+ *
+ * @param out Output stream
+ * @param data Data to write
+ * @param len Length of data, in bytes
+ * @return 0 on success, else < 0
+ */
+int iwii_out_write(iwii_out_t *out, const void *data, size_t len);
+
+int iwii_out_putc(iwii_out_t *out, char c);
+
+int iwii_out_puts(iwii_out_t *out, const char *str);
+
+/**
+ * @brief Append a zero-padded, fixed-width decimal number
+ *
+ * A value that does not fit in the number of digits is an error, failing
+ * the stream, rather than being truncated.
+ *
+ * @param out Output stream
+ * @param val Value to write
+ * @param digits Number of digits to write (1-10)
+ * @return 0 on success, else < 0
+ */
+int iwii_out_dec(iwii_out_t *out, unsigned val, unsigned digits);
+
+/**
+ * @brief Append an escape code with a fixed-width decimal argument, `ESC <cmd> <val>`
+ *
+ * @param out Output stream
+ * @param cmd Command character following ESC
+ * @param val Numeric argument
+ * @param digits Number of digits in argument
+ * @return 0 on success, else < 0
+ */
+int iwii_out_cmd(iwii_out_t *out, char cmd, unsigned val, unsigned digits);
+
+#endif
+
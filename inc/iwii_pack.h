@@ -0,0 +1,30 @@
+#ifndef IWII_PACK_H
+#define IWII_PACK_H
+
+#include <stdint.h>
+
+#include "iwii.h"
+
+/**
+ * @brief Transpose rows of ribbon masks into per-ribbon column bytes
+ *
+ * Each input byte holds one pixel's ribbon mask (bit n set if ribbon n is
+ * required, @see iwii_ribbon_e). Row n ends up in bit n of each column byte.
+ *
+ * Uses the widest vector unit available at runtime (AVX2 or SSE2 on x86,
+ * NEON on ARM), falling back to a portable implementation. Setting the
+ * environment variable IWII_NO_SIMD forces the portable implementation.
+ * Safe to call from several threads at once.
+ *
+ * @param cols Column bytes for each ribbon, each at least width bytes
+ * @param start First non-empty column for each ribbon, < 0 if ribbon is unused
+ * @param end Last non-empty column for each ribbon
+ * @param rows Pointer to each row of ribbon masks
+ * @param nrows Number of rows, at most 8
+ * @param width Number of columns
+ */
+void iwii_pack_columns(uint8_t *const cols[IWII_RIBBON_MAX], int start[IWII_RIBBON_MAX], int end[IWII_RIBBON_MAX],
+                       const uint8_t *const rows[], unsigned nrows, unsigned width);
+
+#endif
+
@@ -0,0 +1,83 @@
+#ifndef IWII_QUANT_H
+#define IWII_QUANT_H
+
+#include <stdint.h>
+
+#define IWII_QUANT_MAX_COLORS (16) /**< Maximum number of palette entries */
+
+struct iwii_quant_pool_struct;
+
+/**
+ * @brief Dithering methods
+ */
+typedef enum iwii_dither_enum {
+    IWII_DITHER_FS = 0,  /**< Floyd-Steinberg error diffusion */
+    IWII_DITHER_ORDERED, /**< Ordered dithering, using an 8x8 Bayer matrix */
+    IWII_DITHER_NONE,    /**< Nearest color only */
+    IWII_DITHER_MAX
+} iwii_dither_e;
+
+/**
+ * @brief Color quantizer, reducing rows of RGB pixels to palette indexes
+ *
+ * Rows are fed in order, one band at a time, and Floyd-Steinberg error is
+ * carried from one band to the next. Error diffusion within a band is split
+ * across worker threads as a wavefront: each row trails the row above it by
+ * a few pixels, which is all the error it needs from it.
+ */
+typedef struct {
+    iwii_dither_e dither;      /**< Dithering method */
+    unsigned      width;       /**< Row width, in pixels */
+    unsigned      px_sz;       /**< Size of input pixels, in bytes (3 for BGR, 4 for BGRX) */
+    unsigned      y;           /**< Number of rows quantized since init or reset */
+
+    int32_t       pal[IWII_QUANT_MAX_COLORS][4]; /**< Palette, as blue, green, red, 0 */
+    uint8_t      *lut;         /**< Nearest palette entry, indexed by 5 bits each of red, green, and blue */
+
+    int32_t      *err;         /**< Error diffused into each row of the band, and the row following it */
+    unsigned      err_rows;    /**< Number of rows allocated in err */
+    unsigned     *progress;    /**< Number of pixels completed in each row of the band */
+
+    struct iwii_quant_pool_struct *pool; /**< Worker threads, NULL if quantizing on the calling thread only */
+} iwii_quant_t;
+
+/**
+ * @brief Initialize a quantizer
+ *
+ * @param quant Quantizer
+ * @param palette Palette, as 0xRRGGBB values
+ * @param n_colors Number of palette entries, at most IWII_QUANT_MAX_COLORS
+ * @param dither Dithering method
+ * @param width Row width, in pixels
+ * @param px_sz Size of input pixels, in bytes, 3 (BGR) or 4 (BGRX)
+ * @param threads Number of threads to use, 0 to pick based on the number of CPUs
+ * @return 0 on success, else < 0
+ */
+int iwii_quant_init(iwii_quant_t *quant, const uint32_t *palette, unsigned n_colors,
+                    iwii_dither_e dither, unsigned width, unsigned px_sz, unsigned threads);
+
+/**
+ * @brief Stop worker threads and free quantizer
+ */
+void iwii_quant_destroy(iwii_quant_t *quant);
+
+/**
+ * @brief Quantize the next band of rows
+ *
+ * @param quant Quantizer
+ * @param rows Pointer to each row of input pixels
+ * @param n_rows Number of rows
+ * @param dst Output buffer, receiving n_rows * width palette indexes
+ * @return 0 on success, else < 0
+ */
+int iwii_quant_band(iwii_quant_t *quant, const uint8_t *const rows[], unsigned n_rows, uint8_t *dst);
+
+/**
+ * @brief Parse the name of a dithering method
+ *
+ * @param name "fs" (or "floyd-steinberg"), "ordered", or "none"
+ * @return Dithering method, < 0 if not recognized
+ */
+int iwii_quant_parse_dither(const char *name);
+
+#endif
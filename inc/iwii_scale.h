@@ -0,0 +1,101 @@
+#ifndef IWII_SCALE_H
+#define IWII_SCALE_H
+
+#include <stdint.h>
+
+/**
+ * @brief Resampling kernels
+ */
+typedef enum iwii_resample_enum {
+    IWII_RESAMPLE_NEAREST = 0, /**< Nearest source pixel, works on indexed or ribbon mask data as-is */
+    IWII_RESAMPLE_BOX,         /**< Average of the source pixels covered, on BGR(X) pixels only */
+    IWII_RESAMPLE_MAX
+} iwii_resample_e;
+
+/**
+ * @brief Image scaler, resampling one output row at a time
+ *
+ * Nothing but per-column lookup tables and a single row of accumulators are
+ * kept, rows are pulled from the source as they are needed. Source rows for
+ * consecutive output rows never go backwards, so a top-down stream is enough.
+ */
+typedef struct {
+    iwii_resample_e kernel;    /**< Resampling kernel */
+    unsigned        src_w;     /**< Source width, in pixels */
+    unsigned        src_h;     /**< Source height, in pixels */
+    unsigned        dst_w;     /**< Output width, in pixels */
+    unsigned        dst_h;     /**< Output height, in pixels */
+
+    uint32_t       *x0;        /**< Source column sampled by (nearest), or first covered by (box), each output column */
+    uint32_t       *x1;        /**< One past the last source column covered by each output column (box) */
+    uint64_t       *inv;       /**< Reciprocal of twice the number of source pixels covered, as 0.48 fixed-point, 0 to divide (box) */
+    unsigned        inv_rows;  /**< Number of source rows inv was computed for (box) */
+    uint64_t       *sums;      /**< Blue, green, and red sums of each output column (box) */
+    unsigned        n_rows;    /**< Number of rows summed so far (box) */
+} iwii_scale_t;
+
+/**
+ * @brief Initialize a scaler
+ *
+ * @param scale Scaler
+ * @param kernel Resampling kernel
+ * @param src_w Source width
+ * @param src_h Source height
+ * @param dst_w Output width
+ * @param dst_h Output height
+ * @return 0 on success, else < 0
+ */
+int iwii_scale_init(iwii_scale_t *scale, iwii_resample_e kernel,
+                    unsigned src_w, unsigned src_h, unsigned dst_w, unsigned dst_h);
+
+/**
+ * @brief Free scaler
+ */
+void iwii_scale_destroy(iwii_scale_t *scale);
+
+/**
+ * @brief Get the source rows an output row is made from
+ *
+ * @param scale Scaler
+ * @param y Output row
+ * @param end Receives one past the last source row, the first being returned
+ * @return First source row
+ */
+unsigned iwii_scale_src_rows(const iwii_scale_t *scale, unsigned y, unsigned *end);
+
+/**
+ * @brief Resample a source row to an output row, picking the nearest pixels
+ *
+ * @param scale Scaler
+ * @param dst Output row, dst_w pixels
+ * @param src Source row, src_w pixels
+ * @param px_sz Size of pixels, in bytes (1, 3, or 4)
+ */
+void iwii_scale_row(const iwii_scale_t *scale, uint8_t *dst, const uint8_t *src, unsigned px_sz);
+
+/**
+ * @brief Add a source row to the output row being averaged
+ *
+ * @param scale Scaler
+ * @param src Source row, src_w pixels
+ * @param px_sz Size of pixels, in bytes (3 for BGR, 4 for BGRX)
+ */
+void iwii_scale_box_add(iwii_scale_t *scale, const uint8_t *src, unsigned px_sz);
+
+/**
+ * @brief Write out the average of the rows added, and start the next output row
+ *
+ * @param scale Scaler
+ * @param dst Output row, receiving dst_w BGR pixels
+ */
+void iwii_scale_box_finish(iwii_scale_t *scale, uint8_t *dst);
+
+/**
+ * @brief Parse the name of a resampling kernel
+ *
+ * @param name "nearest" or "box"
+ * @return Resampling kernel, < 0 if not recognized
+ */
+int iwii_scale_parse_kernel(const char *name);
+
+#endif
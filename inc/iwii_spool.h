@@ -0,0 +1,182 @@
+#ifndef IWII_SPOOL_H
+#define IWII_SPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "iwii_gfx.h"
+#include "iwii_out.h"
+
+/*
+ * Spool files hold a compiled print job: the exact byte stream to send to
+ * the printer, along with the parameters it was built with and an index of
+ * where each band ends. They are laid out as:
+ *
+ *   [iwii_spool_header_t][printer data][band index, n_bands x uint64_t]
+ *
+ * All values are stored in host byte order, spool files are not meant to be
+ * moved between machines.
+ */
+
+#define IWII_SPOOL_MAGIC    "IWIISPL"      /**< Spool file signature, including the terminating NUL */
+#define IWII_SPOOL_VERSION  (1)            /**< Spool file format version */
+#define IWII_SPOOL_EXT      ".iws"         /**< Extension of spool files in the cache */
+#define IWII_SPOOL_CACHE_SZ (256ULL << 20) /**< Size the cache is trimmed down to, in bytes */
+#define IWII_SPOOL_TMP_AGE  (3600)         /**< Age past which temporary spool files are taken to be abandoned, in seconds */
+
+#pragma pack(push)
+#pragma pack(1)
+
+typedef struct {
+    char     magic[8];  /**< IWII_SPOOL_MAGIC */
+    uint32_t version;   /**< IWII_SPOOL_VERSION */
+    uint32_t n_bands;   /**< Number of entries in band index */
+    uint64_t key;       /**< Cache key the job was built from, @see iwii_spool_key */
+    uint64_t data_off;  /**< Offset of printer data */
+    uint64_t data_len;  /**< Length of printer data, in bytes */
+    uint64_t index_off; /**< Offset of band index */
+    uint16_t flags;     /**< iwii_gfx_params_t flags */
+    uint8_t  h_dpi;     /**< iwii_gfx_params_t horizontal DPI */
+    uint8_t  v_dpi;     /**< iwii_gfx_params_t vertical DPI */
+    uint32_t h_pos;     /**< iwii_gfx_params_t horizontal offset */
+} iwii_spool_header_t;
+
+#pragma pack(pop)
+
+/**
+ * @brief Spool file being written
+ */
+typedef struct {
+    int       fd;        /**< Temporary file being written */
+    char     *path;      /**< Final path of spool file */
+    char     *tmp_path;  /**< Path of temporary file, renamed to path once complete */
+    uint64_t  len;       /**< Number of data bytes written so far */
+    uint64_t *bands;     /**< End of each band, relative to start of data */
+    unsigned  n_bands;   /**< Number of bands */
+    unsigned  cap;       /**< Number of entries allocated in bands */
+    int       err;       /**< Set once anything fails */
+} iwii_spool_writer_t;
+
+/**
+ * @brief Spool file opened for replay
+ */
+typedef struct {
+    const iwii_spool_header_t *head;  /**< Header */
+    const uint8_t             *data;  /**< Printer data */
+    const uint64_t            *bands; /**< Band index */
+
+    void                      *map;    /**< Mapping of entire file */
+    size_t                     map_sz; /**< Size of mapping, in bytes */
+} iwii_spool_t;
+
+/**
+ * @brief Compute the cache key of a job
+ *
+ * The key covers the input image, the parameters, and the build of the tool,
+ * identified by a hash of the running executable, so output from any other
+ * build is never replayed.
+ *
+ * @param data Input image
+ * @param len Length of input image, in bytes
+ * @param params Graphics parameters
+ * @param key Receives key
+ * @return 0 on success, < 0 if the build cannot be identified
+ */
+int iwii_spool_key(const void *data, size_t len, const iwii_gfx_params_t *params, uint64_t *key);
+
+/**
+ * @brief Find the directory to cache spool files in, creating it if needed
+ *
+ * Uses $IWII_CACHE_DIR if set, otherwise $XDG_CACHE_HOME/iwiitool or
+ * $HOME/.cache/iwiitool.
+ *
+ * @return Newly allocated path, NULL if no cache directory is available
+ */
+char *iwii_spool_cache_dir(void);
+
+/**
+ * @brief Build the path of a cached spool file
+ *
+ * @param dir Cache directory
+ * @param key Cache key
+ * @return Newly allocated path, NULL on failure
+ */
+char *iwii_spool_cache_path(const char *dir, uint64_t key);
+
+/**
+ * @brief Delete the least recently used spool files in a cache directory, until it is small enough
+ *
+ * Cached jobs are taken to be used when last modified, so should be touched
+ * whenever they are replayed. Abandoned temporary files are deleted too.
+ *
+ * @param dir Cache directory
+ * @param max_sz Total size of spool files to keep, in bytes
+ */
+void iwii_spool_trim(const char *dir, uint64_t max_sz);
+
+/**
+ * @brief Start writing a spool file
+ *
+ * Data is written to a temporary file next to path, which only replaces path
+ * once iwii_spool_finish() succeeds.
+ *
+ * @param wr Spool writer
+ * @param path Path of spool file
+ * @return 0 on success, else < 0
+ */
+int iwii_spool_create(iwii_spool_writer_t *wr, const char *path);
+
+/**
+ * @brief Append printer data to spool, @see iwii_out_sink_t
+ */
+int iwii_spool_sink(void *arg, const void *data, size_t len);
+
+/**
+ * @brief Record the end of a band, @see iwii_out_mark_t
+ */
+void iwii_spool_mark(void *arg, uint64_t pos);
+
+/**
+ * @brief Write out header and band index, and move spool file into place
+ *
+ * @param wr Spool writer
+ * @param key Cache key of job
+ * @param params Parameters job was built with
+ * @return 0 on success, else < 0
+ */
+int iwii_spool_finish(iwii_spool_writer_t *wr, uint64_t key, const iwii_gfx_params_t *params);
+
+/**
+ * @brief Free spool writer, removing the temporary file if not finished
+ */
+void iwii_spool_destroy(iwii_spool_writer_t *wr);
+
+/**
+ * @brief Check whether a buffer starts with a spool header
+ */
+int iwii_spool_detect(const void *data, size_t len);
+
+/**
+ * @brief Map and validate a spool file
+ *
+ * @param spool Spool
+ * @param fd File descriptor of spool file
+ * @return 0 on success, else < 0
+ */
+int iwii_spool_open(iwii_spool_t *spool, int fd);
+
+void iwii_spool_close(iwii_spool_t *spool);
+
+/**
+ * @brief Send a spool file's printer data, straight from the mapping
+ *
+ * Data is sent one band at a time, yielding the output stream after each.
+ *
+ * @param spool Spool
+ * @param out Output stream to write to
+ * @return 0 on success, else < 0
+ */
+int iwii_spool_replay(const iwii_spool_t *spool, iwii_out_t *out);
+
+#endif
+
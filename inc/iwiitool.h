@@ -5,5 +5,9 @@ int ansi2iwii(int argc, char **argv);
 
 int iwiigfx(int argc, char **argv);
 
+int iwiiemu(int argc, char **argv);
+
+int iwiid(int argc, char **argv);
+
 #endif
 
@@ -0,0 +1,46 @@
+#ifndef PNM_H
+#define PNM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bmp.h"
+
+struct pnm_reader_struct;
+
+/**
+ * @brief Check whether the start of a file is a Netpbm signature (P1 to P7)
+ *
+ * @param magic First two bytes of file
+ */
+int pnm_detect(const uint8_t *magic);
+
+/**
+ * @brief Read a Netpbm (PBM, PGM, PPM, or PAM) header, and prepare to read rows
+ *
+ * The image is presented through the BMP handle as if it were an equivalent
+ * top-down BMP: PBM as 1 bpp black and white, PGM and grayscale PAM as 8 bpp
+ * with a grayscale palette, and PPM and RGB PAM as 24 bpp. Samples are scaled
+ * to 8 bits, and alpha is composited onto white paper.
+ *
+ * Rows are decoded straight into the band being loaded, so only a band's
+ * worth of memory is needed when reading from a pipe. Binary images in
+ * regular files can be read in any order, other images only top to bottom.
+ *
+ * @param hand BMP handle, with fd already set
+ * @param magic First two bytes of file, already consumed
+ * @return 0 on success, else < 0
+ */
+int pnm_open(bmp_hand_t *hand, const uint8_t *magic);
+
+/**
+ * @brief Decode a band of rows into the handle's data, @see bmp_load_band
+ */
+int pnm_load_band(bmp_hand_t *hand, uint32_t y, uint32_t rows);
+
+/**
+ * @brief Free Netpbm reader state and pixel data
+ */
+void pnm_close(bmp_hand_t *hand);
+
+#endif
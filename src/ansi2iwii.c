@@ -11,7 +11,10 @@
 #include <unistd.h>
 
 #include "iwii.h"
+#include "iwii_est.h"
 #include "iwii_gfx.h"
+#include "iwii_job.h"
+#include "iwii_out.h"
 #include "iwiitool.h"
 #include "ansi_escape.h"
 
@@ -20,8 +23,12 @@ typedef struct opts_struct {
 /* I/O Config */
     int      fd_in;     /**< Input file descriptor */
     int      fd_out;    /**< Output file descriptor */
+    iwii_out_t out;     /**< Buffered output stream, wrapping fd_out */
+    iwii_est_t est;     /**< Print time estimator, used in place of fd_out with OPT_FLAG_ESTIMATE */
     unsigned baud;      /**< Baud rate to use */
     uint8_t  flow;      /**< Flow control method to use */
+    char    *socket;    /**< Path of iwiid socket with OPT_FLAG_DAEMON, NULL for default */
+    unsigned priority;  /**< Priority of job submitted to iwiid */
 
 /* Configuration */
     uint8_t  verbose;   /**< Program verbosity level */
@@ -61,6 +68,8 @@ typedef struct opts_struct {
     uint32_t flags;     /**< Configuration flags, and default state */
 #define OPT_FLAG_STRIKETHROUGH      (1UL <<  0) /**< Strikethrough enabled */
 #define OPT_FLAG_CONCEAL            (1UL <<  1) /**< Conceal enabled */
+#define OPT_FLAG_DAEMON             (1UL << 27) /**< Submit job to iwiid instead of writing output */
+#define OPT_FLAG_ESTIMATE           (1UL << 28) /**< Only estimate print time, do not write output */
 #define OPT_FLAG_IDENTIFY           (1UL << 29) /**< Request identity from printer */
 #define OPT_FLAG_NOSETUP            (1UL << 30) /**< Do not configure printer at startup */
 #define OPT_FLAG_ENABLECOLOR        (1UL << 31) /**< Enable color escape codes */
@@ -74,6 +83,7 @@ static opts_t opts = {
     .fd_out    = STDOUT_FILENO,
     .flow      = IWII_FLOW_XONXOFF,
     .baud      = 9600,
+    .priority  = IWII_JOB_PRIORITY_DEFAULT,
 
 /* Config */
     .verbose     = 0,
@@ -100,25 +110,71 @@ static int _apply_config(void);
 static int _handle_char(char c);
 static int _handle_args(int argc, char **const argv);
 
-#define BUFF_SZ 64
+#define BUFF_SZ 4096
 
 int ansi2iwii(int argc, char **argv) {
     if(_handle_args(argc, argv)) {
         return -1;
     }
 
-    if(iwii_serial_init(opts.fd_out, opts.flow, opts.baud)) {
-        close(opts.fd_in);
+    if(opts.flags & OPT_FLAG_DAEMON) {
+        if(opts.flags & (OPT_FLAG_ESTIMATE | OPT_FLAG_IDENTIFY)) {
+            fprintf(stderr, "Cannot estimate or identify printer when submitting to iwiid!\n");
+            close(opts.fd_in);
+            close(opts.fd_out);
+            return -1;
+        }
+
+        int sock = iwii_job_connect(opts.socket, opts.priority);
+        if(sock < 0) {
+            close(opts.fd_in);
+            close(opts.fd_out);
+            return -1;
+        }
         close(opts.fd_out);
-        return -1;
+        opts.fd_out = sock;
     }
 
-    if(opts.flags & OPT_FLAG_IDENTIFY) {
-        if(_identify()) {
+    if(opts.flags & OPT_FLAG_ESTIMATE) {
+        if(opts.flags & OPT_FLAG_IDENTIFY) {
+            fprintf(stderr, "Cannot identify printer while estimating!\n");
             close(opts.fd_in);
             close(opts.fd_out);
             return -1;
         }
+
+        if(iwii_est_init(&opts.est, opts.baud, opts.flow)) {
+            close(opts.fd_in);
+            close(opts.fd_out);
+            return -1;
+        }
+        if(iwii_out_init_sink(&opts.out, iwii_est_feed, &opts.est, 0)) {
+            iwii_est_destroy(&opts.est);
+            close(opts.fd_in);
+            close(opts.fd_out);
+            return -1;
+        }
+    } else {
+        /* iwiid owns the serial port */
+        if(!(opts.flags & OPT_FLAG_DAEMON) &&
+           iwii_serial_init(opts.fd_out, opts.flow, opts.baud)) {
+            close(opts.fd_in);
+            close(opts.fd_out);
+            return -1;
+        }
+
+        if(iwii_out_init(&opts.out, opts.fd_out, 0)) {
+            close(opts.fd_in);
+            close(opts.fd_out);
+            return -1;
+        }
+    }
+
+    if(opts.flags & OPT_FLAG_IDENTIFY) {
+        if(_identify()) {
+            goto main_fail_nobuff;
+        }
+        iwii_out_destroy(&opts.out);
         close(opts.fd_in);
         close(opts.fd_out);
         return 0;
@@ -126,18 +182,14 @@ int ansi2iwii(int argc, char **argv) {
 
     if(!(opts.flags & OPT_FLAG_NOSETUP)) {
         if(_apply_config()) {
-            close(opts.fd_in);
-            close(opts.fd_out);
-            return -1;
+            goto main_fail_nobuff;
         }
     }
 
     char *buff = malloc(BUFF_SZ);
     if(buff == NULL) {
         fprintf(stderr, "Could not allocate space for input buffer: %s\n", strerror(errno));
-        close(opts.fd_in);
-        close(opts.fd_out);
-        return -1;
+        goto main_fail_nobuff;
     }
 
     while(1) {
@@ -146,6 +198,11 @@ int ansi2iwii(int argc, char **argv) {
             for(ssize_t i = 0; i < rd; i++) {
                 _handle_char(buff[i]);
             }
+            /* Push out each chunk as it is processed, so interactive input is
+             * not held back waiting for the buffer to fill */
+            if(iwii_out_flush(&opts.out)) {
+                goto main_fail;
+            }
         } else if(rd < 0) {
             fprintf(stderr, "Error reading from input: %s\n", strerror(errno));
             goto main_fail;
@@ -156,6 +213,27 @@ int ansi2iwii(int argc, char **argv) {
     }
 
     free(buff);
+    if(iwii_out_destroy(&opts.out)) {
+        if(opts.flags & OPT_FLAG_ESTIMATE) {
+            iwii_est_destroy(&opts.est);
+        }
+        close(opts.fd_in);
+        close(opts.fd_out);
+        return -1;
+    }
+    if(opts.flags & OPT_FLAG_ESTIMATE) {
+        iwii_est_report(&opts.est, stdout);
+        iwii_est_destroy(&opts.est);
+    }
+    if(opts.flags & OPT_FLAG_DAEMON) {
+        uint32_t id;
+        if(iwii_job_finish(opts.fd_out, &id)) {
+            close(opts.fd_in);
+            close(opts.fd_out);
+            return -1;
+        }
+        fprintf(stderr, "Queued as job %u\n", id);
+    }
     close(opts.fd_in);
     close(opts.fd_out);
 
@@ -163,6 +241,11 @@ int ansi2iwii(int argc, char **argv) {
 
 main_fail:
     free(buff);
+main_fail_nobuff:
+    iwii_out_destroy(&opts.out);
+    if(opts.flags & OPT_FLAG_ESTIMATE) {
+        iwii_est_destroy(&opts.est);
+    }
     close(opts.fd_in);
     close(opts.fd_out);
 
@@ -171,7 +254,10 @@ main_fail:
 
 
 static int _identify(void) {
-    write(opts.fd_out, "\033?", 2);
+    iwii_out_write(&opts.out, "\033?", 2);
+    if(iwii_out_flush(&opts.out)) {
+        return -1;
+    }
     
     char resp[8];
     int i = 0;
@@ -194,54 +280,54 @@ static int _identify(void) {
 
 static int _apply_config(void) {
     if(opts.setflags & OPT_SETFLAG_FONT) {
-        iwii_set_font(opts.fd_out, opts.font);
+        iwii_set_font(&opts.out, opts.font);
     }
     if(opts.setflags & OPT_SETFLAG_QUALITY) {
-        iwii_set_quality(opts.fd_out, opts.quality);
+        iwii_set_quality(&opts.out, opts.quality);
     }
     if((opts.flags & OPT_FLAG_ENABLECOLOR) &&
        (opts.setflags & OPT_SETFLAG_COLOR)) {
-        iwii_set_ansicolor(opts.fd_out, opts.color);
+        iwii_set_ansicolor(&opts.out, opts.color);
     }
     if(opts.setflags & OPT_SETFLAG_TAB) {
-        iwii_set_tabs(opts.fd_out, opts.tab, opts.font);
+        iwii_set_tabs(&opts.out, opts.tab, opts.font);
     }
     if(opts.setflags & OPT_SETFLAG_LINESPERINCH) {
-        iwii_set_lpi(opts.fd_out, opts.lpi);
+        iwii_set_lpi(&opts.out, opts.lpi);
     }
     if(opts.setflags & OPT_SETFLAG_LINESPACING) {
-        iwii_set_line_spacing(opts.fd_out, opts.linespacing);
+        iwii_set_line_spacing(&opts.out, opts.linespacing);
     }
     
     if(opts.setflags & OPT_SETFLAG_LEFTMARGIN) {
-        iwii_set_left_margin(opts.fd_out, opts.leftmargin);
+        iwii_set_left_margin(&opts.out, opts.leftmargin);
     }
     if(opts.setflags & OPT_SETFLAG_PAGELEN) {
-        iwii_set_pagelen(opts.fd_out, opts.pagelen);
+        iwii_set_pagelen(&opts.out, opts.pagelen);
     }
     if(opts.setflags & OPT_SETFLAG_PROPSPACING) {
-        iwii_set_prop_spacing(opts.fd_out, opts.propspacing);
+        iwii_set_prop_spacing(&opts.out, opts.propspacing);
     }
     
     if(opts.setflags & OPT_SETFLAG_SKIPPERFORATION) {
-        write(opts.fd_out, (opts.cfgflags & OPT_CFGFLAG_SKIPPERFORATION) ? "\033D\x00\x04"
-                                                                         : "\033Z\x00\x04", 4);
+        iwii_out_write(&opts.out, (opts.cfgflags & OPT_CFGFLAG_SKIPPERFORATION) ? "\033D\x00\x04"
+                                                                                : "\033Z\x00\x04", 4);
     }
     if(opts.setflags & OPT_SETFLAG_UNIDIRECTIONAL) {
-        write(opts.fd_out, (opts.cfgflags & OPT_CFGFLAG_UNIDIRECTIONAL) ? "\033>"
-                                                                        : "\033<", 2);
+        iwii_out_write(&opts.out, (opts.cfgflags & OPT_CFGFLAG_UNIDIRECTIONAL) ? "\033>"
+                                                                               : "\033<", 2);
     }
     if(opts.setflags & OPT_SETFLAG_AUTOLINEFEED) {
-        write(opts.fd_out, (opts.cfgflags & OPT_CFGFLAG_AUTOLINEFEED) ? "\033D \x00"
-                                                                      : "\033Z \x00", 4);
+        iwii_out_write(&opts.out, (opts.cfgflags & OPT_CFGFLAG_AUTOLINEFEED) ? "\033D \x00"
+                                                                             : "\033Z \x00", 4);
     }
     if(opts.setflags & OPT_SETFLAG_SLASHEDZERO) {
-        write(opts.fd_out, (opts.cfgflags & OPT_CFGFLAG_SLASHEDZERO) ? "\033D\x00\x01"
-                                                                     : "\033Z\x00\x01", 4);
+        iwii_out_write(&opts.out, (opts.cfgflags & OPT_CFGFLAG_SLASHEDZERO) ? "\033D\x00\x01"
+                                                                            : "\033Z\x00\x01", 4);
     }
     if(opts.setflags & OPT_SETFLAG_DOUBLEWIDTH) {
-        write(opts.fd_out, (opts.cfgflags & OPT_CFGFLAG_DOUBLEWIDTH) ? "\x0e"
-                                                                     : "\x0f", 1);
+        iwii_out_write(&opts.out, (opts.cfgflags & OPT_CFGFLAG_DOUBLEWIDTH) ? "\x0e"
+                                                                            : "\x0f", 1);
     }
 
     return 0;
@@ -251,12 +337,12 @@ static void _ansi_reset(void) {
     opts.flags &= ~(OPT_FLAG_STRIKETHROUGH | OPT_FLAG_CONCEAL);
     /* No bold, underline, sub/superscript, or italic */
     const char *reset = "\033\"\033Y\033z\033W";
-    write(opts.fd_out, reset, strlen(reset));
+    iwii_out_write(&opts.out, reset, strlen(reset));
 
-    iwii_set_font(opts.fd_out, opts.font);
+    iwii_set_font(&opts.out, opts.font);
 
     if(opts.flags & OPT_FLAG_ENABLECOLOR) {
-        iwii_set_ansicolor(opts.fd_out, opts.color);
+        iwii_set_ansicolor(&opts.out, opts.color);
     }
 }
 
@@ -278,16 +364,17 @@ static const char _ansi_iwii_codes[] = {
 static int _handle_sgr(unsigned sgr) {
     if((sgr < sizeof(_ansi_iwii_codes)) &&
        (_ansi_iwii_codes[sgr] != 0)) {
-        dprintf(opts.fd_out, "\033%c", _ansi_iwii_codes[sgr]);
+        char cmd[] = { '\033', _ansi_iwii_codes[sgr] };
+        iwii_out_write(&opts.out, cmd, sizeof(cmd));
     } else {
         if((sgr >= ANSI_SGR_FONT_START) &&
            (sgr < (ANSI_SGR_FONT_START + IWII_FONT_MAX))) {
             opts.font_curr = sgr - ANSI_SGR_FONT_START;
-            iwii_set_font(opts.fd_out, opts.font_curr);
+            iwii_set_font(&opts.out, opts.font_curr);
         } else if((sgr >= ANSI_SGR_FOREGROUND_START) &&
                   (sgr <= ANSI_SGR_FOREGROUND_END)) {
             if(opts.flags & OPT_FLAG_ENABLECOLOR) {
-                iwii_set_ansicolor(opts.fd_out, sgr - ANSI_SGR_FOREGROUND_START);
+                iwii_set_ansicolor(&opts.out, sgr - ANSI_SGR_FOREGROUND_START);
             }
         } else {
             switch(sgr) {
@@ -308,7 +395,7 @@ static int _handle_sgr(unsigned sgr) {
                     break;
                 case ANSI_SGR_FONT_PRIMARY:
                     opts.font_curr = opts.font;
-                    iwii_set_font(opts.fd_out, opts.font_curr);
+                    iwii_set_font(&opts.out, opts.font_curr);
                     break;
                 case ANSI_SGR_PROPORTIONAL_SPACING:
                     if((opts.font_curr == IWII_FONT_PROPORTIONAL_PICA) ||
@@ -319,7 +406,7 @@ static int _handle_sgr(unsigned sgr) {
                     opts.font_save = opts.font_curr;
                     opts.font_curr = (opts.font_save >= IWII_FONT_ELITE) ? IWII_FONT_PROPORTIONAL_ELITE :
                                                                            IWII_FONT_PROPORTIONAL_PICA;
-                    iwii_set_font(opts.fd_out, opts.font_curr);
+                    iwii_set_font(&opts.out, opts.font_curr);
                     break;
                 case ANSI_SGR_NO_PROPORTIONAL_SPACING:
                     if((opts.font_curr != IWII_FONT_PROPORTIONAL_PICA) &&
@@ -333,7 +420,7 @@ static int _handle_sgr(unsigned sgr) {
                         opts.font_curr = (opts.font_curr == IWII_FONT_PROPORTIONAL_ELITE) ? IWII_FONT_ELITE :
                                                                                             IWII_FONT_PICA;
                     }
-                    iwii_set_font(opts.fd_out, opts.font_curr);
+                    iwii_set_font(&opts.out, opts.font_curr);
                     break;
                 default:
                     /* Unsupported SGR */
@@ -346,7 +433,6 @@ static int _handle_sgr(unsigned sgr) {
 }
 
 static int _handle_char(char c) {
-    /* @todo It would be more efficient to buffer up writes and send them in chunks. */
 #define ANSIBUFF_SZ 32
     static char     ansi_buf[ANSIBUFF_SZ];
     static unsigned ansi_pos = 0;
@@ -392,14 +478,14 @@ static int _handle_char(char c) {
         if(opts.flags & OPT_FLAG_CONCEAL) {
             c = ' ';
         } 
-        write(opts.fd_out, &c, 1);
+        iwii_out_putc(&opts.out, c);
         if(opts.flags & OPT_FLAG_STRIKETHROUGH) {
             /* @note This is highly inefficient, the print head has to move
              * back and fourth rapidly to cover each character. A potential
              * optimization would be to keep track of strokethrough works, and
              * only striking through a line at a time. */
             const char st[] = { '\b', '-' };
-            write(opts.fd_out, &st, 2);
+            iwii_out_write(&opts.out, st, 2);
         } 
     }
 
@@ -410,7 +496,7 @@ ansi_error:
         ansi_buf[ansi_pos] = 0;
         fprintf(stderr, "ansi_error: `%s`\n", &ansi_buf[1]);
     }
-    write(opts.fd_out, &ansi_buf[1], ansi_pos-1);
+    iwii_out_write(&opts.out, &ansi_buf[1], ansi_pos-1);
     ansi_pos = 0;
     return -1;
 }
@@ -428,6 +514,12 @@ static void _help(void) {
          "                              1: XON/XOFF (default)\n"
          "                              2: RTS/CTS\n"
          "  -N, --no-setup            Do not configure printer via escape codes on startup\n"
+         "  -E, --estimate            Do not print, instead report the size of the print job and an\n"
+         "                            estimate of how long it would take with the given settings\n"
+         "  -d, --daemon[=SOCKET]     Submit the job to iwiid instead of writing output. SOCKET\n"
+         "                            defaults to that of iwiid, see `iwiid --help`\n"
+         "  -Q, --priority=PRIO       Priority of job submitted to iwiid, 0 to 9 (default 5). Jobs\n"
+         "                            with higher priority are printed first\n"
          "\n"
          "Common Format Options:\n"
          "  -f, --font=FONT           Set default font to use:\n"
@@ -487,6 +579,9 @@ static const struct option prog_options[] = {
     { "baud",             required_argument, NULL, 'b' },
     { "flow",             required_argument, NULL, 'F' },
     { "no-setup",         no_argument,       NULL, 'N' },
+    { "estimate",         no_argument,       NULL, 'E' },
+    { "daemon",           optional_argument, NULL, 'd' },
+    { "priority",         required_argument, NULL, 'Q' },
     /* Common Format Options */
     { "font",             required_argument, NULL, 'f' },
     { "quality",          required_argument, NULL, 'q' },
@@ -552,7 +647,7 @@ static int __get_number(const char *arg, unsigned min, unsigned max, const char
 
 static int _handle_args(int argc, char **const argv) {
     int c;
-    while ((c = getopt_long(argc, argv, "i:o:b:F:N"
+    while ((c = getopt_long(argc, argv, "i:o:b:F:NEd::Q:"
                                         "f:q:c::t:l:L:"
                                         "M:p:P::"
                                         "U::A::Z::D::S:"
@@ -609,6 +704,16 @@ static int _handle_args(int argc, char **const argv) {
             case 'N':
                 opts.flags |= OPT_FLAG_NOSETUP;
                 break;
+            case 'E':
+                opts.flags |= OPT_FLAG_ESTIMATE;
+                break;
+            case 'd':
+                opts.flags |= OPT_FLAG_DAEMON;
+                opts.socket = optarg;
+                break;
+            case 'Q':
+                _get_number(0, IWII_JOB_PRIORITY_MAX, "Job priority", opts.priority);
+                break;
 
             case 'f':
                 opts.setflags |= OPT_SETFLAG_FONT;
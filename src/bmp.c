@@ -1,15 +1,459 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "bmp.h"
+#include "pnm.h"
 
+/**
+ * @brief Read exactly len bytes, retrying on short reads
+ *
+ * @return 0 on success, else < 0
+ */
+static int _read_full(int fd, void *buf, size_t len) {
+    uint8_t *ptr = buf;
+    while(len) {
+        ssize_t rd = read(fd, ptr, len);
+        if(rd < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if(rd == 0) {
+            /* Premature EOF */
+            return -1;
+        }
+        ptr += rd;
+        len -= rd;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read and discard len bytes
+ *
+ * @return 0 on success, else < 0
+ */
+static int _skip(int fd, size_t len) {
+    uint8_t buf[256];
+    while(len) {
+        size_t n = (len > sizeof(buf)) ? sizeof(buf) : len;
+        if(_read_full(fd, buf, n)) {
+            return -1;
+        }
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write exactly len bytes, retrying on short writes
+ *
+ * @return 0 on success, else < 0
+ */
+static int _write_full(int fd, const void *buf, size_t len) {
+    const uint8_t *ptr = buf;
+    while(len) {
+        ssize_t wr = write(fd, ptr, len);
+        if(wr < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += wr;
+        len -= wr;
+    }
+
+    return 0;
+}
+
+static int _pread_full(int fd, void *buf, size_t len, off_t off) {
+    uint8_t *ptr = buf;
+    while(len) {
+        ssize_t rd = pread(fd, ptr, len, off);
+        if(rd < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if(rd == 0) {
+            return -1;
+        }
+        ptr += rd;
+        len -= rd;
+        off += rd;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Ensure data can hold at least the given number of rows
+ */
+static int _reserve_rows(bmp_hand_t *hand, size_t rows) {
+    if(rows <= hand->data_cap) {
+        return 0;
+    }
+
+    uint8_t *data = realloc(hand->data, rows * hand->row_sz);
+    if(data == NULL) {
+        fprintf(stderr, "BMP: Could not allocate memory for pixel data\n");
+        return -1;
+    }
+    hand->data     = data;
+    hand->data_cap = rows;
+
+    return 0;
+}
+
+/**
+ * @brief Map entire file, and point data at the pixel array within it
+ *
+ * @return 0 on success, else < 0
+ */
+static int _map_file(bmp_hand_t *hand, size_t file_sz) {
+    if((file_sz < hand->file_head.img_offset) ||
+       ((file_sz - hand->file_head.img_offset) < hand->data_sz)) {
+        return -1;
+    }
+
+    void *map = mmap(NULL, file_sz, PROT_READ, MAP_PRIVATE, hand->fd, 0);
+    if(map == MAP_FAILED) {
+        return -1;
+    }
+
+    /* Bottom-up images are walked from the end of the file backwards, which
+     * defeats kernel readahead, so request the whole pixel array up-front. */
+    madvise(map, file_sz, (hand->flags & BMP_FLAG_TOPDOWN) ? MADV_SEQUENTIAL : MADV_WILLNEED);
+
+    hand->map     = map;
+    hand->map_sz  = file_sz;
+    hand->data    = (uint8_t *)map + hand->file_head.img_offset;
+    hand->flags  |= BMP_FLAG_MAPPED | BMP_FLAG_BUFFERED;
+    hand->band_fy = 0;
+    hand->band_n  = hand->height;
+
+    return 0;
+}
+
+static void _rle_close(bmp_hand_t *hand) {
+    if(hand->flags & BMP_FLAG_MAPPED) {
+        munmap(hand->map, hand->map_sz);
+    } else {
+        free((void *)hand->rle);
+    }
+    free(hand->rle_rows);
+    free(hand->data);
+    hand->rle      = NULL;
+    hand->rle_rows = NULL;
+    hand->data     = NULL;
+}
+
+/**
+ * @brief Check whether a run of RLE pixels draws anything other than palette index 0
+ *
+ * @param src Pixel data of run, 2 pixels per byte for RLE4
+ * @param len Length of pixel data, in bytes
+ */
+static int _rle_drawn(const uint8_t *src, size_t len) {
+    for(size_t i = 0; i < len; i++) {
+        if(src[i]) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Walk the compressed data once, recording where each row starts
+ *
+ * Rows skipped by end-of-line, delta, and end-of-bitmap codes, and rows made
+ * up only of palette index 0, are marked as blank.
+ *
+ * @return 0 on success, else < 0
+ */
+static int _rle_index(bmp_hand_t *hand) {
+    const uint8_t *rle    = hand->rle;
+    size_t         sz     = hand->rle_sz;
+    unsigned       bpp    = hand->dib_head.bpp;
+    uint32_t       height = hand->height;
+
+    hand->rle_rows = malloc((height ? height : 1) * sizeof(bmp_rle_row_t));
+    if(hand->rle_rows == NULL) {
+        fprintf(stderr, "BMP: Could not allocate memory for RLE index\n");
+        return -1;
+    }
+    for(uint32_t fy = 0; fy < height; fy++) {
+        hand->rle_rows[fy].off = BMP_RLE_BLANK;
+        hand->rle_rows[fy].x   = 0;
+    }
+
+    size_t   pos   = 0;
+    uint32_t fy    = 0;
+    uint32_t x     = 0;
+    size_t   start = 0;
+    uint32_t x0    = 0;
+    int      drawn = 0;
+
+    /* A missing end-of-bitmap code is tolerated, the remaining rows are blank */
+    while((fy < height) && ((pos + 2) <= sz)) {
+        uint8_t cnt  = rle[pos];
+        uint8_t code = rle[pos + 1];
+
+        if(cnt) {
+            /* Encoded run, a count followed by the pixel(s) to repeat */
+            drawn |= (code != 0);
+            x     += cnt;
+            pos   += 2;
+            continue;
+        }
+
+        if(code == 2) {
+            /* Delta, moving right and down (up in file order) */
+            if((pos + 4) > sz) {
+                break;
+            }
+            uint8_t dx = rle[pos + 2];
+            uint8_t dy = rle[pos + 3];
+            pos += 4;
+            x   += dx;
+            if(dy == 0) {
+                continue;
+            }
+            if(drawn) {
+                hand->rle_rows[fy].off = start;
+                hand->rle_rows[fy].x   = x0;
+            }
+            fy    += dy;
+            start  = pos;
+            x0     = x;
+            drawn  = 0;
+        } else if(code < 2) {
+            /* End of line or end of bitmap */
+            pos += 2;
+            if(drawn) {
+                hand->rle_rows[fy].off = start;
+                hand->rle_rows[fy].x   = x0;
+            }
+            if(code == 1) {
+                return 0;
+            }
+            fy++;
+            start = pos;
+            x0    = 0;
+            x     = 0;
+            drawn = 0;
+        } else {
+            /* Absolute run, pixels stored as-is, padded to a 16-bit boundary */
+            size_t len = (bpp == 8) ? code : ((code + 1) / 2);
+            if((pos + 2 + len) > sz) {
+                fprintf(stderr, "BMP: Truncated RLE data\n");
+                return -1;
+            }
+            drawn |= _rle_drawn(&rle[pos + 2], len);
+            x     += code;
+            pos   += 2 + len + (len & 1);
+        }
+    }
+
+    if((fy < height) && drawn) {
+        hand->rle_rows[fy].off = start;
+        hand->rle_rows[fy].x   = x0;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Decode a single RLE compressed row
+ *
+ * Pixels not drawn by the compressed data are left as palette index 0.
+ *
+ * @param hand BMP handle
+ * @param fy Row, in file order
+ * @param dst Row buffer, in the same layout as an uncompressed row
+ */
+static void _rle_decode_row(const bmp_hand_t *hand, uint32_t fy, uint8_t *dst) {
+    memset(dst, 0, hand->row_sz);
+
+    const bmp_rle_row_t *row = &hand->rle_rows[fy];
+    if(row->off == BMP_RLE_BLANK) {
+        return;
+    }
+
+    const uint8_t *rle   = hand->rle;
+    size_t         sz    = hand->rle_sz;
+    uint32_t       width = hand->dib_head.width;
+    size_t         pos   = row->off;
+    uint32_t       x     = row->x;
+
+    while(((pos + 2) <= sz) && (x < width)) {
+        uint8_t  cnt  = rle[pos];
+        uint8_t  code = rle[pos + 1];
+        uint32_t n;
+
+        if(cnt) {
+            n = ((width - x) < cnt) ? (width - x) : cnt;
+            if(hand->dib_head.bpp == 8) {
+                memset(&dst[x], code, n);
+            } else if(code) {
+                /* Pixels alternate between the high and low nibble */
+                for(uint32_t i = 0; i < n; i++, x++) {
+                    uint8_t px = (i & 1) ? (code & 0x0f) : (code >> 4);
+                    dst[x / 2] |= (x & 1) ? px : (px << 4);
+                }
+                x -= n;
+            }
+            x   += n;
+            pos += 2;
+        } else if(code == 2) {
+            if(((pos + 4) > sz) || rle[pos + 3]) {
+                /* Moving down ends the row */
+                return;
+            }
+            x   += rle[pos + 2];
+            pos += 4;
+        } else if(code < 2) {
+            return;
+        } else {
+            const uint8_t *src = &rle[pos + 2];
+            size_t         len = (hand->dib_head.bpp == 8) ? code : ((code + 1) / 2);
+            n = ((width - x) < code) ? (width - x) : code;
+            if(hand->dib_head.bpp == 8) {
+                memcpy(&dst[x], src, n);
+            } else {
+                for(uint32_t i = 0; i < n; i++, x++) {
+                    uint8_t px = (src[i / 2] >> ((i & 1) ? 0 : 4)) & 0x0f;
+                    dst[x / 2] |= (x & 1) ? px : (px << 4);
+                }
+                x -= n;
+            }
+            x   += n;
+            pos += 2 + len + (len & 1);
+        }
+    }
+}
+
+/**
+ * @brief Get hold of the compressed pixel data of an RLE image, and index its rows
+ *
+ * @param hand BMP handle
+ * @param pos Current offset into file
+ * @return 0 on success, else < 0
+ */
+static int _rle_open(bmp_hand_t *hand, size_t pos) {
+    size_t sz = hand->dib_head.image_sz;
+
+    struct stat st;
+    if(!fstat(hand->fd, &st) && S_ISREG(st.st_mode)) {
+        size_t file_sz = st.st_size;
+        if(file_sz < hand->file_head.img_offset) {
+            fprintf(stderr, "BMP: File too small for pixel data\n");
+            return -1;
+        }
+        if((sz == 0) || (sz > (file_sz - hand->file_head.img_offset))) {
+            sz = file_sz - hand->file_head.img_offset;
+        }
+
+        void *map = mmap(NULL, file_sz, PROT_READ, MAP_PRIVATE, hand->fd, 0);
+        if(map == MAP_FAILED) {
+            fprintf(stderr, "BMP: Could not map file: %s\n", strerror(errno));
+            return -1;
+        }
+        madvise(map, file_sz, MADV_WILLNEED);
+
+        hand->map    = map;
+        hand->map_sz = file_sz;
+        hand->rle    = (const uint8_t *)map + hand->file_head.img_offset;
+        hand->flags |= BMP_FLAG_MAPPED | BMP_FLAG_SEEKABLE;
+    } else {
+        if((hand->file_head.img_offset < pos) ||
+           _skip(hand->fd, hand->file_head.img_offset - pos)) {
+            fprintf(stderr, "BMP: Could not seek to pixel data\n");
+            return -1;
+        }
+
+        /* The top row is at the end of the data, so all of it is read in.
+         * Without a size in the header, read until EOF. */
+        size_t   cap = sz ? sz : 65536;
+        size_t   len = 0;
+        uint8_t *buf = malloc(cap);
+        while(buf) {
+            if(len == cap) {
+                if(sz) {
+                    break;
+                }
+                uint8_t *tmp = realloc(buf, cap * 2);
+                if(tmp == NULL) {
+                    free(buf);
+                    buf = NULL;
+                    break;
+                }
+                buf  = tmp;
+                cap *= 2;
+            }
+
+            ssize_t rd = read(hand->fd, &buf[len], cap - len);
+            if(rd < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                fprintf(stderr, "BMP: Could not read pixel data\n");
+                free(buf);
+                return -1;
+            } else if(rd == 0) {
+                break;
+            }
+            len += rd;
+        }
+        if(buf == NULL) {
+            fprintf(stderr, "BMP: Could not allocate memory for pixel data\n");
+            return -1;
+        }
+
+        hand->rle = buf;
+        sz        = len;
+    }
+    hand->rle_sz = sz;
+
+    if(_rle_index(hand)) {
+        _rle_close(hand);
+        return -1;
+    }
 
-int bmp_load_file(bmp_hand_t *hand, int fd) {
-    if(pread(fd, &hand->file_head, sizeof(bmp_file_header_t), 0) != sizeof(bmp_file_header_t)) {
+    return 0;
+}
+
+int bmp_open(bmp_hand_t *hand, int fd) {
+    memset(hand, 0, sizeof(*hand));
+    hand->fd = fd;
+
+    /* Offset into file, as everything is read sequentially */
+    size_t pos = 0;
+    /* Bitfield masks, if part of the DIB header */
+    uint32_t dib_masks[3] = { 0 };
+
+    /* Only the signature is read at first, as Netpbm headers can be shorter than a BMP file header */
+    if(_read_full(fd, &hand->file_head, 2)) {
+        fprintf(stderr, "BMP: Could not read file header\n");
+        return -1;
+    }
+    if(pnm_detect((const uint8_t *)&hand->file_head)) {
+        return pnm_open(hand, (const uint8_t *)&hand->file_head);
+    }
+    if(_read_full(fd, (uint8_t *)&hand->file_head + 2, sizeof(bmp_file_header_t) - 2)) {
         fprintf(stderr, "BMP: Could not read file header\n");
         return -1;
     }
+    pos += sizeof(bmp_file_header_t);
     if(hand->file_head.signature != BMP_SIGNATURE) {
         fprintf(stderr, "BMP: Invalid signature: %hu\n", hand->file_head.signature);
         return -1;
@@ -17,82 +461,335 @@ int bmp_load_file(bmp_hand_t *hand, int fd) {
 
     {
         uint32_t dib_sz = 0;
-        if((pread(fd, &dib_sz, 4, sizeof(bmp_file_header_t)) != 4) ||
-           (dib_sz == 0)) {
+        if(_read_full(fd, &dib_sz, 4) ||
+           (dib_sz < 4)) {
             fprintf(stderr, "BMP: Could not read DIB size\n");
             return -1;
         }
-        if(dib_sz > sizeof(bmp_dib_header_t)) {
-            dib_sz = sizeof(bmp_dib_header_t);
+        hand->dib_head.dib_size = dib_sz;
+
+        size_t rd_sz = dib_sz;
+        if(rd_sz > sizeof(bmp_dib_header_t)) {
+            rd_sz = sizeof(bmp_dib_header_t);
+        }
+        size_t mask_sz = 0;
+        if(dib_sz > rd_sz) {
+            mask_sz = dib_sz - rd_sz;
+            if(mask_sz > sizeof(dib_masks)) {
+                mask_sz = sizeof(dib_masks);
+            }
         }
-        if(pread(fd, &hand->dib_head, dib_sz, sizeof(bmp_file_header_t)) != (ssize_t)dib_sz) {
+        if(_read_full(fd, (uint8_t *)&hand->dib_head + 4, rd_sz - 4) ||
+           _read_full(fd, dib_masks, mask_sz) ||
+           _skip(fd, dib_sz - rd_sz - mask_sz)) {
             fprintf(stderr, "BMP: Could not read DIB header\n");
             return -1;
         }
+        pos += dib_sz;
     }
 
-    if(hand->dib_head.compression != BMP_COMPRESSION_RGB) {
-        fprintf(stderr, "BMP: Unsupported compression value: %u\n", hand->dib_head.compression);
+    if((hand->dib_head.bpp != 1) &&
+       (hand->dib_head.bpp != 4) &&
+       (hand->dib_head.bpp != 8) &&
+       (hand->dib_head.bpp != 24) &&
+       (hand->dib_head.bpp != 32)) {
+        fprintf(stderr, "BMP: Unsupported bits-per-pixel value: %hu\n", hand->dib_head.bpp);
         return -1;
     }
-    if(hand->dib_head.bpp > 4) {
-        fprintf(stderr, "BMP: Unsupported bits-per-pixel value: %hu\n", hand->dib_head.bpp);
+    if((hand->dib_head.compression == BMP_COMPRESSION_BITFIELDS) &&
+       (hand->dib_head.bpp == 32)) {
+        /* Masks are part of newer DIB headers, but follow the original one */
+        uint32_t masks[3];
+        if(hand->dib_head.dib_size >= (sizeof(bmp_dib_header_t) + sizeof(masks))) {
+            memcpy(masks, dib_masks, sizeof(masks));
+        } else if(_read_full(fd, masks, sizeof(masks))) {
+            fprintf(stderr, "BMP: Could not read bitfield masks\n");
+            return -1;
+        } else {
+            pos += sizeof(masks);
+        }
+        /* Only the layout matching uncompressed 32 bpp images is supported */
+        if((masks[0] != 0x00ff0000) || (masks[1] != 0x0000ff00) || (masks[2] != 0x000000ff)) {
+            fprintf(stderr, "BMP: Unsupported bitfield masks: %08x %08x %08x\n", masks[0], masks[1], masks[2]);
+            return -1;
+        }
+    } else if(((hand->dib_head.compression == BMP_COMPRESSION_RLE8) && (hand->dib_head.bpp == 8)) ||
+              ((hand->dib_head.compression == BMP_COMPRESSION_RLE4) && (hand->dib_head.bpp == 4))) {
+        if(hand->dib_head.height < 0) {
+            fprintf(stderr, "BMP: RLE compressed images cannot be top-down\n");
+            return -1;
+        }
+        hand->flags |= BMP_FLAG_RLE;
+    } else if(hand->dib_head.compression != BMP_COMPRESSION_RGB) {
+        fprintf(stderr, "BMP: Unsupported compression value: %u\n", hand->dib_head.compression);
         return -1;
     }
-    if(hand->dib_head.n_colors == 0) {
+    if((hand->dib_head.n_colors == 0) && (hand->dib_head.bpp <= 8)) {
+        /* Truecolor images do not need a palette */
         hand->dib_head.n_colors = 1 << hand->dib_head.bpp;
     }
+    if(hand->dib_head.n_colors > 256) {
+        fprintf(stderr, "BMP: Invalid palette size: %u\n", hand->dib_head.n_colors);
+        return -1;
+    }
 
-    {
+    if(hand->dib_head.height < 0) {
+        hand->flags |= BMP_FLAG_TOPDOWN;
+        hand->height = -hand->dib_head.height;
+    } else {
+        hand->height =  hand->dib_head.height;
+    }
+
+    if(hand->dib_head.n_colors) {
         size_t palette_sz = hand->dib_head.n_colors * sizeof(bmp_color_entry_t);
         hand->palette = malloc(palette_sz);
         if(hand->palette == NULL) {
             fprintf(stderr, "BMP: Could not allocate memory for palette\n");
             return -1;
         }
-        if(pread(fd, hand->palette, palette_sz, sizeof(bmp_file_header_t) + hand->dib_head.dib_size) != (ssize_t)palette_sz) {
+        if(_read_full(fd, hand->palette, palette_sz)) {
             fprintf(stderr, "BMP: Could not read palette\n");
             free(hand->palette);
             return -1;
         }
+        pos += palette_sz;
     }
 
     hand->row_sz  = ((hand->dib_head.bpp * hand->dib_head.width + 31) / 32) * 4;
-    hand->data_sz = hand->row_sz * hand->dib_head.height;
-    hand->data = malloc(hand->data_sz);
-    if(hand->data == NULL) {
-        fprintf(stderr, "BMP: Could not allocate memory for pixel data\n");
-        free(hand->palette);
-        return -1;
+    hand->data_sz = hand->row_sz * hand->height;
+
+    if(hand->flags & BMP_FLAG_RLE) {
+        if(_rle_open(hand, pos)) {
+            free(hand->palette);
+            return -1;
+        }
+        return 0;
     }
-    if(pread(fd, hand->data, hand->data_sz, hand->file_head.img_offset) != (ssize_t)hand->data_sz) {
-        fprintf(stderr, "BMP: Could not read pixel data\n");
+
+    struct stat st;
+    if(!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+        hand->flags |= BMP_FLAG_SEEKABLE;
+        if(!_map_file(hand, st.st_size)) {
+            return 0;
+        }
+        /* Fall back to pread() */
+        if(((size_t)st.st_size < hand->file_head.img_offset) ||
+           (((size_t)st.st_size - hand->file_head.img_offset) < hand->data_sz)) {
+            fprintf(stderr, "BMP: File too small for pixel data\n");
+            free(hand->palette);
+            return -1;
+        }
+        return 0;
+    }
+
+    /* Pixel data does not necessarily immediately follow the palette */
+    if((hand->file_head.img_offset < pos) ||
+       _skip(fd, hand->file_head.img_offset - pos)) {
+        fprintf(stderr, "BMP: Could not seek to pixel data\n");
         free(hand->palette);
-        free(hand->data);
         return -1;
     }
 
+    if(!(hand->flags & BMP_FLAG_TOPDOWN)) {
+        /* The top row of a bottom-up image is at the end of the file, so the
+         * whole pixel array must be read in before anything can be printed. */
+        if(_reserve_rows(hand, hand->height)) {
+            free(hand->palette);
+            return -1;
+        }
+        if(_read_full(fd, hand->data, hand->data_sz)) {
+            fprintf(stderr, "BMP: Could not read pixel data\n");
+            free(hand->palette);
+            free(hand->data);
+            return -1;
+        }
+        hand->flags  |= BMP_FLAG_BUFFERED;
+        hand->band_fy = 0;
+        hand->band_n  = hand->height;
+    }
+
     return 0;
 }
 
 void bmp_destroy(bmp_hand_t *hand) {
     free(hand->palette);
-    free(hand->data);
+    if(hand->flags & BMP_FLAG_PNM) {
+        pnm_close(hand);
+    } else if(hand->flags & BMP_FLAG_RLE) {
+        _rle_close(hand);
+    } else if(hand->flags & BMP_FLAG_MAPPED) {
+        munmap(hand->map, hand->map_sz);
+    } else {
+        free(hand->data);
+    }
+}
+
+int bmp_load_band(bmp_hand_t *hand, uint32_t y, uint32_t rows) {
+    if((y >= hand->height) || (rows > (hand->height - y))) {
+        return -1;
+    }
+    if(hand->flags & BMP_FLAG_BUFFERED) {
+        return 0;
+    }
+    if(hand->flags & BMP_FLAG_PNM) {
+        return pnm_load_band(hand, y, rows);
+    }
+
+    /* First row of the band, in file order */
+    uint32_t fy = (hand->flags & BMP_FLAG_TOPDOWN) ? y : (hand->height - (y + rows));
+
+    if(_reserve_rows(hand, rows)) {
+        return -1;
+    }
+
+    if(hand->flags & BMP_FLAG_RLE) {
+        for(uint32_t i = 0; i < rows; i++) {
+            _rle_decode_row(hand, fy + i, &hand->data[i * hand->row_sz]);
+        }
+    } else if(hand->flags & BMP_FLAG_SEEKABLE) {
+        if(_pread_full(hand->fd, hand->data, rows * hand->row_sz,
+                       hand->file_head.img_offset + ((off_t)fy * hand->row_sz))) {
+            fprintf(stderr, "BMP: Could not read pixel data\n");
+            return -1;
+        }
+    } else {
+        /* Streaming a top-down image, rows can only be read in order. Rows
+         * still held from the previous band may be asked for again. */
+        uint32_t keep = 0;
+        if(fy < hand->next_fy) {
+            if(fy < hand->band_fy) {
+                fprintf(stderr, "BMP: Cannot rewind non-seekable input\n");
+                return -1;
+            }
+            keep = hand->next_fy - fy;
+            if(keep > rows) {
+                keep = rows;
+            }
+            memmove(hand->data, &hand->data[(fy - hand->band_fy) * hand->row_sz], keep * hand->row_sz);
+        }
+        if(keep < rows) {
+            if(_skip(hand->fd, (fy + keep - hand->next_fy) * hand->row_sz) ||
+               _read_full(hand->fd, &hand->data[keep * hand->row_sz], (rows - keep) * hand->row_sz)) {
+                fprintf(stderr, "BMP: Could not read pixel data\n");
+                return -1;
+            }
+            hand->next_fy = fy + rows;
+        }
+    }
+
+    hand->band_fy = fy;
+    hand->band_n  = rows;
+
+    return 0;
 }
 
-int bmp_get_pixel(bmp_hand_t *hand, uint32_t x, uint32_t y) {
-    /* Assuming height is positive */
-    if((x >= hand->dib_head.width) || (y >= hand->dib_head.height)) {
+const uint8_t *bmp_get_row(const bmp_hand_t *hand, uint32_t y) {
+    if(y >= hand->height) {
+        return NULL;
+    }
+
+    uint32_t fy = (hand->flags & BMP_FLAG_TOPDOWN) ? y : ((hand->height - 1) - y);
+    if((fy < hand->band_fy) || (fy >= (hand->band_fy + hand->band_n))) {
+        return NULL;
+    }
+
+    return &hand->data[hand->row_sz * (fy - hand->band_fy)];
+}
+
+int bmp_row_blank(const bmp_hand_t *hand, uint32_t y) {
+    if(!(hand->flags & BMP_FLAG_RLE) || (y >= hand->height)) {
+        return 0;
+    }
+
+    return hand->rle_rows[(hand->height - 1) - y].off == BMP_RLE_BLANK;
+}
+
+int bmp_get_pixel(const bmp_hand_t *hand, uint32_t x, uint32_t y) {
+    if(x >= hand->dib_head.width) {
         return -1;
     }
 
+    const uint8_t *row = bmp_get_row(hand, y);
+    if(row == NULL) {
+        return -1;
+    }
+
+    if(hand->dib_head.bpp > 8) {
+        const uint8_t *px = &row[x * (hand->dib_head.bpp / 8)];
+        return (px[2] << 16) | (px[1] << 8) | px[0];
+    }
+
     unsigned byte = (x * hand->dib_head.bpp) / 8;
     uint8_t  msb  = 7 - ((x * hand->dib_head.bpp) % 8);
     uint8_t  lsb  = msb - (hand->dib_head.bpp - 1);
 
-    uint8_t *row = &hand->data[hand->row_sz * ((hand->dib_head.height - 1) - y)];
-    uint8_t  px  = (row[byte] >> lsb) & ((1 << hand->dib_head.bpp) - 1);
-    
+    uint8_t  px   = (row[byte] >> lsb) & ((1 << hand->dib_head.bpp) - 1);
+
     return px;
 }
 
+int bmp_write(int fd, const uint8_t *data, uint32_t width, uint32_t height,
+              const bmp_color_entry_t *palette, uint32_t n_colors) {
+    if((n_colors == 0) || (n_colors > 256)) {
+        return -1;
+    }
+
+    uint16_t bpp    = (n_colors <= 16) ? 4 : 8;
+    size_t   row_sz = ((((size_t)width * bpp) + 31) / 32) * 4;
+
+    bmp_file_header_t file_head = {
+        .signature  = BMP_SIGNATURE,
+        .img_offset = sizeof(bmp_file_header_t) + sizeof(bmp_dib_header_t) +
+                      (n_colors * sizeof(bmp_color_entry_t))
+    };
+    file_head.file_sz = file_head.img_offset + (row_sz * height);
+
+    bmp_dib_header_t dib_head = {
+        .dib_size    = sizeof(bmp_dib_header_t),
+        .width       = width,
+        .height      = height,
+        .n_planes    = 1,
+        .bpp         = bpp,
+        .compression = BMP_COMPRESSION_RGB,
+        .image_sz    = row_sz * height,
+        .n_colors    = n_colors
+    };
+
+    uint8_t *row = calloc(1, row_sz ? row_sz : 1);
+    if(row == NULL) {
+        return -1;
+    }
+
+    if(_write_full(fd, &file_head, sizeof(file_head)) ||
+       _write_full(fd, &dib_head, sizeof(dib_head)) ||
+       _write_full(fd, palette, n_colors * sizeof(bmp_color_entry_t))) {
+        goto write_fail;
+    }
+
+    /* Rows are stored bottom-up */
+    for(uint32_t y = height; y > 0; y--) {
+        const uint8_t *src = &data[(size_t)(y - 1) * width];
+        if(bpp == 4) {
+            for(uint32_t x = 0; x < width; x++) {
+                if(x & 1) {
+                    row[x / 2] |= src[x] & 0x0f;
+                } else {
+                    row[x / 2]  = src[x] << 4;
+                }
+            }
+        } else {
+            memcpy(row, src, width);
+        }
+        if(_write_full(fd, row, row_sz)) {
+            goto write_fail;
+        }
+    }
+
+    free(row);
+    return 0;
+
+write_fail:
+    fprintf(stderr, "BMP: Could not write image: %s\n", strerror(errno));
+    free(row);
+    return -1;
+}
@@ -7,6 +7,7 @@
 
 #include "ansi_escape.h"
 #include "iwii.h"
+#include "iwii_out.h"
 
 int iwii_serial_init(int fd, iwii_flow_e flow, unsigned baud) {
     speed_t speed;
@@ -76,6 +77,96 @@ int iwii_serial_init(int fd, iwii_flow_e flow, unsigned baud) {
     return 0;
 }
 
+int iwii_esc_args(uint8_t cmd) {
+    switch(cmd) {
+        case 'V':
+            return 5;
+        case 'G': case 'F': case 'H': case 'S':
+            return 4;
+        case 'g': case 'L': case 'u':
+            return 3;
+        case 'T': case 'D': case 'Z':
+            return 2;
+        case 'K': case 'a': case 's': case 'l':
+            return 1;
+        case '(': case ')':
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Check whether the head is known to be at the left margin
+ */
+static int _at_margin(const iwii_out_t *out) {
+    return out->state.at_margin &&
+           (out->state.margin_pos == iwii_out_tell(out));
+}
+
+/**
+ * @brief Send a command changing a setting, unless the printer already has that setting
+ *
+ * @param out Output stream
+ * @param setting Setting changed by command
+ * @param val New value of setting
+ * @param cmd Command
+ * @param len Length of command, in bytes
+ * @return 0 on success, else < 0
+ */
+static int _set(iwii_out_t *out, iwii_setting_e setting, unsigned val, const char *cmd, size_t len) {
+    iwii_out_state_t *state = &out->state;
+    if((state->known & (1U << setting)) && (state->values[setting] == val)) {
+        return out->err ? -1 : 0;
+    }
+
+    /* Settings do not move the head */
+    int at_margin = _at_margin(out);
+    if(iwii_out_write(out, cmd, len)) {
+        return -1;
+    }
+    if(at_margin) {
+        state->margin_pos = iwii_out_tell(out);
+    }
+
+    state->known           |= 1U << setting;
+    state->values[setting]  = val;
+
+    return 0;
+}
+
+/**
+ * @brief Send a command with a fixed-width decimal argument changing a setting, @see _set
+ */
+static int _set_dec(iwii_out_t *out, iwii_setting_e setting, char cmd, unsigned val, unsigned digits) {
+    char     buf[8] = { '\033', cmd };
+    unsigned num    = val;
+    for(unsigned i = digits; i > 0; i--) {
+        buf[1 + i] = '0' + (num % 10);
+        num /= 10;
+    }
+
+    return _set(out, setting, val, buf, 2 + digits);
+}
+
+void iwii_state_invalidate(iwii_out_t *out) {
+    memset(&out->state, 0, sizeof(out->state));
+}
+
+int iwii_carriage_return(iwii_out_t *out) {
+    if(_at_margin(out)) {
+        return out->err ? -1 : 0;
+    }
+
+    if(iwii_out_putc(out, '\r')) {
+        return -1;
+    }
+    out->state.at_margin  = 1;
+    out->state.margin_pos = iwii_out_tell(out);
+
+    return 0;
+}
+
 static const char iwii_font[] = {
     [IWII_FONT_EXTENDED]           = 'n',
     [IWII_FONT_PICA]               = 'N',
@@ -88,15 +179,14 @@ static const char iwii_font[] = {
     [IWII_FONT_CUSTOM]             = '\'',
 };
 
-int iwii_set_font(int fd, unsigned font) {
+int iwii_set_font(iwii_out_t *out, unsigned font) {
     if(font >= IWII_FONT_MAX) {
         return -1;
     }
 
     char cmd[] = { '\033', iwii_font[font] };
-    write(fd, &cmd, sizeof(cmd));
 
-    return 0;
+    return _set(out, IWII_SETTING_FONT, font, cmd, sizeof(cmd));
 }
 
 static const char iwii_quality[] = {
@@ -105,15 +195,14 @@ static const char iwii_quality[] = {
     [IWII_QUAL_NEARLETTERQUALITY] = '2'
 };
 
-int iwii_set_quality(int fd, unsigned quality) {
+int iwii_set_quality(iwii_out_t *out, unsigned quality) {
     if(quality >= IWII_QUAL_MAX) {
         return -1;
     }
 
     char cmd[] = { '\033', 'a', iwii_quality[quality] };
-    write(fd, &cmd, sizeof(cmd));
 
-    return 0;
+    return _set(out, IWII_SETTING_QUALITY, quality, cmd, sizeof(cmd));
 }
 
 static const char iwii_color[] = {
@@ -127,37 +216,34 @@ static const char iwii_color[] = {
     [ANSI_COLOR_WHITE]   = '0'  /* White would be no printing at all, mapping to black */
 };
 
-int iwii_set_color(int fd, unsigned color) {
+int iwii_set_color(iwii_out_t *out, unsigned color) {
     if(color >= IWII_COLOR_MAX) {
         return -1;
     }
 
-    dprintf(fd, "\033K%u", color);
-
-    return 0;
+    return _set_dec(out, IWII_SETTING_COLOR, 'K', color, 1);
 }
 
-int iwii_set_ansicolor(int fd, unsigned color) {
+int iwii_set_ansicolor(iwii_out_t *out, unsigned color) {
     if(color >= ANSI_COLOR_MAX) {
         return -1;
     }
 
     char cmd[] = { '\033', 'K', iwii_color[color] };
-    write(fd, &cmd, sizeof(cmd));
 
-    return 0;
+    return _set(out, IWII_SETTING_COLOR, iwii_color[color] - '0', cmd, sizeof(cmd));
 }
 
 /** Max tab positions for each font. Assuming minimum for custom fonts to be safe */
 static const uint8_t tab_max[IWII_FONT_MAX] = { 72, 80, 96, 107, 120, 136, 72, 82, 72 };
 
-int iwii_set_tabs(int fd, unsigned tab_size, unsigned font) {
+int iwii_set_tabs(iwii_out_t *out, unsigned tab_size, unsigned font) {
     if(font > IWII_FONT_MAX) {
         return -1;
     }
 
     /* Start writing tab stops */
-    write(fd, "\033(", 2);
+    iwii_out_write(out, "\033(", 2);
     /* Get number of tabs for selected spacing */
     unsigned n = (tab_max[font] / tab_size) - 1;
     if(n > 32) {
@@ -165,82 +251,127 @@ int iwii_set_tabs(int fd, unsigned tab_size, unsigned font) {
     }
 
     for(unsigned i = 1; i <= n; i++) {
-        dprintf(fd, "%03u", tab_size * i);
+        iwii_out_dec(out, tab_size * i, 3);
         if(i < n) {
-            write(fd, ",", 1);
+            iwii_out_putc(out, ',');
         }
     }
 
     /* Stop writing tab stops */
-    write(fd, ".", 1);
-
-    return 0;
+    return iwii_out_putc(out, '.');
 }
 
-int iwii_set_lpi(int fd, unsigned lpi) {
+int iwii_set_lpi(iwii_out_t *out, unsigned lpi) {
     if((lpi != 6) && (lpi != 8)) {
         return -1;
     }
 
     char cmd[] = { '\033', (lpi == 6) ? 'A' : 'B' };
-    write(fd, &cmd, sizeof(cmd));
 
-    return 0;
+    /* Tracked as line spacing, 6 and 8 lpi being 24 and 18 144ths of an inch */
+    return _set(out, IWII_SETTING_SPACING, 144 / lpi, cmd, sizeof(cmd));
 }
 
-int iwii_set_line_spacing(int fd, unsigned line_spacing) {
+int iwii_set_line_spacing(iwii_out_t *out, unsigned line_spacing) {
     if((line_spacing < 1) ||
        (line_spacing > 99)) {
         return -1;
     }
 
-    dprintf(fd, "\033T%02u", line_spacing);
-
-    return 0;
+    return _set_dec(out, IWII_SETTING_SPACING, 'T', line_spacing, 2);
 }
 
 
 
 
-int iwii_set_left_margin(int fd, unsigned left_margin) {
+int iwii_set_left_margin(iwii_out_t *out, unsigned left_margin) {
     if(left_margin > 300) {
         return -1;
     }
 
-    dprintf(fd, "\033L%03u", left_margin);
-
-    return 0;
+    return _set_dec(out, IWII_SETTING_LEFT_MARGIN, 'L', left_margin, 3);
 }
-int iwii_set_pagelen(int fd, unsigned pagelen) {
+int iwii_set_pagelen(iwii_out_t *out, unsigned pagelen) {
     if((pagelen < 1) ||
        (pagelen > 9999)) {
         return -1;
     }
 
-    dprintf(fd, "\033H%04u", pagelen);
-
-    return 0;
+    return _set_dec(out, IWII_SETTING_PAGELEN, 'H', pagelen, 4);
 }
 
-int iwii_set_prop_spacing(int fd, unsigned prop_spacing) {
+int iwii_set_prop_spacing(iwii_out_t *out, unsigned prop_spacing) {
     if(prop_spacing > 9) {
         return -1;
     }
 
-    dprintf(fd, "\033s%u", prop_spacing);
+    return _set_dec(out, IWII_SETTING_PROP_SPACING, 's', prop_spacing, 1);
+}
 
-    return 0;
+/**
+ * @brief Send line feeds, in runs of up to 15 per command
+ */
+static int _line_feeds(iwii_out_t *out, unsigned n) {
+    while(n > 1) {
+        unsigned run   = (n > 15) ? 15 : n;
+        char     cmd[] = { 0x1f, '0' + run };
+        if(iwii_out_write(out, cmd, sizeof(cmd))) {
+            return -1;
+        }
+        n -= run;
+    }
+
+    return n ? iwii_out_putc(out, '\n') : (out->err ? -1 : 0);
 }
 
-int iwii_move_up_lines(int fd, unsigned lines) {
-    /* Reverse line feed */
-    write(fd, "\er", 2);
-    while(lines--) {
-        write(fd, "\n", 1);
+int iwii_feed(iwii_out_t *out, int dist) {
+    if(dist == 0) {
+        return out->err ? -1 : 0;
     }
-    /* Forward line feed */
-    write(fd, "\ef", 2);
 
-    return 0;
+    unsigned d = (dist < 0) ? -dist : dist;
+
+    /* As few line feeds as the longest line spacing allows, split between
+     * at most two spacings one dot apart. The current spacing goes first,
+     * if it is one of them. */
+    unsigned n       = (d + 98) / 99;
+    unsigned spacing = d / n;
+    unsigned extra   = d % n;
+    unsigned s[2]    = { spacing + 1, spacing };
+    unsigned cnt[2]  = { extra, n - extra };
+    if((out->state.known & (1U << IWII_SETTING_SPACING)) &&
+       (out->state.values[IWII_SETTING_SPACING] == spacing)) {
+        s[0]   = spacing;
+        s[1]   = spacing + 1;
+        cnt[0] = n - extra;
+        cnt[1] = extra;
+    }
+
+    /* Paper motion does not move the head */
+    int at_margin = _at_margin(out);
+    int reverse   = 0;
+    for(unsigned i = 0; i < 2; i++) {
+        if(cnt[i] == 0) {
+            continue;
+        }
+        if(iwii_set_line_spacing(out, s[i])) {
+            return -1;
+        }
+        if((dist < 0) && !reverse) {
+            iwii_out_write(out, "\er", 2);
+            reverse = 1;
+        }
+        if(_line_feeds(out, cnt[i])) {
+            return -1;
+        }
+    }
+    if(reverse && iwii_out_write(out, "\ef", 2)) {
+        return -1;
+    }
+    if(at_margin) {
+        out->state.margin_pos = iwii_out_tell(out);
+    }
+
+    return out->err ? -1 : 0;
 }
 
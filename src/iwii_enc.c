@@ -0,0 +1,154 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "iwii_enc.h"
+#include "iwii_out.h"
+
+/* Byte cost of each command */
+#define COST_POSITION (6) /**< `ESC F nnnn` */
+#define COST_RAW      (6) /**< `ESC G nnnn`, excluding data */
+#define COST_REPEAT   (7) /**< `ESC V nnnn c` */
+
+/** Largest count accepted by `ESC G` and `ESC V` */
+#define MAX_COUNT (9999)
+
+/* Encoder states, whether or not a raw run is currently open */
+#define STATE_NONE (0)
+#define STATE_RAW  (1)
+
+/* Choices made for each run, in the cost model */
+#define CHOICE_RAW    (0)
+#define CHOICE_REPEAT (1)
+#define CHOICE_SKIP   (2)
+#define CHOICE(choice, prev) (((choice) << 1) | (prev))
+
+typedef struct {
+    uint16_t start;     /**< First column of run */
+    uint16_t len;       /**< Length of run */
+    uint8_t  val;       /**< Column byte */
+    uint8_t  choice[2]; /**< Best choice to end up in each state after this run, CHOICE() */
+} _enc_run_t;
+
+int iwii_enc_init(iwii_enc_t *enc, unsigned width) {
+    enc->width = width;
+    enc->runs  = malloc((width ? width : 1) * sizeof(_enc_run_t));
+    if(enc->runs == NULL) {
+        fprintf(stderr, "ENC: Could not allocate memory for encoder\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void iwii_enc_destroy(iwii_enc_t *enc) {
+    free(enc->runs);
+    enc->runs = NULL;
+}
+
+unsigned iwii_enc_line(iwii_enc_t *enc, iwii_enc_op_t *ops, const uint8_t *cols, unsigned start, unsigned end) {
+    _enc_run_t *runs   = enc->runs;
+    unsigned    n_runs = 0;
+
+    /* Split line into runs of identical column bytes */
+    for(unsigned j = start; j <= end;) {
+        unsigned k = j + 1;
+        while((k <= end) && (cols[k] == cols[j]) && ((k - j) < MAX_COUNT)) {
+            k++;
+        }
+        runs[n_runs].start = j;
+        runs[n_runs].len   = k - j;
+        runs[n_runs].val   = cols[j];
+        n_runs++;
+        j = k;
+    }
+
+    /* Find the cheapest way of sending each run, given the state left by the
+     * previous run. The initial carriage position is not included, as it is
+     * always required. */
+    uint32_t cost[2] = { [STATE_NONE] = 0, [STATE_RAW] = UINT32_MAX / 2 };
+    for(unsigned i = 0; i < n_runs; i++) {
+        _enc_run_t *run = &runs[i];
+        uint32_t    next[2];
+
+        /* Continue or open a raw run */
+        if(cost[STATE_RAW] <= (cost[STATE_NONE] + COST_RAW)) {
+            next[STATE_RAW]        = cost[STATE_RAW] + run->len;
+            run->choice[STATE_RAW] = CHOICE(CHOICE_RAW, STATE_RAW);
+        } else {
+            next[STATE_RAW]        = cost[STATE_NONE] + COST_RAW + run->len;
+            run->choice[STATE_RAW] = CHOICE(CHOICE_RAW, STATE_NONE);
+        }
+
+        /* Repeat, or skip over blank runs, from whichever state is cheaper */
+        unsigned prev = (cost[STATE_RAW] < cost[STATE_NONE]) ? STATE_RAW : STATE_NONE;
+        if(run->val == 0) {
+            next[STATE_NONE]        = cost[prev] + COST_POSITION;
+            run->choice[STATE_NONE] = CHOICE(CHOICE_SKIP, prev);
+        } else {
+            next[STATE_NONE]        = cost[prev] + COST_REPEAT;
+            run->choice[STATE_NONE] = CHOICE(CHOICE_REPEAT, prev);
+        }
+
+        cost[STATE_NONE] = next[STATE_NONE];
+        cost[STATE_RAW]  = next[STATE_RAW];
+    }
+
+    /* Walk back through the choices, building the operations in reverse */
+    unsigned state = (cost[STATE_RAW] <= cost[STATE_NONE]) ? STATE_RAW : STATE_NONE;
+    unsigned n_ops = 0;
+    for(unsigned i = n_runs; i > 0; i--) {
+        _enc_run_t *run    = &runs[i - 1];
+        unsigned    choice = run->choice[state] >> 1;
+
+        if(choice == CHOICE_RAW) {
+            if(n_ops && (ops[n_ops - 1].op == IWII_ENC_OP_RAW) &&
+               ((ops[n_ops - 1].start) == (run->start + run->len)) &&
+               ((ops[n_ops - 1].len + run->len) <= MAX_COUNT)) {
+                /* Merge with following raw run */
+                ops[n_ops - 1].start = run->start;
+                ops[n_ops - 1].len  += run->len;
+            } else {
+                ops[n_ops++] = (iwii_enc_op_t){ .op = IWII_ENC_OP_RAW, .start = run->start, .len = run->len };
+            }
+        } else if(choice == CHOICE_REPEAT) {
+            ops[n_ops++] = (iwii_enc_op_t){ .op = IWII_ENC_OP_REPEAT, .val = run->val,
+                                            .start = run->start, .len = run->len };
+        }
+
+        state = run->choice[state] & 1;
+    }
+
+    /* Put operations back in order */
+    for(unsigned i = 0; i < (n_ops / 2); i++) {
+        iwii_enc_op_t tmp  = ops[i];
+        ops[i]             = ops[n_ops - 1 - i];
+        ops[n_ops - 1 - i] = tmp;
+    }
+
+    return n_ops;
+}
+
+int iwii_enc_emit(iwii_out_t *out, const iwii_enc_op_t *ops, unsigned n_ops, const uint8_t *cols, unsigned h_pos) {
+    int pos = -1;
+
+    for(unsigned i = 0; i < n_ops; i++) {
+        const iwii_enc_op_t *op = &ops[i];
+
+        if(op->start != pos) {
+            iwii_out_cmd(out, 'F', h_pos + op->start, 4);
+        }
+
+        if(op->op == IWII_ENC_OP_REPEAT) {
+            iwii_out_cmd(out, 'V', op->len, 4);
+            iwii_out_putc(out, op->val);
+        } else {
+            iwii_out_cmd(out, 'G', op->len, 4);
+            iwii_out_write(out, &cols[op->start], op->len);
+        }
+
+        pos = op->start + op->len;
+    }
+
+    return out->err ? -1 : 0;
+}
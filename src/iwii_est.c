@@ -0,0 +1,385 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iwii.h"
+#include "iwii_est.h"
+#include "iwii_model.h"
+
+/** Bits sent on the serial link per byte, 8N1 */
+#define BITS_PER_BYTE (10)
+
+/** Band position of each color on the ribbon, mixed colors start from their lightest band */
+static const uint8_t _color_band[IWII_COLOR_MAX] = {
+    [IWII_COLOR_BLACK]  = IWII_RIBBON_BLACK,
+    [IWII_COLOR_YELLOW] = IWII_RIBBON_YELLOW,
+    [IWII_COLOR_RED]    = IWII_RIBBON_RED,
+    [IWII_COLOR_BLUE]   = IWII_RIBBON_BLUE,
+    [IWII_COLOR_ORANGE] = IWII_RIBBON_YELLOW,
+    [IWII_COLOR_GREEN]  = IWII_RIBBON_YELLOW,
+    [IWII_COLOR_PURPLE] = IWII_RIBBON_RED
+};
+
+/**
+ * @brief Reset printer state to its power-on defaults
+ */
+static void _reset(iwii_est_t *est) {
+    est->h_dpi   = 80; /* Pica */
+    est->quality = IWII_QUAL_STANDARD;
+    est->color   = IWII_COLOR_BLACK;
+    est->spacing = 24; /* 6 lines per inch */
+    est->reverse = 0;
+}
+
+int iwii_est_init(iwii_est_t *est, unsigned baud, unsigned flow) {
+    memset(est, 0, sizeof(*est));
+
+    if(baud == 0) {
+        return -1;
+    }
+    est->baud     = baud;
+    est->flow     = flow;
+    est->last_dir = -1;
+    _reset(est);
+
+    if(flow != IWII_FLOW_NONE) {
+        est->pending = malloc((IWII_MODEL_BUFFER_SZ + 1) * sizeof(iwii_est_pend_t));
+        if(est->pending == NULL) {
+            fprintf(stderr, "EST: Could not allocate memory for buffer model\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void iwii_est_destroy(iwii_est_t *est) {
+    free(est->pending);
+    est->pending = NULL;
+}
+
+/**
+ * @brief Account for a completed command
+ *
+ * Data is sent at the link's baud rate, and each command is executed once it
+ * has been fully received and the previous command has completed. With flow
+ * control, the host is held off while the printer's input buffer is full.
+ *
+ * @param est Estimator
+ * @param bytes Length of command, in bytes
+ * @param mech Time taken to execute command, in microseconds
+ */
+static void _schedule(iwii_est_t *est, unsigned bytes, uint64_t mech) {
+    uint64_t tx    = ((uint64_t)bytes * BITS_PER_BYTE * 1000000) / est->baud;
+    uint64_t start = est->tx_time;
+
+    est->offset += bytes;
+    if(est->pending) {
+        /* Wait until the printer has consumed enough to make room for this command */
+        while(est->pend_cnt &&
+              ((est->pending[est->pend_head].end + IWII_MODEL_BUFFER_SZ) <= est->offset)) {
+            if(est->pending[est->pend_head].done > start) {
+                start = est->pending[est->pend_head].done;
+            }
+            est->pend_head = (est->pend_head + 1) % (IWII_MODEL_BUFFER_SZ + 1);
+            est->pend_cnt--;
+        }
+    }
+    est->tx_time = start + tx;
+
+    uint64_t begin = (est->busy_time > est->tx_time) ? est->busy_time : est->tx_time;
+    est->busy_time = begin + mech;
+
+    if(est->pending) {
+        unsigned idx = (est->pend_head + est->pend_cnt) % (IWII_MODEL_BUFFER_SZ + 1);
+        est->pending[idx].end  = est->offset;
+        est->pending[idx].done = est->busy_time;
+        est->pend_cnt++;
+    }
+
+    est->stats.tx_us   += tx;
+    est->stats.mech_us += mech;
+    est->stats.total_us = est->busy_time;
+}
+
+/**
+ * @brief Move print head, returning time taken
+ */
+static uint64_t _travel(iwii_est_t *est, uint64_t to) {
+    uint64_t dist = (est->head > to) ? (est->head - to) : (to - est->head);
+    est->head = to;
+    if(dist == 0) {
+        return 0;
+    }
+
+    return IWII_MODEL_MOVE_US + (dist * IWII_MODEL_SLEW_US_PER_INCH) / IWII_EST_HEAD_UNITS;
+}
+
+/**
+ * @brief Print columns of graphics data, returning time taken
+ */
+static uint64_t _print_cols(iwii_est_t *est, unsigned cols) {
+    est->head += ((uint64_t)cols * IWII_EST_HEAD_UNITS) / est->h_dpi;
+
+    return ((uint64_t)cols * IWII_MODEL_PRINT_US_PER_INCH) / est->h_dpi;
+}
+
+/**
+ * @brief Feed paper by a number of lines in the current direction, returning time taken
+ */
+static uint64_t _feed(iwii_est_t *est, unsigned lines) {
+    uint64_t mech = 0;
+
+    for(unsigned i = 0; i < lines; i++) {
+        if(est->reverse) {
+            est->stats.reverse_feeds++;
+        } else {
+            est->stats.line_feeds++;
+        }
+
+        est->v_pos += est->reverse ? -(int64_t)est->spacing : (int64_t)est->spacing;
+
+        mech += IWII_MODEL_FEED_US + ((uint64_t)est->spacing * IWII_MODEL_FEED_US_PER_INCH) / 144;
+        if((est->last_dir >= 0) && (est->last_dir != est->reverse)) {
+            mech += IWII_MODEL_REVERSE_US;
+        }
+        est->last_dir = est->reverse;
+    }
+
+    return mech;
+}
+
+/**
+ * @brief Parse a fixed-width decimal argument
+ */
+static unsigned _dec(const uint8_t *str, unsigned digits) {
+    unsigned val = 0;
+    for(unsigned i = 0; i < digits; i++) {
+        if((str[i] >= '0') && (str[i] <= '9')) {
+            val = (val * 10) + (str[i] - '0');
+        }
+    }
+
+    return val;
+}
+
+/**
+ * @brief Execute the fully received command, returning the time it takes
+ */
+static uint64_t _exec(iwii_est_t *est) {
+    const uint8_t *hdr = est->hdr;
+    unsigned       char_w = (8 * IWII_EST_HEAD_UNITS) / est->h_dpi;
+
+    if(hdr[0] == 0x1f) {
+        /* Multiple line feeds */
+        return _feed(est, hdr[1] & 0x0f);
+    } else if(hdr[0] != '\033') {
+        switch(hdr[0]) {
+            case '\r':
+                est->stats.returns++;
+                return _travel(est, 0);
+            case '\n':
+                return _feed(est, 1);
+            case '\b':
+                return _travel(est, (est->head > char_w) ? (est->head - char_w) : 0);
+            case '\t':
+                return _travel(est, est->head + char_w);
+            default:
+                if((hdr[0] >= 0x20) && (hdr[0] < 0x7f)) {
+                    est->stats.chars++;
+                    est->head += char_w;
+                    switch(est->quality) {
+                        case IWII_QUAL_DRAFT:
+                            return IWII_MODEL_CHAR_US_DRAFT;
+                        case IWII_QUAL_NEARLETTERQUALITY:
+                            return IWII_MODEL_CHAR_US_NLQ;
+                        default:
+                            return IWII_MODEL_CHAR_US_STANDARD;
+                    }
+                }
+                return 0;
+        }
+    }
+
+    switch(hdr[1]) {
+        case 'G':
+            est->stats.raw_runs++;
+            return _print_cols(est, _dec(&hdr[2], 4));
+        case 'g':
+            est->stats.raw_runs++;
+            return _print_cols(est, _dec(&hdr[2], 3) * 8);
+        case 'V': {
+            unsigned cols = _dec(&hdr[2], 4);
+            est->stats.repeat_runs++;
+            if(est->render) {
+                for(unsigned i = 0; i < cols; i++) {
+                    est->render(est->render_arg, est, est->head + (((uint64_t)i * IWII_EST_HEAD_UNITS) / est->h_dpi), hdr[6]);
+                }
+            }
+            return _print_cols(est, cols);
+        }
+        case 'F':
+            est->stats.positions++;
+            return _travel(est, ((uint64_t)_dec(&hdr[2], 4) * IWII_EST_HEAD_UNITS) / est->h_dpi);
+        case 'K': {
+            unsigned color = hdr[2] - '0';
+            if((color < IWII_COLOR_MAX) && (color != est->color)) {
+                unsigned from = _color_band[est->color];
+                unsigned to   = _color_band[color];
+                est->stats.color_switches++;
+                est->color = color;
+                if(from != to) {
+                    return IWII_MODEL_SHIFT_US +
+                           IWII_MODEL_SHIFT_STEP_US * ((from > to) ? (from - to) : (to - from));
+                }
+            }
+            return 0;
+        }
+        case 'T':
+            est->spacing = _dec(&hdr[2], 2);
+            return 0;
+        case 'A':
+            est->spacing = 24;
+            return 0;
+        case 'B':
+            est->spacing = 18;
+            return 0;
+        case 'r':
+            est->reverse = 1;
+            return 0;
+        case 'f':
+            est->reverse = 0;
+            return 0;
+        case 'a':
+            est->quality = (hdr[2] == '1') ? IWII_QUAL_DRAFT :
+                           (hdr[2] == '2') ? IWII_QUAL_NEARLETTERQUALITY : IWII_QUAL_STANDARD;
+            return 0;
+        case 'n': est->h_dpi =  72; return 0;
+        case 'N': est->h_dpi =  80; return 0;
+        case 'E': est->h_dpi =  96; return 0;
+        case 'e': est->h_dpi = 107; return 0;
+        case 'q': est->h_dpi = 120; return 0;
+        case 'Q': est->h_dpi = 136; return 0;
+        case 'p': est->h_dpi = 144; return 0;
+        case 'P': est->h_dpi = 160; return 0;
+        case 'c':
+            _reset(est);
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Finish off the current command
+ */
+static void _complete(iwii_est_t *est) {
+    _schedule(est, est->cmd_len, _exec(est));
+    if(est->cmd) {
+        est->cmd(est->cmd_arg, est, est->hdr, est->hdr_len);
+    }
+    est->hdr_len = 0;
+    est->cmd_len = 0;
+}
+
+int iwii_est_feed(void *arg, const void *data, size_t len) {
+    iwii_est_t    *est = arg;
+    const uint8_t *buf = data;
+
+    est->stats.bytes += len;
+
+    for(size_t i = 0; i < len; i++) {
+        uint8_t c = buf[i];
+        est->cmd_len++;
+
+        if(est->data) {
+            /* Graphics data is not needed, only its length */
+            size_t skip = len - i;
+            if(skip > est->data) {
+                skip = est->data;
+            }
+            if(est->render) {
+                for(size_t j = 0; j < skip; j++, est->data_col++) {
+                    est->render(est->render_arg, est,
+                                est->head + (((uint64_t)est->data_col * IWII_EST_HEAD_UNITS) / est->h_dpi), buf[i + j]);
+                }
+            }
+            est->cmd_len += skip - 1;
+            est->data    -= skip;
+            i            += skip - 1;
+            if(est->data == 0) {
+                _complete(est);
+            }
+            continue;
+        }
+
+        if(est->in_list) {
+            if(c == '.') {
+                est->in_list = 0;
+                _complete(est);
+            }
+            continue;
+        }
+
+        est->hdr[est->hdr_len++] = c;
+        if(est->hdr_len == 1) {
+            est->hdr_need = ((c == '\033') || (c == 0x1f)) ? 2 : 1;
+        } else if((est->hdr_len == 2) && (est->hdr[0] == '\033')) {
+            int args = iwii_esc_args(c);
+            if(args < 0) {
+                est->in_list = 1;
+                continue;
+            }
+            est->hdr_need = 2 + args;
+        }
+
+        if(est->hdr_len < est->hdr_need) {
+            continue;
+        }
+
+        /* Header complete, graphics commands are followed by their data */
+        est->data_col = 0;
+        if(est->hdr[0] == '\033') {
+            if(est->hdr[1] == 'G') {
+                est->data = _dec(&est->hdr[2], 4);
+            } else if(est->hdr[1] == 'g') {
+                est->data = _dec(&est->hdr[2], 3) * 8;
+            }
+        }
+        if(est->data == 0) {
+            _complete(est);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write a duration, as seconds and h:mm:ss
+ */
+static void _report_time(FILE *file, const char *name, uint64_t us) {
+    uint64_t secs = (us + 500000) / 1000000;
+    fprintf(file, "%-18s %" PRIu64 ".%01" PRIu64 " s (%" PRIu64 ":%02" PRIu64 ":%02" PRIu64 ")\n",
+            name, us / 1000000, (us / 100000) % 10, secs / 3600, (secs / 60) % 60, secs % 60);
+}
+
+void iwii_est_report(const iwii_est_t *est, FILE *file) {
+    const iwii_est_stats_t *stats = &est->stats;
+
+    fprintf(file, "%-18s %" PRIu64 "\n", "Bytes:",            stats->bytes);
+    fprintf(file, "%-18s %" PRIu64 "\n", "Graphics runs:",    stats->raw_runs);
+    fprintf(file, "%-18s %" PRIu64 "\n", "Repeat runs:",      stats->repeat_runs);
+    fprintf(file, "%-18s %" PRIu64 "\n", "Head positions:",   stats->positions);
+    fprintf(file, "%-18s %" PRIu64 "\n", "Color switches:",   stats->color_switches);
+    fprintf(file, "%-18s %" PRIu64 "\n", "Line feeds:",       stats->line_feeds);
+    fprintf(file, "%-18s %" PRIu64 "\n", "Reverse feeds:",    stats->reverse_feeds);
+    fprintf(file, "%-18s %" PRIu64 "\n", "Carriage returns:", stats->returns);
+    fprintf(file, "%-18s %" PRIu64 "\n", "Characters:",       stats->chars);
+    _report_time(file, "Transmit time:",   stats->tx_us);
+    _report_time(file, "Mechanical time:", stats->mech_us);
+    _report_time(file, "Estimated time:",  stats->total_us);
+    fflush(file);
+}
+
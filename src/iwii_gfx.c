@@ -1,4 +1,6 @@
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,18 +8,31 @@
 
 #include "bmp.h"
 #include "iwii.h"
+#include "iwii_enc.h"
 #include "iwii_gfx.h"
+#include "iwii_model.h"
+#include "iwii_pack.h"
+#include "iwii_quant.h"
+#include "iwii_scale.h"
 
 typedef struct {
-    iwii_gfx_params_t cfg; /**< Configuration parameters */
+    iwii_gfx_params_t cfg;    /**< Configuration parameters */
+    unsigned          head;   /**< Current print head position, in dots from the left margin */
+    unsigned          ribbon; /**< Currently selected ribbon, @see iwii_ribbon_e */
+    unsigned          v_off;  /**< Paper position within the current band, in 144ths of an inch */
+    int               feed;   /**< Paper motion not yet sent, in 144ths of an inch, negative being up */
+    int               yellow_first; /**< Whether yellow must be printed before other ribbons in the current band */
 } iwii_gfx_state_t;
 
 static iwii_gfx_state_t _gfx_state;
 
-int iwii_gfx_init(int fd, const iwii_gfx_params_t *params) {
+int iwii_gfx_init(iwii_out_t *out, const iwii_gfx_params_t *params) {
     memset(&_gfx_state, 0, sizeof(_gfx_state));
-    memcpy(&_gfx_state.cfg, params, sizeof(iwii_gfx_state_t));
-    
+    memcpy(&_gfx_state.cfg, params, sizeof(iwii_gfx_params_t));
+    /* The printer powers up on the black ribbon */
+    _gfx_state.ribbon = IWII_RIBBON_BLACK;
+    _gfx_state.yellow_first = 1;
+
     /* Horizontal DPI is determined by the currently selected font */
     iwii_font_e font;
     switch(_gfx_state.cfg.h_dpi) {
@@ -55,345 +70,1702 @@ int iwii_gfx_init(int fd, const iwii_gfx_params_t *params) {
         return -1;
     }
 
-    if(iwii_set_font(fd, font) ||
-       iwii_set_line_spacing(fd, 16)) {
+    if(iwii_set_font(out, font) ||
+       iwii_set_line_spacing(out, 16)) {
         return -1;
     }
 
     return 0;
 }
 
+/** Color to select for each ribbon pass */
+static const uint8_t _ribbon_color[IWII_RIBBON_MAX] = {
+    [IWII_RIBBON_YELLOW] = IWII_COLOR_YELLOW,
+    [IWII_RIBBON_RED]    = IWII_COLOR_RED,
+    [IWII_RIBBON_BLUE]   = IWII_COLOR_BLUE,
+    [IWII_RIBBON_BLACK]  = IWII_COLOR_BLACK
+};
+
+#define RIBBON(r) (1U << IWII_RIBBON_##r)
+
+/** Ribbons needed to print each color, with IWII_COLOR_MAX being white */
+const uint8_t iwii_gfx_color_ribbons[IWII_COLOR_MAX + 1] = {
+    [IWII_COLOR_BLACK]  = RIBBON(BLACK),
+    [IWII_COLOR_YELLOW] = RIBBON(YELLOW),
+    [IWII_COLOR_RED]    = RIBBON(RED),
+    [IWII_COLOR_BLUE]   = RIBBON(BLUE),
+    [IWII_COLOR_ORANGE] = RIBBON(YELLOW) | RIBBON(RED),
+    [IWII_COLOR_GREEN]  = RIBBON(YELLOW) | RIBBON(BLUE),
+    [IWII_COLOR_PURPLE] = RIBBON(RED)    | RIBBON(BLUE),
+    [IWII_COLOR_MAX]    = 0
+};
+
 /**
- * @brief Print a single line of gfx data, in a single (pre-set) color
- *
- * @param fd File descriptor to write to
- * @param data Buffer where each byte represents one column of 8 dots
- * @param len Length of buffer/line
+ * @brief A single line (8 dots tall) of gfx data, packed and encoded for every ribbon
  */
-static int iwii_gfx_print_line(int fd, const uint8_t *data, unsigned len) {
-    if(len > 9999) {
+typedef struct {
+    uint8_t       *cols[IWII_RIBBON_MAX];  /**< Column bytes for each ribbon, one byte per column */
+    int            start[IWII_RIBBON_MAX]; /**< First non-empty column, < 0 if ribbon is unused */
+    int            end[IWII_RIBBON_MAX];   /**< Last non-empty column */
+    iwii_enc_op_t *ops[IWII_RIBBON_MAX];   /**< Encoded operations for each ribbon */
+    unsigned       n_ops[IWII_RIBBON_MAX]; /**< Number of encoded operations for each ribbon */
+    unsigned      *segs[IWII_RIBBON_MAX];  /**< First operation of each segment, followed by n_ops */
+    unsigned       n_segs[IWII_RIBBON_MAX]; /**< Number of segments for each ribbon */
+    iwii_enc_t     enc;                    /**< Line encoder */
+} iwii_gfx_line_t;
+
+static int _line_alloc(iwii_gfx_line_t *line, unsigned width) {
+    uint8_t *buf = malloc(IWII_RIBBON_MAX * width);
+    if(buf == NULL) {
         return -1;
     }
-
-    dprintf(fd, "\033G%04u", len);
-    if(write(fd, data, len) < 0) {
+    iwii_enc_op_t *ops = malloc(IWII_RIBBON_MAX * width * sizeof(iwii_enc_op_t));
+    if(ops == NULL) {
+        free(buf);
+        return -1;
+    }
+    unsigned *segs = malloc(IWII_RIBBON_MAX * (width + 1) * sizeof(unsigned));
+    if(segs == NULL) {
+        free(ops);
+        free(buf);
         return -1;
     }
+    if(iwii_enc_init(&line->enc, width)) {
+        free(segs);
+        free(ops);
+        free(buf);
+        return -1;
+    }
+    for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+        line->cols[r]   = &buf[r * width];
+        line->ops[r]    = &ops[r * width];
+        line->n_ops[r]  = 0;
+        line->segs[r]   = &segs[r * (width + 1)];
+        line->n_segs[r] = 0;
+    }
 
     return 0;
 }
 
+static void _line_free(iwii_gfx_line_t *line) {
+    iwii_enc_destroy(&line->enc);
+    free(line->segs[0]);
+    free(line->ops[0]);
+    free(line->cols[0]);
+}
+
 /**
- * @brief Tests if the given color requires using the current ribbon
- * 
- * @param ribbon Current ribbon
- * @param color  Color to test
+ * @brief Split a ribbon's encoded operations into segments
+ *
+ * A segment is a group of operations that are printed back-to-back without
+ * repositioning the carriage. Segments can be printed in any order.
  */
-static inline int _test_color(uint8_t ribbon, uint8_t color) {
-    switch(ribbon) {
-        case 0: /* Yellow */
-            return (color == IWII_COLOR_YELLOW) ||
-                   (color == IWII_COLOR_ORANGE) ||
-                   (color == IWII_COLOR_GREEN);
-        case 1: /* Red */
-            return (color == IWII_COLOR_RED) ||
-                   (color == IWII_COLOR_ORANGE) ||
-                   (color == IWII_COLOR_PURPLE);
-        case 2: /* Blue */
-            return (color == IWII_COLOR_BLUE) ||
-                   (color == IWII_COLOR_GREEN) ||
-                   (color == IWII_COLOR_PURPLE);
-        case 3: /* Black */
-            return color == IWII_COLOR_BLACK;
+static void _line_segment(iwii_gfx_line_t *line, unsigned ribbon) {
+    const iwii_enc_op_t *ops  = line->ops[ribbon];
+    unsigned            *segs = line->segs[ribbon];
+    unsigned             n    = 0;
+
+    for(unsigned i = 0; i < line->n_ops[ribbon]; i++) {
+        if((i == 0) || (ops[i].start != (ops[i - 1].start + ops[i - 1].len))) {
+            segs[n++] = i;
+        }
     }
+    segs[n] = line->n_ops[ribbon];
 
-    return 0;
+    line->n_segs[ribbon] = n;
 }
 
 /**
- * @brief Print a single line of gfx data, with all necessary colors
+ * @brief Pack rows of ribbon masks into column bytes, for all ribbons at once
+ *
+ * Row `first + (n * stride)` ends up in bit n of each column byte.
  *
- * @note This method is not terribly efficient, but it's good enough for now.
+ * @param line Line to pack into
+ * @param data Buffer containing ribbon masks, each byte containing one pixel
+ * @param width Width of image, in pixels
+ * @param first First row to pack
+ * @param rows Number of rows to pack, at most 8
+ * @param stride Distance between packed rows
+ */
+static void _pack_line(iwii_gfx_line_t *line, const uint8_t *data, unsigned width,
+                       unsigned first, unsigned rows, unsigned stride) {
+    const uint8_t *row_ptrs[8];
+    for(unsigned n = 0; n < rows; n++) {
+        row_ptrs[n] = &data[(first + (n * stride)) * width];
+    }
+
+    iwii_pack_columns(line->cols, line->start, line->end, row_ptrs, rows, width);
+
+    for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+        line->n_ops[r] = (line->start[r] < 0) ? 0 :
+                         iwii_enc_line(&line->enc, line->ops[r], line->cols[r], line->start[r], line->end[r]);
+        _line_segment(line, r);
+    }
+}
+
+/**
+ * @brief Pack a band of ribbon masks into one (72 dpi) or two (144 dpi) interlaced lines
  *
- * @param fd File descriptor to write to
- * @param data Buffer containing indexed color data, each byte containing one pixel
+ * @param lines Lines to pack into, two are required at 144 dpi
+ * @param data Buffer containing ribbon masks, each byte containing one pixel
  * @param width Width of image, in pixels
- * @param rows Numer of rows to print, should be 8 an all lines but the final line
- * @param color Color to print
+ * @param rows Number of rows in band
+ */
+static void _pack_band(iwii_gfx_line_t *lines, const uint8_t *data, unsigned width, unsigned rows) {
+    if(_gfx_state.cfg.v_dpi == 144) {
+        _pack_line(&lines[0], data, width, 0, (rows + 1) / 2, 2);
+        _pack_line(&lines[1], data, width, 1,  rows      / 2, 2);
+    } else {
+        _pack_line(&lines[0], data, width, 0, rows, 1);
+    }
+}
+
+/**
+ * @brief Column bytes of every line of an image, for the ribbons still to be printed
+ *
+ * Lets sequential color mode convert the image only once, on its first
+ * pass. Only the columns between each ribbon's first and last non-empty
+ * columns are kept, so at most half a byte per pixel is needed.
  */
-static int iwii_gfx_print_line_color(int fd, const uint8_t *data, unsigned width, unsigned rows, unsigned color) {
-    uint8_t *line = malloc(width);
-    if(line == NULL) {
+typedef struct {
+    struct {
+        int    start;      /**< First non-empty column, < 0 if ribbon is unused */
+        int    end;        /**< Last non-empty column */
+        size_t off;        /**< Offset of the columns within data */
+    }        (*spans)[IWII_RIBBON_MAX]; /**< Span of each ribbon, for each line */
+    uint8_t   *data;       /**< Column bytes */
+    size_t     len;        /**< Number of bytes used in data */
+    size_t     cap;        /**< Number of bytes allocated for data */
+} _planes_t;
+
+static int _planes_init(_planes_t *planes, unsigned n_lines) {
+    memset(planes, 0, sizeof(*planes));
+    planes->spans = malloc(n_lines * sizeof(*planes->spans));
+    if(planes->spans == NULL) {
         return -1;
     }
+    for(unsigned i = 0; i < n_lines; i++) {
+        for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+            planes->spans[i][r].start = -1;
+        }
+    }
+
+    return 0;
+}
 
-    int start = -1;
-    int end   =  0;
+static void _planes_free(_planes_t *planes) {
+    free(planes->spans);
+    free(planes->data);
+}
 
-    for(unsigned j = 0; j < width; j++) {
-        uint8_t col = 0;
-        for(int k = rows - 1; k >= 0; k--) {
-            col = (col << 1) | (_test_color(color, data[(k * width) + j]) ? 1 : 0);
+/**
+ * @brief Keep a packed line's columns, for ribbons from `first` on
+ *
+ * @param planes Planes to add to
+ * @param idx Index of line within image
+ * @param line Packed line
+ * @param first First ribbon to keep
+ * @return 0 on success, else < 0
+ */
+static int _planes_add(_planes_t *planes, unsigned idx, const iwii_gfx_line_t *line, unsigned first) {
+    for(unsigned r = first; r < IWII_RIBBON_MAX; r++) {
+        if(line->start[r] < 0) {
+            continue;
         }
-        if(col) {
-            if(start < 0) {
-                start = j;
+
+        size_t len = line->end[r] - line->start[r] + 1;
+        if((planes->len + len) > planes->cap) {
+            size_t   cap  = planes->cap ? planes->cap : 4096;
+            while(cap < (planes->len + len)) {
+                cap *= 2;
+            }
+            uint8_t *data = realloc(planes->data, cap);
+            if(data == NULL) {
+                return -1;
             }
-            end = j;
+            planes->data = data;
+            planes->cap  = cap;
         }
-        line[j] = col;
+
+        memcpy(&planes->data[planes->len], &line->cols[r][line->start[r]], len);
+        planes->spans[idx][r].start = line->start[r];
+        planes->spans[idx][r].end   = line->end[r];
+        planes->spans[idx][r].off   = planes->len;
+        planes->len += len;
     }
 
-    /* Only write if color is used in line */
-    if(start >= 0) {
-        iwii_set_color(fd, (color == 0) ? IWII_COLOR_YELLOW :
-                           (color == 1) ? IWII_COLOR_RED    :
-                           (color == 2) ? IWII_COLOR_BLUE   : IWII_COLOR_BLACK);
+    return 0;
+}
 
-        /* Set carriage start position */
-        dprintf(fd, "\r\033F%04d", _gfx_state.cfg.h_pos + start);
-        
-        iwii_gfx_print_line(fd, &line[start], (end + 1) - start);
+/**
+ * @brief Restore a ribbon of a line kept by _planes_add, and encode it for printing
+ *
+ * @param planes Planes holding line
+ * @param idx Index of line within image
+ * @param line Line to restore into, only the given ribbon is touched
+ * @param ribbon Ribbon to restore
+ */
+static void _planes_load(const _planes_t *planes, unsigned idx, iwii_gfx_line_t *line, unsigned ribbon) {
+    int start = planes->spans[idx][ribbon].start;
+    int end   = planes->spans[idx][ribbon].end;
+
+    line->start[ribbon] = start;
+    line->end[ribbon]   = end;
+    line->n_ops[ribbon] = 0;
+    if(start >= 0) {
+        memcpy(&line->cols[ribbon][start], &planes->data[planes->spans[idx][ribbon].off], end - start + 1);
+        line->n_ops[ribbon] = iwii_enc_line(&line->enc, line->ops[ribbon], line->cols[ribbon], start, end);
     }
+    _line_segment(line, ribbon);
+}
 
-    free(line);
+/**
+ * @brief Ribbons used by the lines of a band kept by _planes_add
+ */
+static unsigned _planes_ribbons(const _planes_t *planes, unsigned idx, unsigned n_lines) {
+    unsigned used = 0;
+    for(unsigned i = idx; i < (idx + n_lines); i++) {
+        for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+            if(planes->spans[i][r].start >= 0) {
+                used |= 1U << r;
+            }
+        }
+    }
 
-    return 0;
+    return used;
 }
 
-/* @todo Merge with above */
-static int iwii_gfx_print_line_color_144dpi(int fd, const uint8_t *data, unsigned width, unsigned rows, unsigned color) {
-    uint8_t *line = malloc(width);
-    if(line == NULL) {
+/**
+ * @brief Which ribbons each band of an image uses
+ */
+typedef struct {
+    uint8_t  *bands;                   /**< Ribbons used by each band, bit n for iwii_ribbon_e n */
+    unsigned  n_bands;                 /**< Number of bands in image */
+    unsigned  used;                    /**< Ribbons used anywhere in the image */
+    unsigned  counts[IWII_RIBBON_MAX]; /**< Number of bands using each ribbon */
+} _usage_t;
+
+static int _usage_init(_usage_t *usage, unsigned n_bands) {
+    memset(usage, 0, sizeof(*usage));
+    usage->bands = calloc(n_bands ? n_bands : 1, 1);
+    if(usage->bands == NULL) {
         return -1;
     }
+    usage->n_bands = n_bands;
 
-    for(int i = 0; i < 2; i++) {
-        int start = -1;
-        int end   =  0;
+    return 0;
+}
 
-        for(unsigned j = 0; j < width; j++) {
-            uint8_t col = 0;
-            /* If last row is even, we need to invert logic */
-            int     k   = rows - ((((rows & 1) ^ i) & 1) ? 1 : 2);
-            for(; k >= 0; k -= 2) {
-                col = (col << 1) | (_test_color(color, data[(k * width) + j]) ? 1 : 0);
-            }
-            if(col) {
-                if(start < 0) {
-                    start = j;
-                }
-                end = j;
-            }
-            line[j] = col;
+static void _usage_add(_usage_t *usage, unsigned band, unsigned used) {
+    usage->bands[band] = used;
+    usage->used       |= used;
+    for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+        if(used & (1U << r)) {
+            usage->counts[r]++;
         }
+    }
+}
 
-        /* Only write if color is used in line */
-        if(start >= 0) {
-            iwii_set_color(fd, (color == 0) ? IWII_COLOR_YELLOW :
-                               (color == 1) ? IWII_COLOR_RED    :
-                               (color == 2) ? IWII_COLOR_BLUE   : IWII_COLOR_BLACK);
+/**
+ * @brief Report ribbon usage, and how the image is to be printed
+ *
+ * @param usage Ribbon usage
+ * @param width Width of image, in dots
+ * @param height Height of image, in dots
+ * @param passes Number of sequential color passes, 0 if printed band by band
+ */
+static void _usage_report(const _usage_t *usage, unsigned width, unsigned height, unsigned passes) {
+    static const char *names[IWII_RIBBON_MAX] = { "yellow", "red", "blue", "black" };
 
-            /* Set carriage start position */
-            dprintf(fd, "\r\033F%04d", _gfx_state.cfg.h_pos + start);
-            
-            iwii_gfx_print_line(fd, &line[start], (end + 1) - start);
+    unsigned blank = 0;
+    for(unsigned b = 0; b < usage->n_bands; b++) {
+        if(usage->bands[b] == 0) {
+            blank++;
         }
+    }
 
-        if(i) {
-            /* Move up one dot */
-            iwii_set_line_spacing(fd, 1);
-            iwii_move_up_lines(fd, 1);
-            iwii_set_line_spacing(fd, 16);
-        } else {
-            /* Move down one dot */
-            iwii_set_line_spacing(fd, 1);
-            write(fd, "\n", 1);
-            iwii_set_line_spacing(fd, 16);
+    fprintf(stderr, "GFX: %ux%u dots, %u bands, %u blank\n", width, height, usage->n_bands, blank);
+    fprintf(stderr, "GFX: Bands using ribbon:");
+    for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+        fprintf(stderr, " %s %u%s", names[r], usage->counts[r], (r < (IWII_RIBBON_MAX - 1)) ? "," : "\n");
+    }
+    if(passes) {
+        fprintf(stderr, "GFX: Sequential color: %u pass%s, %u rewind%s\n",
+                passes, (passes == 1) ? "" : "es", passes - 1, (passes == 2) ? "" : "s");
+    }
+
+    if(_gfx_state.cfg.verbose >= 2) {
+        for(unsigned b = 0; b < usage->n_bands; b++) {
+            fprintf(stderr, "GFX: Band %4u: %c%c%c%c\n", b,
+                    (usage->bands[b] & RIBBON(YELLOW)) ? 'Y' : '-',
+                    (usage->bands[b] & RIBBON(RED))    ? 'R' : '-',
+                    (usage->bands[b] & RIBBON(BLUE))   ? 'B' : '-',
+                    (usage->bands[b] & RIBBON(BLACK))  ? 'K' : '-');
         }
     }
+}
 
-    iwii_set_line_spacing(fd, 16);
+/**
+ * @brief Cost of moving the carriage, in microseconds
+ *
+ * @param from Current head position, in dots
+ * @param to Target head position, in dots
+ */
+static uint64_t _travel_cost(unsigned from, unsigned to) {
+    unsigned dist = (from > to) ? (from - to) : (to - from);
+    if(dist == 0) {
+        return 0;
+    }
 
-    free(line);
+    return IWII_MODEL_MOVE_US + ((uint64_t)dist * IWII_MODEL_SLEW_US_PER_INCH) / _gfx_state.cfg.h_dpi;
+}
 
-    return 0;
+/**
+ * @brief Cost of shifting the ribbon, in microseconds
+ *
+ * The color bands on the ribbon are stacked in iwii_ribbon_e order, so the
+ * further apart two ribbons are, the further the ribbon has to be shifted.
+ */
+static uint64_t _shift_cost(unsigned from, unsigned to) {
+    if(from == to) {
+        return 0;
+    }
+
+    return IWII_MODEL_SHIFT_US + IWII_MODEL_SHIFT_STEP_US * ((from > to) ? (from - to) : (to - from));
 }
 
+/**
+ * @brief Carriage travel cost of printing a ribbon's segments of a line
+ *
+ * Each segment is always printed left to right, but the segments themselves
+ * may be visited in either order.
+ *
+ * @param line Packed line
+ * @param ribbon Ribbon, @see iwii_ribbon_e
+ * @param head Print head position before printing, updated with position after printing
+ * @param reverse Visit segments right to left rather than left to right
+ * @return Cost, in microseconds
+ */
+static uint64_t _line_cost(const iwii_gfx_line_t *line, unsigned ribbon, unsigned *head, int reverse) {
+    const iwii_enc_op_t *ops    = line->ops[ribbon];
+    const unsigned      *segs   = line->segs[ribbon];
+    unsigned             n_segs = line->n_segs[ribbon];
+    uint64_t             cost   = 0;
+    unsigned             pos    = *head;
 
-int iwii_gfx_print_image(int fd, const uint8_t *data, unsigned width, unsigned height) {
-    for(unsigned i = 0; i < height; i += 8) {
-        unsigned rows = 8;
-        if((height - i) < rows) {
-            rows = height - i;
-        }
+    for(unsigned i = 0; i < n_segs; i++) {
+        unsigned seg   = reverse ? (n_segs - 1 - i) : i;
+        unsigned start = _gfx_state.cfg.h_pos + ops[segs[seg]].start;
+        unsigned end   = _gfx_state.cfg.h_pos + ops[segs[seg + 1] - 1].start + ops[segs[seg + 1] - 1].len;
 
-        for(unsigned color = 0; color < 4; color++) {
-            iwii_gfx_print_line_color(fd, &data[i * width], width, rows, color);
-        }
-        write(fd, "\r\n", 2);
+        cost += _travel_cost(pos, start) + _travel_cost(start, end);
+        pos   = end;
     }
 
-    return 0;
+    *head = pos;
+    return cost;
 }
 
-const uint32_t _rgb_colors[IWII_COLOR_MAX+1] = {
-    [IWII_COLOR_BLACK]  = 0x000000,
-    [IWII_COLOR_YELLOW] = 0xd6d426,
-    [IWII_COLOR_RED]    = 0xb80000,
-    [IWII_COLOR_BLUE]   = 0x005bff,
-    [IWII_COLOR_ORANGE] = 0xff5d00,
-    [IWII_COLOR_GREEN]  = 0x0d8900,
-    [IWII_COLOR_PURPLE] = 0x88004c,
-    [IWII_COLOR_MAX]    = 0xffffff /* White */
-};
+/**
+ * @brief Choose which order to visit a ribbon's segments of a line in, given the current head position
+ *
+ * @return 1 if segments should be visited right to left, else 0
+ */
+static int _line_reverse(const iwii_gfx_line_t *line, unsigned ribbon, unsigned head) {
+    unsigned fwd_head = head;
+    unsigned rev_head = head;
 
-static int _conv_colors(bmp_hand_t *bmp, const uint8_t *pal_map, unsigned row, unsigned width, unsigned rows, uint8_t *row_data) {
-    unsigned idx = 0;
-    for(unsigned y = row; y < row + rows; y++) {
-        for(unsigned x = 0; x < width; x++) {
-            int col = bmp_get_pixel(bmp, x, y);
-            if(col < 0 || col > 7) {
-                fprintf(stderr, "GFX: Bad pixel: (%u, %u) -> %d\n", x, y, col);
-                return -1;
-            }
-            row_data[idx++] = pal_map[bmp_get_pixel(bmp, x, y)];
-        }
+    return _line_cost(line, ribbon, &rev_head, 1) < _line_cost(line, ribbon, &fwd_head, 0);
+}
+
+/**
+ * @brief Carriage travel cost of a single ribbon's pass over a band
+ *
+ * @param lines Packed lines making up band
+ * @param n_lines Number of lines in band
+ * @param ribbon Ribbon, @see iwii_ribbon_e
+ * @param head Print head position before pass, updated with position after pass
+ * @return Cost, in microseconds
+ */
+static uint64_t _pass_cost(const iwii_gfx_line_t *lines, unsigned n_lines, unsigned ribbon, unsigned *head) {
+    uint64_t cost = 0;
+    for(unsigned i = 0; i < n_lines; i++) {
+        cost += _line_cost(&lines[i], ribbon, head, _line_reverse(&lines[i], ribbon, *head));
     }
 
-    return 0;
+    return cost;
 }
 
-int iwii_gfx_print_bmp(int fd, int bmp_fd) {
-    bmp_hand_t *bmp = malloc(sizeof(*bmp));
-    if(bmp == NULL) {
-        return -1;
-    }
-    if(bmp_load_file(bmp, bmp_fd)) {
-        free(bmp);
-        return -1;
+/**
+ * @brief Ribbon pass ordering for a single band
+ */
+typedef struct {
+    unsigned order[IWII_RIBBON_MAX];  /**< Ribbons, in the order they are to be printed */
+    unsigned n;                       /**< Number of ribbons to print */
+    uint64_t cost;                    /**< Cost of this ordering, in microseconds */
+    unsigned head;                    /**< Print head position after printing */
+} _band_plan_t;
+
+/**
+ * @brief Search every allowed ordering of the ribbon passes, keeping the cheapest
+ *
+ * @param best Cheapest complete ordering found so far
+ * @param cur Ordering currently being built
+ * @param lines Packed lines making up band
+ * @param n_lines Number of lines in band
+ * @param todo Mask of ribbons still to be printed
+ * @param ribbon Currently selected ribbon
+ * @param head Current print head position
+ */
+static void _plan_search(_band_plan_t *best, _band_plan_t *cur, const iwii_gfx_line_t *lines, unsigned n_lines,
+                         unsigned todo, unsigned ribbon, unsigned head) {
+    if(todo == 0) {
+        if(cur->cost < best->cost) {
+            cur->head = head;
+            *best     = *cur;
+        }
+        return;
     }
-    /* @note Even if the file is only using 8 colors, it may say it is using 16, or it
-     * relies upon the bits-per-pixel value instead. ImageMagick for instance does this,
-     * while GIMP does not. So we allow up to 16, and only fail if any of them are
-     * unexpected colors. */
-    if(bmp->dib_head.n_colors > 16) {
-        fprintf(stderr, "GFX: Too many colors: %u\n", bmp->dib_head.n_colors);
-        bmp_destroy(bmp);
-        free(bmp);
-        return -1;
+
+    /* Yellow goes first where needed, so darker inks are never picked up on the yellow ribbon */
+    unsigned allowed = (_gfx_state.yellow_first && (todo & RIBBON(YELLOW))) ? RIBBON(YELLOW) : todo;
+
+    for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+        if(!(allowed & (1U << r))) {
+            continue;
+        }
+
+        unsigned pass_head = head;
+        uint64_t prev_cost = cur->cost;
+        cur->cost += _shift_cost(ribbon, r) + _pass_cost(lines, n_lines, r, &pass_head);
+
+        if(cur->cost < best->cost) {
+            cur->order[cur->n++] = r;
+            _plan_search(best, cur, lines, n_lines, todo & ~(1U << r), r, pass_head);
+            cur->n--;
+        }
+        cur->cost = prev_cost;
     }
+}
 
-    uint8_t pal_map[16];
-    for(unsigned i = 0; i < bmp->dib_head.n_colors; i++) {
-        unsigned j = 0;
-        for(; j < IWII_COLOR_MAX + 1; j++) {
-            if(*(uint32_t *)&bmp->palette[i] == _rgb_colors[j]) {
-                pal_map[i] = j;
-                break;
+/**
+ * @brief Get the set of ribbons used in any of the given lines
+ */
+static unsigned _lines_ribbons(const iwii_gfx_line_t *lines, unsigned n_lines) {
+    unsigned used = 0;
+    for(unsigned i = 0; i < n_lines; i++) {
+        for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+            if(lines[i].n_ops[r]) {
+                used |= 1U << r;
             }
         }
-        if(j == (IWII_COLOR_MAX + 1)) {    
-            fprintf(stderr, "GFX: Unsupported palette entry: %08x (r: %u, g: %u, b: %u)\n",
-                    *(uint32_t *)&bmp->palette[i],
-                    bmp->palette[i].red, bmp->palette[i].green, bmp->palette[i].blue);
-            bmp_destroy(bmp);
-            free(bmp);
+    }
+
+    return used;
+}
+
+/**
+ * @brief Choose the order to print the ribbon passes of a band in
+ *
+ * Orderings are compared using a simple mechanical cost model, covering
+ * ribbon shifts and carriage travel, starting from the given ribbon and
+ * head position. Ties are broken in favour of iwii_ribbon_e order.
+ *
+ * @param plan Where to store the plan
+ * @param lines Packed lines making up band
+ * @param n_lines Number of lines in band
+ * @param mask Ribbons to consider, others are left out of the plan
+ * @param ribbon Ribbon selected beforehand
+ * @param head Print head position beforehand
+ */
+static void _plan_band(_band_plan_t *plan, const iwii_gfx_line_t *lines, unsigned n_lines,
+                       unsigned mask, unsigned ribbon, unsigned head) {
+    _band_plan_t cur = { .n = 0, .cost = 0 };
+    plan->n    = 0;
+    plan->cost = UINT64_MAX;
+    plan->head = head;
+    _plan_search(plan, &cur, lines, n_lines, _lines_ribbons(lines, n_lines) & mask, ribbon, head);
+    if(plan->n == 0) {
+        plan->cost = 0;
+    }
+}
+
+/**
+ * @brief Print a single ribbon's pass over a packed line, in whichever direction is closest to the head
+ *
+ * @param out Output stream to write to
+ * @param line Packed line
+ * @param ribbon Ribbon to print, @see iwii_ribbon_e
+ */
+static int iwii_gfx_print_line_color(iwii_out_t *out, const iwii_gfx_line_t *line, unsigned ribbon) {
+    int reverse = _line_reverse(line, ribbon, _gfx_state.head);
+
+    /* Segments are positioned relative to the left margin, so no carriage return is needed */
+    for(unsigned i = 0; i < line->n_segs[ribbon]; i++) {
+        unsigned             seg = reverse ? (line->n_segs[ribbon] - 1 - i) : i;
+        const unsigned      *segs = line->segs[ribbon];
+        const iwii_enc_op_t *last = &line->ops[ribbon][segs[seg + 1] - 1];
+
+        if(iwii_enc_emit(out, &line->ops[ribbon][segs[seg]], segs[seg + 1] - segs[seg],
+                         line->cols[ribbon], _gfx_state.cfg.h_pos)) {
             return -1;
         }
+        _gfx_state.head = _gfx_state.cfg.h_pos + last->start + last->len;
     }
-    
-    unsigned width         = bmp->dib_head.width;
-    unsigned height        = bmp->dib_head.height;
-    unsigned rows_per_line = (_gfx_state.cfg.v_dpi == 144) ? 16 : 8;
-    unsigned lines         = (_gfx_state.cfg.v_dpi == 144) ? (height + 15) / 16 :
-                                                             (height +  7) / 8;
 
-    uint8_t *row_data = malloc(rows_per_line * width);
-    if(row_data == NULL) {
-        free(bmp);
-        return -1;
+    return 0;
+}
+
+/**
+ * @brief Order in which the lines and ribbons of a band are printed
+ *
+ * Each step prints one ribbon of one line. At 144 dpi, the paper is moved by
+ * one dot whenever a step is on a different line than the one before it.
+ */
+typedef struct {
+    struct {
+        uint8_t line;   /**< Line within band, 0 (even) or 1 (odd) */
+        uint8_t ribbon; /**< Ribbon, @see iwii_ribbon_e */
+    } steps[2 * IWII_RIBBON_MAX];
+    unsigned n;         /**< Number of steps */
+} _sched_t;
+
+/**
+ * @brief Append a step to a schedule, if there is anything to print in it
+ */
+static void _sched_add(_sched_t *sched, const iwii_gfx_line_t *lines, unsigned line, unsigned ribbon) {
+    if(lines[line].n_ops[ribbon]) {
+        sched->steps[sched->n].line   = line;
+        sched->steps[sched->n].ribbon = ribbon;
+        sched->n++;
     }
+}
 
-    if(_gfx_state.cfg.flags & IWII_GFX_FLAG_SEQCOLORS) {
-        for(uint8_t color = 0; color < 4; color++) {
-            if(color) {
-                iwii_move_up_lines(fd, lines);
-            }
+/**
+ * @brief Append each ribbon of a plan to a schedule, on a single line
+ */
+static void _sched_add_plan(_sched_t *sched, const iwii_gfx_line_t *lines, unsigned line, const _band_plan_t *plan) {
+    for(unsigned i = 0; i < plan->n; i++) {
+        _sched_add(sched, lines, line, plan->order[i]);
+    }
+}
 
-            /* At most a 4-pass process. Starting with yellow following recommendation
-             * from manual to prevent staining yellow portion of ribbon.1
-             * 0: Yellow
-             * 1: Red
-             * 2: Blue 
-             * 3: Black*/
-            for(unsigned i = 0; i < height; i += rows_per_line) {
-                unsigned rows = rows_per_line;
-                if((height - i) < rows) {
-                    rows = height - i;
-                }
+/**
+ * @brief Cost of moving the paper by a single dot, in microseconds
+ *
+ * @param up Paper is moved backwards, which changes feed direction twice
+ */
+static uint64_t _nudge_cost(int up) {
+    uint64_t cost = IWII_MODEL_FEED_US + (IWII_MODEL_FEED_US_PER_INCH / 144);
 
-                /* Copy and convert pixel data */
-                if(_conv_colors(bmp, pal_map, i, width, rows, row_data)) {
-                    free(row_data);
-                    bmp_destroy(bmp);
-                    free(bmp);
-                    return -1;
-                }
-            
-                if(_gfx_state.cfg.v_dpi == 144) {
-                    iwii_gfx_print_line_color_144dpi(fd, row_data, width, rows, color);
-                } else {
-                    iwii_gfx_print_line_color(fd, row_data, width, rows, color);
-                }
-                
-                write(fd, "\r\n", 2);
-            }
+    return up ? (cost + (2 * IWII_MODEL_REVERSE_US)) : cost;
+}
+
+/**
+ * @brief Cost of a schedule, starting from the current ribbon, head position, and line
+ */
+static uint64_t _sched_cost(const _sched_t *sched, const iwii_gfx_line_t *lines) {
+    unsigned ribbon = _gfx_state.ribbon;
+    unsigned head   = _gfx_state.head;
+    unsigned line   = _gfx_state.v_off;
+    uint64_t cost   = 0;
+
+    for(unsigned i = 0; i < sched->n; i++) {
+        unsigned l = sched->steps[i].line;
+        unsigned r = sched->steps[i].ribbon;
+        if(l != line) {
+            cost += _nudge_cost(l < line);
+            line  = l;
         }
-    } else {
-        for(unsigned i = 0; i < height; i += rows_per_line) {
-            unsigned rows = rows_per_line;
-            if((height - i) < rows) {
-                rows = height - i;
-            }
+        cost  += _shift_cost(ribbon, r) + _line_cost(&lines[l], r, &head, _line_reverse(&lines[l], r, head));
+        ribbon = r;
+    }
 
-            /* Copy and convert pixel data */
-            if(_conv_colors(bmp, pal_map, i, width, rows, row_data)) {
-                free(row_data);
-                bmp_destroy(bmp);
-                free(bmp);
-                return -1;
-            }
-        
-            for(uint8_t color = 0; color < 4; color++) {
-                /* At most a 4-pass process. Starting with yellow following recommendation
-                 * from manual to prevent staining yellow portion of ribbon.1
-                 * 0: Yellow
-                 * 1: Red
-                 * 2: Blue 
-                 * 3: Black*/
-                if(_gfx_state.cfg.v_dpi == 144) {
-                    iwii_gfx_print_line_color_144dpi(fd, row_data, width, rows, color);
-                } else {
-                    iwii_gfx_print_line_color(fd, row_data, width, rows, color);
-                }
-            }
-            write(fd, "\r\n", 2);
+    return cost;
+}
+
+/**
+ * @brief Send all pending paper motion
+ *
+ * Blank bands, rewinds, and the one dot steps between interlaced lines all
+ * add up, and are sent as a single move with as few line feeds as possible.
+ */
+static int _feed_flush(iwii_out_t *out) {
+    int feed = _gfx_state.feed;
+    _gfx_state.feed = 0;
+
+    return iwii_feed(out, feed);
+}
+
+/**
+ * @brief Print a band following a schedule
+ *
+ * The paper is left wherever the last step needs it, @see _next_band
+ *
+ * @param out Output stream to write to
+ * @param lines Packed lines making up band
+ * @param sched Schedule
+ */
+static int _print_sched(iwii_out_t *out, const iwii_gfx_line_t *lines, const _sched_t *sched) {
+    for(unsigned i = 0; i < sched->n; i++) {
+        unsigned line   = sched->steps[i].line;
+        unsigned ribbon = sched->steps[i].ribbon;
+
+        /* Move one dot up or down, along with any motion still pending */
+        _gfx_state.feed += (int)line - (int)_gfx_state.v_off;
+        _gfx_state.v_off = line;
+        if(_feed_flush(out)) {
+            return -1;
+        }
+
+        iwii_set_color(out, _ribbon_color[ribbon]);
+        _gfx_state.ribbon = ribbon;
+
+        if(iwii_gfx_print_line_color(out, &lines[line], ribbon)) {
+            return -1;
         }
     }
 
-    if(_gfx_state.cfg.flags & IWII_GFX_FLAG_RETURNTOTOP) {
-        iwii_move_up_lines(fd, lines);
+    return out->err ? -1 : 0;
+}
+
+/**
+ * @brief Print a single ribbon's pass over a band
+ *
+ * At 144 dpi, the even (0) line is printed, then the paper is advanced by one
+ * dot to print the odd (1) line.
+ *
+ * @param out Output stream to write to
+ * @param lines Packed lines making up band
+ * @param n_lines Number of lines in band, 1 or 2
+ * @param ribbon Ribbon to print, @see iwii_ribbon_e
+ */
+static int _print_pass(iwii_out_t *out, const iwii_gfx_line_t *lines, unsigned n_lines, unsigned ribbon) {
+    _sched_t sched = { .n = 0 };
+    for(unsigned i = 0; i < n_lines; i++) {
+        _sched_add(&sched, lines, i, ribbon);
     }
 
-    free(row_data);
-    bmp_destroy(bmp);
-    free(bmp);
+    return _print_sched(out, lines, &sched);
+}
 
-    return 0;
+/**
+ * @brief Advance the paper to the next band
+ *
+ * The motion is only planned, it is sent along with any other motion up to
+ * whatever is printed next, @see _feed_flush
+ *
+ * @param out Output stream to write to
+ */
+static int _next_band(iwii_out_t *out) {
+    /* The band may have been left on its odd line */
+    _gfx_state.feed += 16 - _gfx_state.v_off;
+    _gfx_state.v_off = 0;
+
+    return out->err ? -1 : 0;
+}
+
+/**
+ * @brief Plan how to print a two line (144 dpi) band
+ *
+ * Candidate schedules, of which the cheapest is used:
+ *  - Row by row: every ribbon of the even line, one feed, then every ribbon
+ *    of the odd line. Needs no reverse feeds, but only keeps yellow first
+ *    when no other ribbon is used, so is only tried then, or when yellow
+ *    need not go first.
+ *  - Yellow first: yellow on both lines, then the other ribbons on the odd
+ *    line, then the even line, with a single reverse feed.
+ *  - Ribbon by ribbon: each ribbon on both lines, alternating which line is
+ *    printed first so the paper moves once per ribbon.
+ */
+static void _plan_interlaced(_sched_t *best, const iwii_gfx_line_t *lines) {
+    unsigned     used = _lines_ribbons(lines, 2);
+    _band_plan_t plan[2];
+    _sched_t     sched;
+    uint64_t     cost;
+
+    /* Ribbon by ribbon */
+    _plan_band(&plan[0], lines, 2, used, _gfx_state.ribbon, _gfx_state.head);
+    best->n = 0;
+    unsigned line = _gfx_state.v_off;
+    for(unsigned i = 0; i < plan[0].n; i++) {
+        unsigned r     = plan[0].order[i];
+        unsigned other = line ^ 1;
+        _sched_add(best, lines, line, r);
+        _sched_add(best, lines, other, r);
+        if(lines[other].n_ops[r]) {
+            line = other;
+        }
+    }
+    uint64_t best_cost = _sched_cost(best, lines);
+
+    if(!_gfx_state.yellow_first || !(used & RIBBON(YELLOW)) || (used == RIBBON(YELLOW))) {
+        /* Row by row */
+        _plan_band(&plan[0], &lines[0], 1, used, _gfx_state.ribbon, _gfx_state.head);
+        unsigned ribbon = plan[0].n ? plan[0].order[plan[0].n - 1] : _gfx_state.ribbon;
+        _plan_band(&plan[1], &lines[1], 1, used, ribbon, plan[0].head);
+
+        sched.n = 0;
+        _sched_add_plan(&sched, lines, 0, &plan[0]);
+        _sched_add_plan(&sched, lines, 1, &plan[1]);
+    } else {
+        /* Yellow first */
+        sched.n = 0;
+        _sched_add(&sched, lines, 0, IWII_RIBBON_YELLOW);
+        _sched_add(&sched, lines, 1, IWII_RIBBON_YELLOW);
+
+        unsigned head = _gfx_state.head;
+        _line_cost(&lines[0], IWII_RIBBON_YELLOW, &head, _line_reverse(&lines[0], IWII_RIBBON_YELLOW, head));
+        _line_cost(&lines[1], IWII_RIBBON_YELLOW, &head, _line_reverse(&lines[1], IWII_RIBBON_YELLOW, head));
+
+        unsigned rest = used & ~RIBBON(YELLOW);
+        _plan_band(&plan[1], &lines[1], 1, rest, IWII_RIBBON_YELLOW, head);
+        unsigned ribbon = plan[1].n ? plan[1].order[plan[1].n - 1] : IWII_RIBBON_YELLOW;
+        _plan_band(&plan[0], &lines[0], 1, rest, ribbon, plan[1].head);
+
+        _sched_add_plan(&sched, lines, 1, &plan[1]);
+        _sched_add_plan(&sched, lines, 0, &plan[0]);
+    }
+
+    cost = _sched_cost(&sched, lines);
+    if(cost < best_cost) {
+        *best = sched;
+    }
+}
+
+/**
+ * @brief Get a line's column byte for a ribbon, 0 outside of its non-empty columns
+ */
+static uint8_t _line_col(const iwii_gfx_line_t *line, unsigned ribbon, int x) {
+    if((line->start[ribbon] < 0) || (x < line->start[ribbon]) || (x > line->end[ribbon])) {
+        return 0;
+    }
+    return line->cols[ribbon][x];
+}
+
+/**
+ * @brief Check whether any yellow dot of a band overlaps or touches a dot of another ribbon
+ *
+ * Only there can the yellow ribbon pick up darker ink from the paper. The
+ * lines of an interlaced band are half a dot apart, so are merged.
+ *
+ * @param lines Packed lines making up band
+ * @param n_lines Number of lines in band
+ */
+static int _yellow_touches(const iwii_gfx_line_t *lines, unsigned n_lines) {
+    int start = INT_MAX, end = -1;
+    for(unsigned i = 0; i < n_lines; i++) {
+        if(lines[i].start[IWII_RIBBON_YELLOW] >= 0) {
+            if(lines[i].start[IWII_RIBBON_YELLOW] < start) {
+                start = lines[i].start[IWII_RIBBON_YELLOW];
+            }
+            if(lines[i].end[IWII_RIBBON_YELLOW] > end) {
+                end = lines[i].end[IWII_RIBBON_YELLOW];
+            }
+        }
+    }
+
+    for(int x = start; x <= end; x++) {
+        uint8_t yellow = 0, dark = 0;
+        for(unsigned i = 0; i < n_lines; i++) {
+            yellow |= _line_col(&lines[i], IWII_RIBBON_YELLOW, x);
+            for(unsigned r = IWII_RIBBON_RED; r < IWII_RIBBON_MAX; r++) {
+                dark |= _line_col(&lines[i], r, x - 1) | _line_col(&lines[i], r, x) |
+                        _line_col(&lines[i], r, x + 1);
+            }
+        }
+        dark |= (uint8_t)(dark << 1) | (dark >> 1);
+        if(yellow & dark) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Print every ribbon pass of a single packed band, in the cheapest order
+ *
+ * @param out Output stream to write to
+ * @param lines Packed lines making up band
+ * @param n_lines Number of lines in band, 1 or 2
+ */
+static int _print_band(iwii_out_t *out, const iwii_gfx_line_t *lines, unsigned n_lines) {
+    _sched_t sched = { .n = 0 };
+
+    _gfx_state.yellow_first = !(_gfx_state.cfg.flags & IWII_GFX_FLAG_RELAXYELLOW) ||
+                              _yellow_touches(lines, n_lines);
+
+    if(n_lines > 1) {
+        _plan_interlaced(&sched, lines);
+    } else {
+        _band_plan_t plan;
+        _plan_band(&plan, lines, 1, RIBBON(YELLOW) | RIBBON(RED) | RIBBON(BLUE) | RIBBON(BLACK),
+                   _gfx_state.ribbon, _gfx_state.head);
+        _sched_add_plan(&sched, lines, 0, &plan);
+    }
+
+    return _print_sched(out, lines, &sched);
+}
+
+int iwii_gfx_print_image(iwii_out_t *out, const uint8_t *data, unsigned width, unsigned height) {
+    if((_gfx_state.cfg.h_pos + width) > IWII_GFX_MAX_DOTS) {
+        fprintf(stderr, "GFX: Image too wide, offset and width (%u + %u dots) exceed %u dots\n",
+                _gfx_state.cfg.h_pos, width, IWII_GFX_MAX_DOTS);
+        return -1;
+    }
+
+    iwii_gfx_line_t line;
+    uint8_t *masks = malloc(8 * width);
+    if(masks == NULL) {
+        return -1;
+    }
+    if(_line_alloc(&line, width)) {
+        free(masks);
+        return -1;
+    }
+
+    /* Start from a known head position */
+    iwii_carriage_return(out);
+    _gfx_state.head = 0;
+
+    for(unsigned i = 0; i < height; i += 8) {
+        unsigned rows = 8;
+        if((height - i) < rows) {
+            rows = height - i;
+        }
+
+        for(unsigned j = 0; j < (rows * width); j++) {
+            uint8_t color = data[(i * width) + j];
+            masks[j] = (color <= IWII_COLOR_MAX) ? iwii_gfx_color_ribbons[color] : 0;
+        }
+        _pack_line(&line, masks, width, 0, rows, 1);
+
+        _print_band(out, &line, 1);
+        _next_band(out);
+    }
+    iwii_carriage_return(out);
+    _gfx_state.head = 0;
+
+    _feed_flush(out);
+    iwii_set_line_spacing(out, 16);
+
+    _line_free(&line);
+    free(masks);
+
+    return 0;
+}
+
+const uint32_t iwii_gfx_color_rgb[IWII_COLOR_MAX + 1] = {
+    [IWII_COLOR_BLACK]  = 0x000000,
+    [IWII_COLOR_YELLOW] = 0xd6d426,
+    [IWII_COLOR_RED]    = 0xb80000,
+    [IWII_COLOR_BLUE]   = 0x005bff,
+    [IWII_COLOR_ORANGE] = 0xff5d00,
+    [IWII_COLOR_GREEN]  = 0x0d8900,
+    [IWII_COLOR_PURPLE] = 0x88004c,
+    [IWII_COLOR_MAX]    = 0xffffff /* White */
+};
+
+/** Ribbon mask marking a palette entry that cannot be printed */
+#define BAD_PIXEL (0x80)
+
+/**
+ * @brief Row decoder, unpacking indexed pixels and mapping them to ribbon masks in one pass
+ */
+typedef struct {
+    unsigned      bpp;          /**< Bits per pixel of source rows (1, 4, or 8) */
+    int           check;        /**< Whether rows may contain BAD_PIXEL, and must be checked */
+    uint8_t       map[256];     /**< Palette index to ribbon mask */
+    uint8_t       lut[256][8];  /**< Source byte to its mapped pixels, for 1 and 4 bpp */
+
+    iwii_quant_t *quant;        /**< Quantizer, if the image is not limited to the printable colors */
+    uint8_t      *bgrx;         /**< Band of pixels for quant, when not taken straight from the image */
+
+    iwii_scale_t *scale;        /**< Scaler, if the image is printed at other than its own size */
+    uint8_t      *src_buf;      /**< Single decoded source row, followed by its expanded pixels, when scaling */
+    unsigned      src_y;        /**< Source row held in src_buf, UINT_MAX if none */
+    int           src_blank;    /**< Whether the row in src_buf is blank */
+} _row_dec_t;
+
+static void _dec_init(_row_dec_t *dec, unsigned bpp) {
+    dec->bpp   = bpp;
+    dec->check = 0;
+    for(unsigned i = 0; i < (1U << bpp); i++) {
+        if(dec->map[i] & BAD_PIXEL) {
+            dec->check = 1;
+        }
+    }
+
+    for(unsigned b = 0; b < 256; b++) {
+        if(bpp == 4) {
+            dec->lut[b][0] = dec->map[b >> 4];
+            dec->lut[b][1] = dec->map[b & 0x0f];
+        } else if(bpp == 1) {
+            for(unsigned i = 0; i < 8; i++) {
+                dec->lut[b][i] = dec->map[(b >> (7 - i)) & 1];
+            }
+        }
+    }
+}
+
+/**
+ * @brief Unpack and map a single row
+ *
+ * @param dec Row decoder
+ * @param dst Output buffer, each byte receiving one pixel's ribbon mask
+ * @param src Raw row data
+ * @param width Width of row, in pixels
+ */
+static void _dec_row(const _row_dec_t *dec, uint8_t *dst, const uint8_t *src, unsigned width) {
+    unsigned x = 0;
+    switch(dec->bpp) {
+        case 8:
+            for(; x < width; x++) {
+                dst[x] = dec->map[src[x]];
+            }
+            break;
+        case 4:
+            for(; (x + 2) <= width; x += 2) {
+                memcpy(&dst[x], dec->lut[*src++], 2);
+            }
+            if(x < width) {
+                dst[x] = dec->lut[*src][0];
+            }
+            break;
+        case 1:
+            for(; (x + 8) <= width; x += 8) {
+                memcpy(&dst[x], dec->lut[*src++], 8);
+            }
+            if(x < width) {
+                memcpy(&dst[x], dec->lut[*src], width - x);
+            }
+            break;
+    }
+}
+
+/**
+ * @brief Decode a source row to ribbon masks, checking for unprintable pixels
+ *
+ * @param bmp BMP handle, with the row loaded
+ * @param dec Row decoder
+ * @param y Source row
+ * @param dst Output buffer, receiving the row's ribbon masks
+ * @return 0 on success, 1 if the row is blank, else < 0
+ */
+static int _dec_masks(bmp_hand_t *bmp, const _row_dec_t *dec, unsigned y, uint8_t *dst) {
+    unsigned width = bmp->dib_head.width;
+    int      blank = 0;
+
+    if(bmp_row_blank(bmp, y)) {
+        /* Nothing but palette index 0, no need to look at the row */
+        memset(dst, dec->map[0], width);
+        blank = 1;
+    } else {
+        _dec_row(dec, dst, bmp_get_row(bmp, y), width);
+    }
+
+    if(dec->check) {
+        for(unsigned x = 0; x < width; x++) {
+            if(dst[x] & BAD_PIXEL) {
+                int idx = bmp_get_pixel(bmp, x, y);
+                if(idx < (int)bmp->dib_head.n_colors) {
+                    fprintf(stderr, "GFX: Unsupported palette entry %d at (%u, %u): %08x (r: %u, g: %u, b: %u)\n",
+                            idx, x, y, *(uint32_t *)&bmp->palette[idx],
+                            bmp->palette[idx].red, bmp->palette[idx].green, bmp->palette[idx].blue);
+                } else {
+                    fprintf(stderr, "GFX: Bad pixel: (%u, %u) -> %d\n", x, y, idx);
+                }
+                return -1;
+            }
+        }
+    }
+
+    return blank;
+}
+
+/**
+ * @brief Decode a source row to palette indexes, checking they are within the palette
+ *
+ * @return 0 on success, else < 0
+ */
+static int _dec_indexes(bmp_hand_t *bmp, const _row_dec_t *dec, unsigned y, uint8_t *dst) {
+    unsigned width = bmp->dib_head.width;
+
+    _dec_row(dec, dst, bmp_get_row(bmp, y), width);
+    for(unsigned x = 0; x < width; x++) {
+        if(dst[x] >= bmp->dib_head.n_colors) {
+            fprintf(stderr, "GFX: Bad pixel: (%u, %u) -> %u\n", x, y, dst[x]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Look up the colors of a row of palette indexes, as BGRX pixels
+ */
+static void _expand(const bmp_hand_t *bmp, uint8_t *dst, const uint8_t *idx, unsigned width) {
+    for(unsigned x = 0; x < width; x++) {
+        memcpy(&dst[x * 4], &bmp->palette[idx[x]], 4);
+    }
+}
+
+/**
+ * @brief Resample the source rows making up an output row, as pixels for the quantizer
+ *
+ * Indexed rows are resampled as palette indexes by nearest, only expanding
+ * the pixels picked, but must be expanded in full to be averaged.
+ *
+ * @param bmp BMP handle, with the source rows loaded
+ * @param dec Row decoder
+ * @param y Output row
+ * @param idx Scratch buffer, receiving one byte per output pixel
+ * @param dst Output buffer, receiving the row's pixels
+ * @return 0 on success, else < 0
+ */
+static int _scale_pixels(bmp_hand_t *bmp, _row_dec_t *dec, unsigned y, uint8_t *idx, uint8_t *dst) {
+    iwii_scale_t *scale   = dec->scale;
+    int           indexed = (bmp->dib_head.bpp <= 8);
+    unsigned      end;
+    unsigned      sy      = iwii_scale_src_rows(scale, y, &end);
+
+    if(scale->kernel == IWII_RESAMPLE_NEAREST) {
+        if(!indexed) {
+            iwii_scale_row(scale, dst, bmp_get_row(bmp, sy), bmp->dib_head.bpp / 8);
+            return 0;
+        }
+        if(sy != dec->src_y) {
+            if(_dec_indexes(bmp, dec, sy, dec->src_buf)) {
+                return -1;
+            }
+            dec->src_y = sy;
+        }
+        iwii_scale_row(scale, idx, dec->src_buf, 1);
+        _expand(bmp, dst, idx, scale->dst_w);
+        return 0;
+    }
+
+    for(; sy < end; sy++) {
+        if(!indexed) {
+            iwii_scale_box_add(scale, bmp_get_row(bmp, sy), bmp->dib_head.bpp / 8);
+            continue;
+        }
+        uint8_t *bgrx = &dec->src_buf[scale->src_w];
+        if(sy != dec->src_y) {
+            if(_dec_indexes(bmp, dec, sy, dec->src_buf)) {
+                return -1;
+            }
+            _expand(bmp, bgrx, dec->src_buf, scale->src_w);
+            dec->src_y = sy;
+        }
+        iwii_scale_box_add(scale, bgrx, 4);
+    }
+    iwii_scale_box_finish(scale, dst);
+
+    return 0;
+}
+
+/**
+ * @brief Quantize a band of pixels to the printable colors, and convert them to ribbon masks
+ *
+ * @see _conv_colors
+ */
+static int _conv_quant(bmp_hand_t *bmp, _row_dec_t *dec, unsigned row, unsigned width, unsigned rows, uint8_t *row_data) {
+    const uint8_t *src[16];
+
+    for(unsigned y = 0; y < rows; y++) {
+        if((dec->scale == NULL) && (bmp->dib_head.bpp > 8)) {
+            src[y] = bmp_get_row(bmp, row + y);
+            continue;
+        }
+
+        uint8_t *idx  = &row_data[y * width];
+        uint8_t *bgrx = &dec->bgrx[y * width * dec->quant->px_sz];
+        if(dec->scale) {
+            if(_scale_pixels(bmp, dec, row + y, idx, bgrx)) {
+                return -1;
+            }
+        } else {
+            /* Unpack palette indexes, then look up their colors */
+            if(_dec_indexes(bmp, dec, row + y, idx)) {
+                return -1;
+            }
+            _expand(bmp, bgrx, idx, width);
+        }
+        src[y] = bgrx;
+    }
+
+    if(iwii_quant_band(dec->quant, src, rows, row_data)) {
+        return -1;
+    }
+    for(unsigned i = 0; i < (rows * width); i++) {
+        row_data[i] = iwii_gfx_color_ribbons[row_data[i]];
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Convert a band of pixels to ribbon masks
+ *
+ * When scaling, the source rows the band is made from are loaded and
+ * resampled as the band is converted, the scaled image is never held whole.
+ *
+ * @param bmp BMP handle
+ * @param dec Row decoder
+ * @param row First row of band, in output rows
+ * @param width Width of output, in pixels
+ * @param rows Number of rows in band
+ * @param row_data Output buffer, each byte receiving one pixel's ribbon mask
+ * @return 0 on success, 1 if there is nothing to print in the band, else < 0
+ */
+static int _conv_colors(bmp_hand_t *bmp, _row_dec_t *dec, unsigned row, unsigned width, unsigned rows, uint8_t *row_data) {
+    unsigned first = row;
+    unsigned end   = row + rows;
+    if(dec->scale) {
+        unsigned tmp;
+        first = iwii_scale_src_rows(dec->scale, row, &tmp);
+        iwii_scale_src_rows(dec->scale, row + rows - 1, &end);
+    }
+    if(bmp_load_band(bmp, first, end - first)) {
+        return -1;
+    }
+    if(dec->quant) {
+        return _conv_quant(bmp, dec, row, width, rows, row_data);
+    }
+
+    int blank = 1;
+    for(unsigned y = row; y < row + rows; y++) {
+        uint8_t *dst = &row_data[(y - row) * width];
+        if(dec->scale == NULL) {
+            int ret = _dec_masks(bmp, dec, y, dst);
+            if(ret < 0) {
+                return -1;
+            }
+            blank &= ret;
+            continue;
+        }
+
+        /* Nearest only, upscaled rows are decoded once */
+        unsigned sy = iwii_scale_src_rows(dec->scale, y, &end);
+        if(sy != dec->src_y) {
+            int ret = _dec_masks(bmp, dec, sy, dec->src_buf);
+            if(ret < 0) {
+                return -1;
+            }
+            dec->src_y     = sy;
+            dec->src_blank = ret;
+        }
+        if(dec->src_blank) {
+            memset(dst, dec->map[0], width);
+        } else {
+            iwii_scale_row(dec->scale, dst, dec->src_buf, 1);
+            blank = 0;
+        }
+    }
+
+    return (blank && (dec->map[0] == 0)) ? 1 : 0;
+}
+
+/** Upper limit on automatically chosen number of threads */
+#define GFX_MAX_THREADS (8)
+
+/**
+ * @brief A band, converted on the calling thread, then packed and encoded on a worker
+ */
+typedef struct {
+    uint8_t        *row_data; /**< Band's ribbon masks */
+    iwii_gfx_line_t lines[2]; /**< Band's packed lines, the second only used at 144 dpi */
+    unsigned        rows;     /**< Number of rows in band */
+    int             conv;     /**< Result of converting the band, 1 if there is nothing to print */
+    int             packed;   /**< Whether lines are ready to be printed */
+} _band_slot_t;
+
+/**
+ * @brief Worker threads packing and encoding bands, in parallel with their conversion and printing
+ *
+ * Band b goes through slot (b % n_slots). The calling thread converts bands
+ * ahead of the one being printed, as conversion reads the image in order and
+ * carries dithering error from band to band. Workers pick them up in order,
+ * but may finish them in any order, bands being taken back in sequence so
+ * output never depends on the number of threads.
+ */
+typedef struct {
+    pthread_t      *threads;
+    unsigned        n_threads; /**< Number of worker threads, 0 to pack on the calling thread */
+    pthread_mutex_t lock;
+    pthread_cond_t  start;     /**< Signalled when queued or stop change */
+    pthread_cond_t  done;      /**< Signalled when a band has been packed */
+    unsigned        queued;    /**< Number of bands converted and handed out */
+    unsigned        next;      /**< Next band to be picked up by a worker */
+    int             stop;      /**< Threads are to exit */
+
+    _band_slot_t   *slots;
+    unsigned        n_slots;   /**< Number of bands in flight at most */
+    unsigned        width;     /**< Width of image, in pixels */
+    unsigned        height;    /**< Height of image, in pixels */
+    unsigned        rows_per_line; /**< Number of rows in each band */
+    unsigned        n_bands;   /**< Number of bands in image */
+} _band_pool_t;
+
+static int _band_slot_alloc(_band_slot_t *slot, unsigned width, unsigned rows_per_line) {
+    slot->row_data = malloc(rows_per_line * width);
+    if(slot->row_data == NULL) {
+        return -1;
+    }
+    if(_line_alloc(&slot->lines[0], width)) {
+        free(slot->row_data);
+        return -1;
+    }
+    if(_line_alloc(&slot->lines[1], width)) {
+        _line_free(&slot->lines[0]);
+        free(slot->row_data);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *_band_worker(void *arg) {
+    _band_pool_t *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;) {
+        while(!pool->stop && (pool->next == pool->queued)) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if(pool->stop) {
+            break;
+        }
+        _band_slot_t *slot = &pool->slots[pool->next++ % pool->n_slots];
+        pthread_mutex_unlock(&pool->lock);
+
+        if(slot->conv == 0) {
+            _pack_band(slot->lines, slot->row_data, pool->width, slot->rows);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        slot->packed = 1;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void _band_pool_destroy(_band_pool_t *pool, unsigned n_started) {
+    if(pool->n_threads) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = 1;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+
+        for(unsigned i = 0; i < n_started; i++) {
+            pthread_join(pool->threads[i], NULL);
+        }
+
+        pthread_cond_destroy(&pool->done);
+        pthread_cond_destroy(&pool->start);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->threads);
+    }
+
+    for(unsigned i = 0; i < pool->n_slots; i++) {
+        _line_free(&pool->slots[i].lines[1]);
+        _line_free(&pool->slots[i].lines[0]);
+        free(pool->slots[i].row_data);
+    }
+    free(pool->slots);
+}
+
+/**
+ * @brief Allocate band slots, and start worker threads
+ *
+ * @param pool Band pool
+ * @param width Width of image, in pixels
+ * @param height Height of image, in pixels
+ * @param rows_per_line Number of rows in each band
+ * @param threads Number of threads to use including the calling thread, 0 to pick based on the number of CPUs
+ * @return 0 on success, else < 0
+ */
+static int _band_pool_init(_band_pool_t *pool, unsigned width, unsigned height, unsigned rows_per_line, unsigned threads) {
+    memset(pool, 0, sizeof(*pool));
+    pool->width         = width;
+    pool->height        = height;
+    pool->rows_per_line = rows_per_line;
+    pool->n_bands       = (height + rows_per_line - 1) / rows_per_line;
+
+    if(threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus < 1) ? 1 : (cpus > GFX_MAX_THREADS) ? GFX_MAX_THREADS : cpus;
+    }
+    /* Not worth it for fewer bands than there are threads */
+    if(threads > pool->n_bands) {
+        threads = pool->n_bands;
+    }
+    pool->n_threads = (threads > 1) ? (threads - 1) : 0;
+    pool->n_slots   = pool->n_threads ? (2 * pool->n_threads) : 1;
+
+    pool->slots = calloc(pool->n_slots, sizeof(_band_slot_t));
+    if(pool->slots == NULL) {
+        return -1;
+    }
+    for(unsigned i = 0; i < pool->n_slots; i++) {
+        if(_band_slot_alloc(&pool->slots[i], width, rows_per_line)) {
+            pool->n_slots = i;
+            _band_pool_destroy(pool, 0);
+            return -1;
+        }
+    }
+
+    if(pool->n_threads) {
+        pool->threads = calloc(pool->n_threads, sizeof(pthread_t));
+        if(pool->threads == NULL) {
+            pool->n_threads = 0;
+            _band_pool_destroy(pool, 0);
+            return -1;
+        }
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->start, NULL);
+        pthread_cond_init(&pool->done, NULL);
+
+        for(unsigned i = 0; i < pool->n_threads; i++) {
+            if(pthread_create(&pool->threads[i], NULL, _band_worker, pool)) {
+                _band_pool_destroy(pool, i);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Get a band, converted and packed, converting the bands after it for workers to pack meanwhile
+ *
+ * Bands must be requested in order, the previous band's slot being reused.
+ *
+ * @param pool Band pool
+ * @param bmp BMP handle
+ * @param dec Row decoder
+ * @param b Band number
+ * @return Band's slot, NULL on failure
+ */
+static _band_slot_t *_band_pool_get(_band_pool_t *pool, bmp_hand_t *bmp, _row_dec_t *dec, unsigned b) {
+    /* Only the calling thread changes queued */
+    while((pool->queued < pool->n_bands) && (pool->queued < (b + pool->n_slots))) {
+        unsigned      i    = pool->queued * pool->rows_per_line;
+        _band_slot_t *slot = &pool->slots[pool->queued % pool->n_slots];
+
+        slot->rows = pool->rows_per_line;
+        if((pool->height - i) < slot->rows) {
+            slot->rows = pool->height - i;
+        }
+        slot->packed = 0;
+        slot->conv   = _conv_colors(bmp, dec, i, pool->width, slot->rows, slot->row_data);
+        if(slot->conv < 0) {
+            return NULL;
+        }
+
+        if(pool->n_threads == 0) {
+            if(slot->conv == 0) {
+                _pack_band(slot->lines, slot->row_data, pool->width, slot->rows);
+            }
+            slot->packed = 1;
+            pool->queued++;
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->queued++;
+        pthread_cond_signal(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    _band_slot_t *slot = &pool->slots[b % pool->n_slots];
+    if(pool->n_threads) {
+        pthread_mutex_lock(&pool->lock);
+        while(!slot->packed) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return slot;
+}
+
+int iwii_gfx_print_bmp(iwii_out_t *out, int bmp_fd) {
+    bmp_hand_t *bmp = malloc(sizeof(*bmp));
+    if(bmp == NULL) {
+        return -1;
+    }
+    if(bmp_open(bmp, bmp_fd)) {
+        free(bmp);
+        return -1;
+    }
+
+    _row_dec_t *dec = malloc(sizeof(*dec));
+    if(dec == NULL) {
+        bmp_destroy(bmp);
+        free(bmp);
+        return -1;
+    }
+
+    /* Map palette entries directly to the set of ribbons they require.
+     * @note Even if the file is only using 8 colors, the palette may hold more
+     * entries. ImageMagick for instance pads 4 bpp palettes to 16 entries, and
+     * 8 bpp palettes are often padded out to 256. So unexpected colors only
+     * result in failure if a pixel actually uses them. */
+    memset(dec->map, BAD_PIXEL, sizeof(dec->map));
+    dec->quant   = NULL;
+    dec->bgrx    = NULL;
+    dec->scale   = NULL;
+    dec->src_buf = NULL;
+    dec->src_y   = UINT_MAX;
+    int exact = (bmp->dib_head.bpp <= 8);
+    for(unsigned i = 0; i < bmp->dib_head.n_colors; i++) {
+        for(unsigned j = 0; j < IWII_COLOR_MAX + 1; j++) {
+            if((*(uint32_t *)&bmp->palette[i] & 0xffffff) == iwii_gfx_color_rgb[j]) {
+                dec->map[i] = iwii_gfx_color_ribbons[j];
+                break;
+            }
+        }
+        if(dec->map[i] & BAD_PIXEL) {
+            exact = 0;
+        }
+    }
+
+    unsigned width         = bmp->dib_head.width;
+    unsigned height        = bmp->height;
+    if(_gfx_state.cfg.width || _gfx_state.cfg.height) {
+        /* A dimension not given keeps the image's aspect ratio, taking its
+         * pixels to be square */
+        uint64_t h_dpi = _gfx_state.cfg.h_dpi;
+        uint64_t v_dpi = _gfx_state.cfg.v_dpi;
+        unsigned w     = _gfx_state.cfg.width;
+        unsigned h     = _gfx_state.cfg.height;
+        if(!w) {
+            w = ((2 * (uint64_t)h * width * h_dpi) + (height * v_dpi)) / (2 * height * v_dpi);
+        } else if(!h) {
+            h = ((2 * (uint64_t)w * height * v_dpi) + (width * h_dpi)) / (2 * width * h_dpi);
+        }
+        width  = w ? w : 1;
+        height = h ? h : 1;
+    }
+    unsigned rows_per_line = (_gfx_state.cfg.v_dpi == 144) ? 16 : 8;
+    unsigned lines         = (_gfx_state.cfg.v_dpi == 144) ? (height + 15) / 16 :
+                                                             (height +  7) / 8;
+    unsigned n_lines       = (_gfx_state.cfg.v_dpi == 144) ? 2 : 1;
+
+    int ret = -1;
+
+    if((_gfx_state.cfg.h_pos + width) > IWII_GFX_MAX_DOTS) {
+        fprintf(stderr, "GFX: Image too wide, offset and width (%u + %u dots) exceed %u dots\n",
+                _gfx_state.cfg.h_pos, width, IWII_GFX_MAX_DOTS);
+        goto print_bmp_nomem;
+    }
+
+    if((width != bmp->dib_head.width) || (height != bmp->height)) {
+        dec->scale = malloc(sizeof(iwii_scale_t));
+        if((dec->scale == NULL) ||
+           iwii_scale_init(dec->scale, _gfx_state.cfg.resample, bmp->dib_head.width, bmp->height, width, height)) {
+            free(dec->scale);
+            dec->scale = NULL;
+            goto print_bmp_nomem;
+        }
+        /* Averaging makes colors of its own */
+        if(_gfx_state.cfg.resample == IWII_RESAMPLE_BOX) {
+            exact = 0;
+        }
+
+        dec->src_buf = malloc(bmp->dib_head.width * 5);
+        if(dec->src_buf == NULL) {
+            goto print_bmp_nomem;
+        }
+    }
+
+    /* Anything but an image drawn only in the printable colors is quantized
+     * to them, indexed images going through their palette first. */
+    if(exact) {
+        _dec_init(dec, bmp->dib_head.bpp);
+    } else {
+        unsigned px_sz = (bmp->dib_head.bpp > 8) ? (bmp->dib_head.bpp / 8) : 4;
+        if(dec->scale && (dec->scale->kernel == IWII_RESAMPLE_BOX)) {
+            px_sz = 3;
+        }
+
+        if(bmp->dib_head.bpp <= 8) {
+            for(unsigned i = 0; i < 256; i++) {
+                dec->map[i] = i;
+            }
+            _dec_init(dec, bmp->dib_head.bpp);
+            dec->check = 0;
+        }
+        if((bmp->dib_head.bpp <= 8) || dec->scale) {
+            dec->bgrx = malloc(rows_per_line * width * px_sz);
+            if(dec->bgrx == NULL) {
+                goto print_bmp_nomem;
+            }
+        }
+
+        dec->quant = malloc(sizeof(iwii_quant_t));
+        if((dec->quant == NULL) ||
+           iwii_quant_init(dec->quant, iwii_gfx_color_rgb, IWII_COLOR_MAX + 1, _gfx_state.cfg.dither,
+                           width, px_sz, _gfx_state.cfg.threads)) {
+            free(dec->quant);
+            dec->quant = NULL;
+            goto print_bmp_nomem;
+        }
+    }
+
+    iwii_gfx_line_t band[2];
+    if(_line_alloc(&band[0], width)) {
+        goto print_bmp_nomem;
+    }
+    if(_line_alloc(&band[1], width)) {
+        goto print_bmp_noband1;
+    }
+    _band_pool_t pool;
+    if(_band_pool_init(&pool, width, height, rows_per_line, _gfx_state.cfg.threads)) {
+        goto print_bmp_nopool;
+    }
+
+    _planes_t planes = { 0 };
+    _usage_t  usage;
+    if(_usage_init(&usage, lines)) {
+        goto print_bmp_fail;
+    }
+
+    /* Start from a known head position */
+    iwii_carriage_return(out);
+    _gfx_state.head = 0;
+
+    if(_gfx_state.cfg.flags & IWII_GFX_FLAG_SEQCOLORS) {
+        /* Convert the whole image up front, keeping every ribbon's column
+         * bytes, to find out which passes are needed at all */
+        if(_planes_init(&planes, lines * n_lines)) {
+            goto print_bmp_fail;
+        }
+        for(unsigned b = 0; b < lines; b++) {
+            _band_slot_t *slot = _band_pool_get(&pool, bmp, dec, b);
+            if(slot == NULL) {
+                goto print_bmp_fail;
+            } else if(slot->conv == 0) {
+                for(unsigned l = 0; l < n_lines; l++) {
+                    if(_planes_add(&planes, (b * n_lines) + l, &slot->lines[l], 0)) {
+                        goto print_bmp_fail;
+                    }
+                }
+            }
+            _usage_add(&usage, b, _planes_ribbons(&planes, b * n_lines, n_lines));
+        }
+
+        /* A pass per ribbon used, in iwii_ribbon_e order, but always at
+         * least one to feed the paper past the image. Only the order
+         * segments are visited in is planned. */
+        unsigned todo   = usage.used ? usage.used : RIBBON(BLACK);
+        unsigned passes = 0;
+        for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+            passes += (todo >> r) & 1;
+        }
+        if(_gfx_state.cfg.verbose) {
+            _usage_report(&usage, width, height, passes);
+        }
+
+        passes = 0;
+        for(uint8_t ribbon = 0; ribbon < IWII_RIBBON_MAX; ribbon++) {
+            if(!(todo & (1U << ribbon))) {
+                continue;
+            }
+            if(passes++) {
+                /* Back to the top, merged with the feeds around it */
+                _gfx_state.feed -= 16 * lines;
+            }
+
+            for(unsigned b = 0; b < lines; b++) {
+                if(usage.bands[b] & (1U << ribbon)) {
+                    for(unsigned l = 0; l < n_lines; l++) {
+                        _planes_load(&planes, (b * n_lines) + l, &band[l], ribbon);
+                    }
+                    if(_print_pass(out, band, n_lines, ribbon)) {
+                        goto print_bmp_fail;
+                    }
+                }
+                _next_band(out);
+                /* Let the writer start on this band while the next is prepared */
+                if(iwii_out_yield(out)) {
+                    goto print_bmp_fail;
+                }
+            }
+        }
+    } else {
+        for(unsigned b = 0; b < lines; b++) {
+            /* Converted and packed, while the bands after it are packed by the workers */
+            _band_slot_t *slot = _band_pool_get(&pool, bmp, dec, b);
+            if(slot == NULL) {
+                goto print_bmp_fail;
+            } else if(slot->conv == 0) {
+                /* At most a 4-pass process, in the cheapest order */
+                if(_print_band(out, slot->lines, n_lines)) {
+                    goto print_bmp_fail;
+                }
+                _usage_add(&usage, b, _lines_ribbons(slot->lines, n_lines));
+            }
+            _next_band(out);
+            /* Let the writer start on this band while the next is converted */
+            if(iwii_out_yield(out)) {
+                goto print_bmp_fail;
+            }
+        }
+
+        if(_gfx_state.cfg.verbose) {
+            _usage_report(&usage, width, height, 0);
+        }
+    }
+
+    iwii_carriage_return(out);
+    _gfx_state.head = 0;
+
+    if(_gfx_state.cfg.flags & IWII_GFX_FLAG_RETURNTOTOP) {
+        _gfx_state.feed -= 16 * lines;
+    }
+    /* Leave the paper where the image ends, and the band spacing set */
+    if(_feed_flush(out) ||
+       iwii_set_line_spacing(out, 16)) {
+        goto print_bmp_fail;
+    }
+
+    ret = 0;
+
+print_bmp_fail:
+    _planes_free(&planes);
+    free(usage.bands);
+    _band_pool_destroy(&pool, pool.n_threads);
+print_bmp_nopool:
+    _line_free(&band[1]);
+print_bmp_noband1:
+    _line_free(&band[0]);
+print_bmp_nomem:
+    if(dec->quant) {
+        iwii_quant_destroy(dec->quant);
+        free(dec->quant);
+    }
+    if(dec->scale) {
+        iwii_scale_destroy(dec->scale);
+        free(dec->scale);
+    }
+    free(dec->bgrx);
+    free(dec->src_buf);
+    free(dec);
+    bmp_destroy(bmp);
+    free(bmp);
+
+    return ret;
 }
 
-int iwii_gfx_test(int fd) {
+int iwii_gfx_test(iwii_out_t *out) {
     iwii_gfx_params_t params = {
         .flags     = 0,
         .h_dpi     = 72,
@@ -401,7 +1773,7 @@ int iwii_gfx_test(int fd) {
         .h_pos     = 0
     };
 
-    if(iwii_gfx_init(fd, &params)) {
+    if(iwii_gfx_init(out, &params)) {
         return -1;
     }
 
@@ -415,7 +1787,7 @@ int iwii_gfx_test(int fd) {
                             3, 3, 4, 4, 5, 5, 6, 6,
                             3, 3, 4, 4, 5, 5, 6, 6 };
 
-    if(iwii_gfx_print_image(fd, img, 8, 8)) {
+    if(iwii_gfx_print_image(out, img, 8, 8)) {
         return -1;
     }
 #else
@@ -424,7 +1796,7 @@ int iwii_gfx_test(int fd) {
         return -1;
     }
 
-    if(iwii_gfx_print_bmp(fd, fd_bmp)) {
+    if(iwii_gfx_print_bmp(out, fd_bmp)) {
         return -1;
     }
 #endif
@@ -0,0 +1,133 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "iwii_job.h"
+
+char *iwii_job_socket_path(void) {
+    const char *env;
+    char        path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+    if((env = getenv("IWII_SOCKET")) && env[0]) {
+        return strdup(env);
+    } else if((env = getenv("XDG_RUNTIME_DIR")) && env[0]) {
+        snprintf(path, sizeof(path), "%s/iwiid.sock", env);
+    } else {
+        snprintf(path, sizeof(path), "/tmp/iwiid-%u.sock", (unsigned)getuid());
+    }
+
+    return strdup(path);
+}
+
+/**
+ * @brief Write exactly len bytes, retrying on short writes
+ *
+ * @return 0 on success, else < 0
+ */
+static int _write_full(int fd, const void *buf, size_t len) {
+    const uint8_t *ptr = buf;
+    while(len) {
+        ssize_t wr = write(fd, ptr, len);
+        if(wr < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += wr;
+        len -= wr;
+    }
+
+    return 0;
+}
+
+int iwii_job_connect(const char *path, unsigned priority) {
+    if(priority > IWII_JOB_PRIORITY_MAX) {
+        return -1;
+    }
+
+    char *def = NULL;
+    if(path == NULL) {
+        path = def = iwii_job_socket_path();
+        if(path == NULL) {
+            return -1;
+        }
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "JOB: Socket path `%s` is too long\n", path);
+        free(def);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        fprintf(stderr, "JOB: Could not create socket: %s\n", strerror(errno));
+        free(def);
+        return -1;
+    }
+
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "JOB: Could not connect to iwiid at `%s`: %s\n", path, strerror(errno));
+        close(fd);
+        free(def);
+        return -1;
+    }
+    free(def);
+
+    iwii_job_header_t head = {
+        .magic    = IWII_JOB_MAGIC,
+        .version  = IWII_JOB_VERSION,
+        .priority = priority,
+        .flags    = 0
+    };
+    if(_write_full(fd, &head, sizeof(head))) {
+        fprintf(stderr, "JOB: Could not send job header: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int iwii_job_finish(int fd, uint32_t *id) {
+    if(shutdown(fd, SHUT_WR)) {
+        fprintf(stderr, "JOB: Could not finish job: %s\n", strerror(errno));
+        return -1;
+    }
+
+    iwii_job_reply_t reply;
+    size_t           len = 0;
+    while(len < sizeof(reply)) {
+        ssize_t rd = read(fd, (uint8_t *)&reply + len, sizeof(reply) - len);
+        if(rd < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "JOB: Could not read reply: %s\n", strerror(errno));
+            return -1;
+        } else if(rd == 0) {
+            fprintf(stderr, "JOB: iwiid closed the connection without replying\n");
+            return -1;
+        }
+        len += rd;
+    }
+
+    if(reply.status < 0) {
+        fprintf(stderr, "JOB: iwiid rejected the job\n");
+        return -1;
+    }
+    if(id) {
+        *id = reply.id;
+    }
+
+    return 0;
+}
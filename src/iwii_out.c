@@ -0,0 +1,443 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "iwii_out.h"
+
+/**
+ * @brief Writer thread, and the ring of buffers it drains
+ *
+ * Buffers are queued in ring order, so the buffer being filled is always the
+ * one following the last queued buffer.
+ */
+struct iwii_out_pipe_struct {
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;    /**< Signalled whenever head, count, or done change */
+
+    uint8_t        *bufs;    /**< All buffers, each out->sz bytes */
+    size_t         *lens;    /**< Number of bytes queued in each buffer */
+    unsigned        n_bufs;  /**< Number of buffers */
+    unsigned        head;    /**< Oldest queued buffer */
+    unsigned        count;   /**< Number of queued buffers */
+    int             done;    /**< No more buffers will be queued */
+    int             err;     /**< Set by writer once a write fails */
+};
+
+int iwii_out_init(iwii_out_t *out, int fd, size_t sz) {
+    memset(out, 0, sizeof(*out));
+
+    if(sz == 0) {
+        sz = IWII_OUT_DEFAULT_SZ;
+    }
+
+    out->buf = malloc(sz);
+    if(out->buf == NULL) {
+        fprintf(stderr, "OUT: Could not allocate output buffer\n");
+        return -1;
+    }
+    out->fd = fd;
+    out->sz = sz;
+
+    return 0;
+}
+
+int iwii_out_init_sink(iwii_out_t *out, iwii_out_sink_t sink, void *arg, size_t sz) {
+    if(iwii_out_init(out, -1, sz)) {
+        return -1;
+    }
+    out->sink     = sink;
+    out->sink_arg = arg;
+
+    return 0;
+}
+
+static void _stop_writer(iwii_out_t *out);
+
+int iwii_out_destroy(iwii_out_t *out) {
+    int ret = iwii_out_flush(out);
+
+    if(out->pipe) {
+        _stop_writer(out);
+        if(out->err) {
+            ret = -1;
+        }
+        /* buf pointed into the ring, which is now gone */
+        out->buf = NULL;
+    }
+
+    free(out->buf);
+    out->buf = NULL;
+    out->sz  = 0;
+
+    return ret;
+}
+
+/**
+ * @brief Write out a set of buffers in full, retrying on short writes
+ *
+ * @param fd File descriptor to write to
+ * @param iov Buffers to write, modified in-place
+ * @param iovcnt Number of buffers
+ * @return 0 on success, else < 0
+ */
+static int _writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while(iovcnt) {
+        ssize_t wr = writev(fd, iov, iovcnt);
+        if(wr < 0) {
+            if(errno == EINTR) {
+                continue;
+            } else if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                /* Non-blocking output, wait until the device can take more */
+                struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+                if((poll(&pfd, 1, -1) < 0) && (errno != EINTR)) {
+                    fprintf(stderr, "OUT: poll: %s\n", strerror(errno));
+                    return -1;
+                }
+                continue;
+            }
+            fprintf(stderr, "OUT: write: %s\n", strerror(errno));
+            return -1;
+        }
+
+        /* Skip past everything that was written */
+        while(iovcnt && ((size_t)wr >= iov->iov_len)) {
+            wr -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt) {
+            iov->iov_base  = (uint8_t *)iov->iov_base + wr;
+            iov->iov_len  -= wr;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Send a set of buffers to the stream's sink or file descriptor
+ */
+static int _send(iwii_out_t *out, struct iovec *iov, int iovcnt) {
+    if(out->sink == NULL) {
+        return _writev_all(out->fd, iov, iovcnt);
+    }
+
+    for(int i = 0; i < iovcnt; i++) {
+        if(out->sink(out->sink_arg, iov[i].iov_base, iov[i].iov_len)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void *_writer(void *arg) {
+    iwii_out_t                  *out  = arg;
+    struct iwii_out_pipe_struct *pipe = out->pipe;
+
+    pthread_mutex_lock(&pipe->lock);
+    while(1) {
+        while((pipe->count == 0) && !pipe->done) {
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        }
+        if(pipe->count == 0) {
+            break;
+        }
+
+        unsigned idx = pipe->head;
+        pthread_mutex_unlock(&pipe->lock);
+
+        /* After an error, keep draining so the producer is never left waiting */
+        int failed = pipe->err;
+        if(!failed) {
+            /* Blocks for as long as flow control holds the device off */
+            struct iovec iov = { .iov_base = &pipe->bufs[idx * out->sz], .iov_len = pipe->lens[idx] };
+            failed = _send(out, &iov, 1) ? 1 : 0;
+        }
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->err  = failed;
+        pipe->head = (pipe->head + 1) % pipe->n_bufs;
+        pipe->count--;
+        pthread_cond_broadcast(&pipe->cond);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    return NULL;
+}
+
+int iwii_out_start_writer(iwii_out_t *out, unsigned n_bufs) {
+    if(out->pipe || out->len) {
+        return -1;
+    }
+    if(n_bufs == 0) {
+        n_bufs = IWII_OUT_DEFAULT_BUFS;
+    } else if(n_bufs < 2) {
+        return -1;
+    }
+
+    struct iwii_out_pipe_struct *pipe = calloc(1, sizeof(*pipe));
+    if(pipe == NULL) {
+        fprintf(stderr, "OUT: Could not allocate writer\n");
+        return -1;
+    }
+    pipe->n_bufs  = n_bufs;
+    pipe->bufs    = malloc(n_bufs * out->sz);
+    pipe->lens    = malloc(n_bufs * sizeof(*pipe->lens));
+    if((pipe->bufs == NULL) || (pipe->lens == NULL)) {
+        fprintf(stderr, "OUT: Could not allocate writer buffers\n");
+        goto start_fail;
+    }
+
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+
+    out->pipe = pipe;
+    int err = pthread_create(&pipe->thread, NULL, _writer, out);
+    if(err) {
+        fprintf(stderr, "OUT: Could not start writer: %s\n", strerror(err));
+        out->pipe = NULL;
+        pthread_cond_destroy(&pipe->cond);
+        pthread_mutex_destroy(&pipe->lock);
+        goto start_fail;
+    }
+
+    /* Fill the ring's buffers from now on */
+    free(out->buf);
+    out->buf = pipe->bufs;
+
+    return 0;
+
+start_fail:
+    free(pipe->lens);
+    free(pipe->bufs);
+    free(pipe);
+    return -1;
+}
+
+/**
+ * @brief Wait for the writer to send everything queued, then stop it
+ */
+static void _stop_writer(iwii_out_t *out) {
+    struct iwii_out_pipe_struct *pipe = out->pipe;
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->done = 1;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+    pthread_join(pipe->thread, NULL);
+
+    if(pipe->err) {
+        out->err = 1;
+    }
+
+    pthread_cond_destroy(&pipe->cond);
+    pthread_mutex_destroy(&pipe->lock);
+    free(pipe->lens);
+    free(pipe->bufs);
+    free(pipe);
+    out->pipe = NULL;
+}
+
+/**
+ * @brief Queue the current buffer for the writer, and move on to the next free one
+ */
+static int _queue(iwii_out_t *out) {
+    struct iwii_out_pipe_struct *pipe = out->pipe;
+
+    pthread_mutex_lock(&pipe->lock);
+    unsigned idx = (pipe->head + pipe->count) % pipe->n_bufs;
+    pipe->lens[idx] = out->len;
+    pipe->count++;
+    pthread_cond_broadcast(&pipe->cond);
+
+    /* Wait for a free buffer */
+    while(pipe->count == pipe->n_bufs) {
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+    }
+    idx = (pipe->head + pipe->count) % pipe->n_bufs;
+    int err = pipe->err;
+    pthread_mutex_unlock(&pipe->lock);
+
+    out->buf = &pipe->bufs[idx * out->sz];
+    out->len = 0;
+    if(err) {
+        out->err = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Pass a copy of data on to the tee, if any
+ *
+ * A failing tee is dropped, the stream itself carrying on without it.
+ */
+static void _tee(iwii_out_t *out, const void *data, size_t len) {
+    if(out->tee && len && out->tee(out->tee_arg, data, len)) {
+        out->tee = NULL;
+    }
+}
+
+uint64_t iwii_out_tell(const iwii_out_t *out) {
+    return out->flushed + out->len;
+}
+
+int iwii_out_yield(iwii_out_t *out) {
+    if(out->mark) {
+        out->mark(out->mark_arg, iwii_out_tell(out));
+    }
+
+    if(out->pipe) {
+        return iwii_out_flush(out);
+    }
+
+    return out->err ? -1 : 0;
+}
+
+int iwii_out_flush(iwii_out_t *out) {
+    if(out->err) {
+        return -1;
+    }
+    if(out->len == 0) {
+        return 0;
+    }
+    out->flushed += out->len;
+    _tee(out, out->buf, out->len);
+
+    if(out->pipe) {
+        return _queue(out);
+    }
+
+    struct iovec iov = { .iov_base = out->buf, .iov_len = out->len };
+    out->len = 0;
+    if(_send(out, &iov, 1)) {
+        out->err = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+int iwii_out_write(iwii_out_t *out, const void *data, size_t len) {
+    if(out->err) {
+        return -1;
+    }
+
+    if(len <= (out->sz - out->len)) {
+        memcpy(&out->buf[out->len], data, len);
+        out->len += len;
+        if(out->len == out->sz) {
+            return iwii_out_flush(out);
+        }
+        return 0;
+    }
+
+    if(out->pipe) {
+        /* The writer sends straight from the ring, so everything is copied into it */
+        const uint8_t *ptr = data;
+        while(len) {
+            size_t part = out->sz - out->len;
+            if(part > len) {
+                part = len;
+            }
+            memcpy(&out->buf[out->len], ptr, part);
+            out->len += part;
+            ptr      += part;
+            len      -= part;
+            if((out->len == out->sz) && iwii_out_flush(out)) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    if(len < (out->sz / 2)) {
+        /* Small enough to be worth buffering, top off buffer then continue */
+        size_t part = out->sz - out->len;
+        memcpy(&out->buf[out->len], data, part);
+        out->len = out->sz;
+        if(iwii_out_flush(out)) {
+            return -1;
+        }
+        memcpy(out->buf, (const uint8_t *)data + part, len - part);
+        out->len = len - part;
+        return 0;
+    }
+
+    /* Large write, send it along with anything already buffered */
+    struct iovec iov[2] = {
+        { .iov_base = out->buf,      .iov_len = out->len },
+        { .iov_base = (void *)data,  .iov_len = len      }
+    };
+    out->flushed += out->len + len;
+    out->len      = 0;
+    _tee(out, iov[0].iov_base, iov[0].iov_len);
+    _tee(out, data, len);
+    if(_send(out, (iov[0].iov_len ? &iov[0] : &iov[1]),
+                  (iov[0].iov_len ? 2       : 1))) {
+        out->err = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+int iwii_out_putc(iwii_out_t *out, char c) {
+    if(out->len < out->sz) {
+        out->buf[out->len++] = c;
+        if(out->len == out->sz) {
+            return iwii_out_flush(out);
+        }
+        return out->err ? -1 : 0;
+    }
+
+    return iwii_out_write(out, &c, 1);
+}
+
+int iwii_out_puts(iwii_out_t *out, const char *str) {
+    return iwii_out_write(out, str, strlen(str));
+}
+
+/** Powers of ten, the smallest number needing one more digit than the index */
+static const unsigned _pow10[10] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+int iwii_out_dec(iwii_out_t *out, unsigned val, unsigned digits) {
+    char str[10];
+
+    if((digits == 0) || (digits > sizeof(str))) {
+        return -1;
+    }
+    if((digits < sizeof(str)) && (val >= _pow10[digits])) {
+        /* Dropping digits would send a different number */
+        fprintf(stderr, "OUT: %u does not fit in %u digits\n", val, digits);
+        out->err = 1;
+        return -1;
+    }
+
+    for(unsigned i = digits; i > 0; i--) {
+        str[i - 1] = '0' + (val % 10);
+        val /= 10;
+    }
+
+    return iwii_out_write(out, str, digits);
+}
+
+int iwii_out_cmd(iwii_out_t *out, char cmd, unsigned val, unsigned digits) {
+    char esc[] = { '\033', cmd };
+
+    if(iwii_out_write(out, esc, sizeof(esc))) {
+        return -1;
+    }
+
+    return iwii_out_dec(out, val, digits);
+}
@@ -0,0 +1,223 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define PACK_X86 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#  include <arm_neon.h>
+#  define PACK_NEON 1
+#endif
+
+#include "iwii.h"
+#include "iwii_pack.h"
+
+/**
+ * @brief Column packing kernel
+ *
+ * Packs as many columns as fit the kernel's vector width, starting from
+ * column 0, and returns the number of columns handled. The remainder is
+ * left to _pack_portable().
+ */
+typedef unsigned (*_pack_kern_t)(uint8_t *const *cols, int *start, int *end,
+                                 const uint8_t *const *rows, unsigned nrows, unsigned width);
+
+/**
+ * @brief Update a ribbon's extents from a chunk's non-empty column bitmap
+ *
+ * @param nz Bitmap of non-empty columns, bit i representing column `base + i`
+ */
+static inline void _extend(int *start, int *end, unsigned base, uint32_t nz) {
+    if(nz) {
+        if(*start < 0) {
+            *start = base + __builtin_ctz(nz);
+        }
+        *end = base + (31 - __builtin_clz(nz));
+    }
+}
+
+/** Ribbon mask spread out such that each ribbon's bit is in the LSB of its own byte */
+#define LANES(m) ((((m) & 1U) <<  0) | (((m) & 2U) <<  7) | \
+                  (((m) & 4U) << 14) | (((m) & 8U) << 21))
+static const uint32_t _ribbon_lanes[16] = {
+    LANES( 0), LANES( 1), LANES( 2), LANES( 3), LANES( 4), LANES( 5), LANES( 6), LANES( 7),
+    LANES( 8), LANES( 9), LANES(10), LANES(11), LANES(12), LANES(13), LANES(14), LANES(15)
+};
+
+/**
+ * @brief Portable packer, builds all four ribbons' column bytes at once, one per byte lane
+ */
+static void _pack_portable(uint8_t *const *cols, int *start, int *end,
+                           const uint8_t *const *rows, unsigned nrows, unsigned first, unsigned width) {
+    for(unsigned j = first; j < width; j++) {
+        uint32_t acc = 0;
+        for(unsigned n = 0; n < nrows; n++) {
+            acc |= _ribbon_lanes[rows[n][j] & 0x0f] << n;
+        }
+
+        for(unsigned r = 0; r < IWII_RIBBON_MAX; r++, acc >>= 8) {
+            uint8_t col = acc & 0xff;
+            cols[r][j] = col;
+            if(col) {
+                if(start[r] < 0) {
+                    start[r] = j;
+                }
+                end[r] = j;
+            }
+        }
+    }
+}
+
+/*
+ * The vector kernels do not need a full bit-matrix transpose: masking out
+ * ribbon r's bit of row n and shifting it by (n - r) lands it at bit n of the
+ * same byte, so every byte lane assembles its own column byte. The shifts are
+ * done on 16-bit lanes, which is safe as the masked bit never crosses into
+ * the neighbouring byte. movemask is then used to find the extents.
+ */
+
+#ifdef PACK_X86
+/* Needs its own target, as 32-bit x86 builds need not assume SSE2 */
+__attribute__((target("sse2")))
+static unsigned _pack_sse2(uint8_t *const *cols, int *start, int *end,
+                           const uint8_t *const *rows, unsigned nrows, unsigned width) {
+    unsigned j = 0;
+    for(; (j + 16) <= width; j += 16) {
+        __m128i acc[IWII_RIBBON_MAX] = { _mm_setzero_si128(), _mm_setzero_si128(),
+                                         _mm_setzero_si128(), _mm_setzero_si128() };
+        for(unsigned n = 0; n < nrows; n++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)&rows[n][j]);
+            for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+                __m128i b = _mm_and_si128(v, _mm_set1_epi8(1 << r));
+                b = (n >= r) ? _mm_sll_epi16(b, _mm_cvtsi32_si128(n - r)) :
+                               _mm_srl_epi16(b, _mm_cvtsi32_si128(r - n));
+                acc[r] = _mm_or_si128(acc[r], b);
+            }
+        }
+        for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+            _mm_storeu_si128((__m128i *)&cols[r][j], acc[r]);
+            uint32_t nz = ~_mm_movemask_epi8(_mm_cmpeq_epi8(acc[r], _mm_setzero_si128())) & 0xffff;
+            _extend(&start[r], &end[r], j, nz);
+        }
+    }
+
+    return j;
+}
+
+__attribute__((target("avx2")))
+static unsigned _pack_avx2(uint8_t *const *cols, int *start, int *end,
+                           const uint8_t *const *rows, unsigned nrows, unsigned width) {
+    unsigned j = 0;
+    for(; (j + 32) <= width; j += 32) {
+        __m256i acc[IWII_RIBBON_MAX] = { _mm256_setzero_si256(), _mm256_setzero_si256(),
+                                         _mm256_setzero_si256(), _mm256_setzero_si256() };
+        for(unsigned n = 0; n < nrows; n++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)&rows[n][j]);
+            for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+                __m256i b = _mm256_and_si256(v, _mm256_set1_epi8(1 << r));
+                b = (n >= r) ? _mm256_sll_epi16(b, _mm_cvtsi32_si128(n - r)) :
+                               _mm256_srl_epi16(b, _mm_cvtsi32_si128(r - n));
+                acc[r] = _mm256_or_si256(acc[r], b);
+            }
+        }
+        for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+            _mm256_storeu_si256((__m256i *)&cols[r][j], acc[r]);
+            uint32_t nz = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(acc[r], _mm256_setzero_si256()));
+            _extend(&start[r], &end[r], j, nz);
+        }
+    }
+
+    /* Finish off a trailing 16-column chunk, if there is one */
+    if((j + 16) <= width) {
+        uint8_t *const tail_cols[IWII_RIBBON_MAX] = { &cols[0][j], &cols[1][j], &cols[2][j], &cols[3][j] };
+        const uint8_t *tail_rows[8];
+        for(unsigned n = 0; n < nrows; n++) {
+            tail_rows[n] = &rows[n][j];
+        }
+        int tail_start[IWII_RIBBON_MAX] = { -1, -1, -1, -1 };
+        int tail_end[IWII_RIBBON_MAX];
+        j += _pack_sse2(tail_cols, tail_start, tail_end, tail_rows, nrows, 16);
+        for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+            if(tail_start[r] >= 0) {
+                if(start[r] < 0) {
+                    start[r] = (j - 16) + tail_start[r];
+                }
+                end[r] = (j - 16) + tail_end[r];
+            }
+        }
+    }
+
+    return j;
+}
+#endif
+
+#ifdef PACK_NEON
+static unsigned _pack_neon(uint8_t *const *cols, int *start, int *end,
+                           const uint8_t *const *rows, unsigned nrows, unsigned width) {
+    unsigned j = 0;
+    for(; (j + 16) <= width; j += 16) {
+        uint8x16_t acc[IWII_RIBBON_MAX] = { vdupq_n_u8(0), vdupq_n_u8(0),
+                                            vdupq_n_u8(0), vdupq_n_u8(0) };
+        for(unsigned n = 0; n < nrows; n++) {
+            uint8x16_t v = vld1q_u8(&rows[n][j]);
+            for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+                /* Negative shift counts shift right */
+                uint8x16_t b = vshlq_u8(vandq_u8(v, vdupq_n_u8(1 << r)), vdupq_n_s8((int)n - (int)r));
+                acc[r] = vorrq_u8(acc[r], b);
+            }
+        }
+        for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+            vst1q_u8(&cols[r][j], acc[r]);
+            if(vmaxvq_u8(acc[r])) {
+                uint32_t nz = 0;
+                for(unsigned i = 0; i < 16; i++) {
+                    nz |= (cols[r][j + i] ? 1U : 0U) << i;
+                }
+                _extend(&start[r], &end[r], j, nz);
+            }
+        }
+    }
+
+    return j;
+}
+#endif
+
+static _pack_kern_t   _pack_kern = NULL;
+static pthread_once_t _pack_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Select the best kernel supported by this machine, run once by whichever thread packs first
+ */
+static void _pack_select(void) {
+    if(getenv("IWII_NO_SIMD")) {
+        return;
+    }
+
+#if defined(PACK_X86)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        _pack_kern = _pack_avx2;
+    } else if(__builtin_cpu_supports("sse2")) {
+        _pack_kern = _pack_sse2;
+    }
+#elif defined(PACK_NEON)
+    _pack_kern = _pack_neon;
+#endif
+}
+
+void iwii_pack_columns(uint8_t *const cols[IWII_RIBBON_MAX], int start[IWII_RIBBON_MAX], int end[IWII_RIBBON_MAX],
+                       const uint8_t *const rows[], unsigned nrows, unsigned width) {
+    pthread_once(&_pack_once, _pack_select);
+
+    for(unsigned r = 0; r < IWII_RIBBON_MAX; r++) {
+        start[r] = -1;
+        end[r]   =  0;
+    }
+
+    unsigned done = 0;
+    if(_pack_kern && nrows) {
+        done = _pack_kern(cols, start, end, rows, nrows, width);
+    }
+    _pack_portable(cols, start, end, rows, nrows, done, width);
+}
@@ -0,0 +1,443 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "iwii_quant.h"
+
+/** Error diffusion is not worth splitting across threads for narrower images */
+#define QUANT_MIN_THREAD_WIDTH (256)
+/** Upper limit on automatically chosen number of threads */
+#define QUANT_MAX_THREADS      (8)
+/** Number of pixels completed between progress updates */
+#define QUANT_CHUNK            (32)
+
+/** One pixel's blue, green, and red channels (and an unused 4th), processed together */
+typedef int32_t _v4i __attribute__((vector_size(16)));
+
+struct iwii_quant_pool_struct;
+
+/**
+ * @brief Argument of each worker thread
+ */
+typedef struct {
+    struct iwii_quant_pool_struct *pool;
+    unsigned                       id;   /**< Worker number, starting from 1 */
+} _worker_arg_t;
+
+/**
+ * @brief Worker threads, quantizing the rows of a band between them
+ *
+ * Row r of a band is handled by worker (r % n_workers), the calling thread
+ * being worker 0.
+ */
+struct iwii_quant_pool_struct {
+    pthread_t            *threads;
+    unsigned              n_threads;  /**< Number of threads, not including the calling thread */
+    pthread_mutex_t       lock;
+    pthread_cond_t        start;      /**< Signalled when gen or stop change */
+    pthread_cond_t        done;       /**< Signalled when busy reaches 0 */
+    unsigned              gen;        /**< Incremented for each band handed out */
+    unsigned              busy;       /**< Number of threads still working on the current band */
+    int                   stop;       /**< Threads are to exit */
+
+    iwii_quant_t         *quant;
+    const uint8_t *const *rows;       /**< Current band's input rows */
+    uint8_t              *dst;        /**< Current band's output */
+    unsigned              n_rows;     /**< Number of rows in current band */
+    unsigned              n_workers;  /**< Number of workers sharing current band, including the calling thread */
+
+    _worker_arg_t        *args;       /**< Argument of each thread */
+};
+
+/** 8x8 Bayer matrix, @see _row_ordered */
+static const uint8_t _bayer[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+/**
+ * @brief Build the lookup table of nearest palette entries
+ *
+ * Distances are weighted towards green and red, to which the eye is more
+ * sensitive.
+ */
+static void _lut_init(uint8_t *lut, const int32_t (*pal)[4], unsigned n_colors) {
+    for(unsigned i = 0; i < 32768; i++) {
+        int32_t b = ((i >>  0) & 0x1f) * 8 + 4;
+        int32_t g = ((i >>  5) & 0x1f) * 8 + 4;
+        int32_t r = ((i >> 10) & 0x1f) * 8 + 4;
+
+        uint32_t best_dist = UINT32_MAX;
+        for(unsigned c = 0; c < n_colors; c++) {
+            int32_t  db   = b - pal[c][0];
+            int32_t  dg   = g - pal[c][1];
+            int32_t  dr   = r - pal[c][2];
+            uint32_t dist = (2 * db * db) + (4 * dg * dg) + (3 * dr * dr);
+            if(dist < best_dist) {
+                best_dist = dist;
+                lut[i]    = c;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Look up the nearest palette entry of a pixel, with channels clamped to 0-255
+ */
+static inline uint8_t _nearest(const uint8_t *lut, _v4i v) {
+    return lut[((v[2] >> 3) << 10) | ((v[1] >> 3) << 5) | (v[0] >> 3)];
+}
+
+static inline _v4i _clamp(_v4i v) {
+    const _v4i max = { 255, 255, 255, 255 };
+    v &= (v > 0);
+    return (v & (v <= max)) | (max & (v > max));
+}
+
+static inline _v4i _load_px(const uint8_t *src) {
+    return (_v4i){ src[0], src[1], src[2], 0 };
+}
+
+/**
+ * @brief Wait until another worker has completed at least need pixels of a row
+ */
+static void _wait_progress(const unsigned *progress, unsigned need) {
+    unsigned spins = 0;
+    while(__atomic_load_n(progress, __ATOMIC_ACQUIRE) < need) {
+        if(++spins > 64) {
+            sched_yield();
+        }
+    }
+}
+
+/**
+ * @brief Floyd-Steinberg dither a single row of a band
+ *
+ * Error for the row is read from err row r, and error for the next row is
+ * accumulated in err row (r + 1), both scaled by 16. Pixel x of the row can
+ * only be done once the row above has completed pixel (x + 1).
+ */
+static void _row_fs(iwii_quant_t *quant, const uint8_t *src, uint8_t *dst, unsigned r) {
+    unsigned     width = quant->width;
+    unsigned     px_sz = quant->px_sz;
+    const _v4i  *above = (const _v4i *)&quant->err[(size_t)r * (width + 2) * 4] + 1;
+    /* Offset by one pixel, as error is also diffused down and to the left */
+    _v4i        *below = (_v4i *)&quant->err[(size_t)(r + 1) * (width + 2) * 4];
+    _v4i         carry = { 0, 0, 0, 0 };
+
+    _v4i pal[IWII_QUANT_MAX_COLORS];
+    memcpy(pal, quant->pal, sizeof(pal));
+
+    memset(below, 0, (width + 2) * sizeof(_v4i));
+
+    for(unsigned x0 = 0; x0 < width; x0 += QUANT_CHUNK) {
+        unsigned x1 = (x0 + QUANT_CHUNK < width) ? (x0 + QUANT_CHUNK) : width;
+        if(r) {
+            _wait_progress(&quant->progress[r - 1], (x1 < width) ? (x1 + 1) : width);
+        }
+
+        for(unsigned x = x0; x < x1; x++) {
+            _v4i    v   = _clamp(_load_px(&src[x * px_sz]) + ((above[x] + carry + 8) >> 4));
+            uint8_t idx = _nearest(quant->lut, v);
+            _v4i    e   = v - pal[idx];
+
+            below[x]     += e * 3;
+            below[x + 1] += e * 5;
+            below[x + 2] += e;
+            carry         = e * 7;
+            dst[x]        = idx;
+        }
+
+        __atomic_store_n(&quant->progress[r], x1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief Ordered dither a single row, offsetting every channel by up to half the full range
+ */
+static void _row_ordered(iwii_quant_t *quant, const uint8_t *src, uint8_t *dst, unsigned y) {
+    const uint8_t *bayer = _bayer[y % 8];
+    for(unsigned x = 0; x < quant->width; x++) {
+        int32_t off = (bayer[x % 8] * 4) + 2 - 128;
+        dst[x] = _nearest(quant->lut, _clamp(_load_px(&src[x * quant->px_sz]) + off));
+    }
+}
+
+static void _row_nearest(iwii_quant_t *quant, const uint8_t *src, uint8_t *dst) {
+    for(unsigned x = 0; x < quant->width; x++) {
+        dst[x] = _nearest(quant->lut, _load_px(&src[x * quant->px_sz]));
+    }
+}
+
+/**
+ * @brief Quantize every row of a band belonging to one worker
+ */
+static void _quant_rows(iwii_quant_t *quant, const uint8_t *const *rows, uint8_t *dst,
+                        unsigned n_rows, unsigned first, unsigned step) {
+    for(unsigned r = first; r < n_rows; r += step) {
+        uint8_t *out = &dst[(size_t)r * quant->width];
+        switch(quant->dither) {
+            case IWII_DITHER_FS:
+                _row_fs(quant, rows[r], out, r);
+                break;
+            case IWII_DITHER_ORDERED:
+                _row_ordered(quant, rows[r], out, quant->y + r);
+                break;
+            default:
+                _row_nearest(quant, rows[r], out);
+                break;
+        }
+    }
+}
+
+static void *_worker(void *arg) {
+    struct iwii_quant_pool_struct *pool = ((_worker_arg_t *)arg)->pool;
+    unsigned                       id   = ((_worker_arg_t *)arg)->id;
+    unsigned                       seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;) {
+        while(!pool->stop && (pool->gen == seen)) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if(pool->stop) {
+            break;
+        }
+        seen = pool->gen;
+        pthread_mutex_unlock(&pool->lock);
+
+        if(id < pool->n_workers) {
+            _quant_rows(pool->quant, pool->rows, pool->dst, pool->n_rows, id, pool->n_workers);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if(--pool->busy == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void _pool_destroy(struct iwii_quant_pool_struct *pool, unsigned n_started) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(unsigned i = 0; i < n_started; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->args);
+    free(pool->threads);
+    free(pool);
+}
+
+/**
+ * @brief Start worker threads
+ *
+ * @param n_threads Number of threads to start, besides the calling thread
+ * @return Pool, NULL on failure
+ */
+static struct iwii_quant_pool_struct *_pool_create(iwii_quant_t *quant, unsigned n_threads) {
+    struct iwii_quant_pool_struct *pool = calloc(1, sizeof(*pool));
+    if(pool == NULL) {
+        return NULL;
+    }
+    pool->quant     = quant;
+    pool->n_threads = n_threads;
+    pool->threads   = calloc(n_threads, sizeof(pthread_t));
+    pool->args      = calloc(n_threads, sizeof(*pool->args));
+    if((pool->threads == NULL) || (pool->args == NULL)) {
+        free(pool->args);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for(unsigned i = 0; i < n_threads; i++) {
+        pool->args[i].pool = pool;
+        pool->args[i].id   = i + 1;
+        if(pthread_create(&pool->threads[i], NULL, _worker, &pool->args[i])) {
+            _pool_destroy(pool, i);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+/**
+ * @brief Split a band between the calling thread and the worker threads, and wait for all of them
+ */
+static void _pool_run(struct iwii_quant_pool_struct *pool, const uint8_t *const *rows, unsigned n_rows, uint8_t *dst) {
+    unsigned n_workers = pool->n_threads + 1;
+    if(n_workers > n_rows) {
+        n_workers = n_rows;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->rows      = rows;
+    pool->dst       = dst;
+    pool->n_rows    = n_rows;
+    pool->n_workers = n_workers;
+    pool->busy      = pool->n_threads;
+    pool->gen++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    _quant_rows(pool->quant, rows, dst, n_rows, 0, n_workers);
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->busy) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @brief Ensure error and progress buffers can hold a band of the given number of rows
+ */
+static int _reserve_rows(iwii_quant_t *quant, unsigned n_rows) {
+    if(n_rows <= quant->err_rows) {
+        return 0;
+    }
+
+    size_t   row_sz = (size_t)(quant->width + 2) * 4 * sizeof(int32_t);
+    int32_t *err;
+    if(posix_memalign((void **)&err, sizeof(_v4i), row_sz * (n_rows + 1))) {
+        return -1;
+    }
+    /* Keep the error carried into the first row */
+    if(quant->err) {
+        memcpy(err, quant->err, row_sz);
+    } else {
+        memset(err, 0, row_sz);
+    }
+
+    unsigned *progress = realloc(quant->progress, n_rows * sizeof(unsigned));
+    if(progress == NULL) {
+        free(err);
+        return -1;
+    }
+
+    free(quant->err);
+    quant->err      = err;
+    quant->progress = progress;
+    quant->err_rows = n_rows;
+
+    return 0;
+}
+
+int iwii_quant_init(iwii_quant_t *quant, const uint32_t *palette, unsigned n_colors,
+                    iwii_dither_e dither, unsigned width, unsigned px_sz, unsigned threads) {
+    memset(quant, 0, sizeof(*quant));
+
+    if((n_colors == 0) || (n_colors > IWII_QUANT_MAX_COLORS) ||
+       (dither >= IWII_DITHER_MAX) || (width == 0) ||
+       ((px_sz != 3) && (px_sz != 4))) {
+        return -1;
+    }
+
+    quant->dither = dither;
+    quant->width  = width;
+    quant->px_sz  = px_sz;
+    for(unsigned i = 0; i < n_colors; i++) {
+        quant->pal[i][0] = (palette[i] >>  0) & 0xff;
+        quant->pal[i][1] = (palette[i] >>  8) & 0xff;
+        quant->pal[i][2] = (palette[i] >> 16) & 0xff;
+    }
+
+    quant->lut = malloc(32768);
+    if(quant->lut == NULL) {
+        fprintf(stderr, "QUANT: Could not allocate lookup table\n");
+        return -1;
+    }
+    _lut_init(quant->lut, (const int32_t (*)[4])quant->pal, n_colors);
+
+    if(_reserve_rows(quant, 16)) {
+        fprintf(stderr, "QUANT: Could not allocate error buffers\n");
+        iwii_quant_destroy(quant);
+        return -1;
+    }
+
+    if(threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus < 1) ? 1 : (cpus > QUANT_MAX_THREADS) ? QUANT_MAX_THREADS : cpus;
+        if(width < QUANT_MIN_THREAD_WIDTH) {
+            threads = 1;
+        }
+    }
+    if(threads > 1) {
+        /* Fall back to quantizing on the calling thread alone */
+        quant->pool = _pool_create(quant, threads - 1);
+    }
+
+    return 0;
+}
+
+void iwii_quant_destroy(iwii_quant_t *quant) {
+    if(quant->pool) {
+        _pool_destroy(quant->pool, quant->pool->n_threads);
+    }
+    free(quant->progress);
+    free(quant->err);
+    free(quant->lut);
+    memset(quant, 0, sizeof(*quant));
+}
+
+int iwii_quant_band(iwii_quant_t *quant, const uint8_t *const rows[], unsigned n_rows, uint8_t *dst) {
+    if(n_rows == 0) {
+        return 0;
+    }
+    if(_reserve_rows(quant, n_rows)) {
+        fprintf(stderr, "QUANT: Could not allocate error buffers\n");
+        return -1;
+    }
+    memset(quant->progress, 0, n_rows * sizeof(unsigned));
+
+    if(quant->pool && (n_rows > 1)) {
+        _pool_run(quant->pool, rows, n_rows, dst);
+    } else {
+        _quant_rows(quant, rows, dst, n_rows, 0, 1);
+    }
+
+    if(quant->dither == IWII_DITHER_FS) {
+        /* Error diffused past the last row carries into the next band */
+        size_t row_sz = (size_t)(quant->width + 2) * 4;
+        memcpy(quant->err, &quant->err[row_sz * n_rows], row_sz * sizeof(int32_t));
+    }
+    quant->y += n_rows;
+
+    return 0;
+}
+
+int iwii_quant_parse_dither(const char *name) {
+    if(!strcasecmp(name, "fs") || !strcasecmp(name, "floyd-steinberg")) {
+        return IWII_DITHER_FS;
+    } else if(!strcasecmp(name, "ordered")) {
+        return IWII_DITHER_ORDERED;
+    } else if(!strcasecmp(name, "none")) {
+        return IWII_DITHER_NONE;
+    }
+
+    return -1;
+}
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "iwii_scale.h"
+
+/** Largest number of pixels averaged using a reciprocal, larger areas are divided */
+#define BOX_MAX_RECIP (16384)
+
+/**
+ * @brief Get the source span covered by an output pixel, when box filtering
+ *
+ * Spans partition the source, each covering at least one pixel.
+ *
+ * @param i Output position
+ * @param src Source size
+ * @param dst Output size
+ * @param end Receives one past the last source position covered
+ * @return First source position covered
+ */
+static unsigned _box_span(unsigned i, unsigned src, unsigned dst, unsigned *end) {
+    unsigned first = ((uint64_t)i * src) / dst;
+    unsigned last  = ((uint64_t)(i + 1) * src) / dst;
+
+    *end = (last > first) ? last : (first + 1);
+    return first;
+}
+
+/**
+ * @brief Get the source position nearest the center of an output pixel
+ */
+static unsigned _nearest(unsigned i, unsigned src, unsigned dst) {
+    return ((uint64_t)(2 * i + 1) * src) / (2 * (uint64_t)dst);
+}
+
+/**
+ * @brief Reciprocal used to divide by 2 * n, as 0.48 fixed-point
+ *
+ * Rounded up, which makes (x * recip) >> 48 exact for any x < 2^47 / n, and
+ * so for twice any sum of n 8 bit samples, if n is at most BOX_MAX_RECIP.
+ */
+static uint64_t _recip(unsigned n) {
+    return ((1ULL << 47) / n) + 1;
+}
+
+int iwii_scale_init(iwii_scale_t *scale, iwii_resample_e kernel,
+                    unsigned src_w, unsigned src_h, unsigned dst_w, unsigned dst_h) {
+    memset(scale, 0, sizeof(*scale));
+    if((kernel >= IWII_RESAMPLE_MAX) || !src_w || !src_h || !dst_w || !dst_h) {
+        return -1;
+    }
+
+    scale->kernel = kernel;
+    scale->src_w  = src_w;
+    scale->src_h  = src_h;
+    scale->dst_w  = dst_w;
+    scale->dst_h  = dst_h;
+
+    scale->x0 = malloc(dst_w * sizeof(uint32_t));
+    if(scale->x0 == NULL) {
+        return -1;
+    }
+
+    if(kernel == IWII_RESAMPLE_NEAREST) {
+        for(unsigned x = 0; x < dst_w; x++) {
+            scale->x0[x] = _nearest(x, src_w, dst_w);
+        }
+        return 0;
+    }
+
+    scale->x1   = malloc(dst_w * sizeof(uint32_t));
+    scale->inv  = malloc(dst_w * sizeof(uint64_t));
+    scale->sums = calloc(dst_w * 3, sizeof(uint64_t));
+    if((scale->x1 == NULL) || (scale->inv == NULL) || (scale->sums == NULL)) {
+        iwii_scale_destroy(scale);
+        return -1;
+    }
+    for(unsigned x = 0; x < dst_w; x++) {
+        unsigned end;
+        scale->x0[x] = _box_span(x, src_w, dst_w, &end);
+        scale->x1[x] = end;
+    }
+
+    return 0;
+}
+
+void iwii_scale_destroy(iwii_scale_t *scale) {
+    free(scale->x0);
+    free(scale->x1);
+    free(scale->inv);
+    free(scale->sums);
+    scale->x0   = NULL;
+    scale->x1   = NULL;
+    scale->inv  = NULL;
+    scale->sums = NULL;
+}
+
+unsigned iwii_scale_src_rows(const iwii_scale_t *scale, unsigned y, unsigned *end) {
+    if(scale->kernel == IWII_RESAMPLE_NEAREST) {
+        unsigned sy = _nearest(y, scale->src_h, scale->dst_h);
+        *end = sy + 1;
+        return sy;
+    }
+
+    return _box_span(y, scale->src_h, scale->dst_h, end);
+}
+
+void iwii_scale_row(const iwii_scale_t *scale, uint8_t *dst, const uint8_t *src, unsigned px_sz) {
+    const uint32_t *x0 = scale->x0;
+
+    switch(px_sz) {
+        case 1:
+            for(unsigned x = 0; x < scale->dst_w; x++) {
+                dst[x] = src[x0[x]];
+            }
+            break;
+        case 3:
+            for(unsigned x = 0; x < scale->dst_w; x++, dst += 3) {
+                memcpy(dst, &src[x0[x] * 3], 3);
+            }
+            break;
+        case 4:
+            for(unsigned x = 0; x < scale->dst_w; x++, dst += 4) {
+                memcpy(dst, &src[x0[x] * 4], 4);
+            }
+            break;
+    }
+}
+
+void iwii_scale_box_add(iwii_scale_t *scale, const uint8_t *src, unsigned px_sz) {
+    uint64_t *sums = scale->sums;
+
+    for(unsigned x = 0; x < scale->dst_w; x++, sums += 3) {
+        /* A single row of a span cannot overflow, however wide */
+        uint32_t       b = 0, g = 0, r = 0;
+        const uint8_t *px  = &src[scale->x0[x] * px_sz];
+        const uint8_t *end = &src[scale->x1[x] * px_sz];
+        for(; px < end; px += px_sz) {
+            b += px[0];
+            g += px[1];
+            r += px[2];
+        }
+        sums[0] += b;
+        sums[1] += g;
+        sums[2] += r;
+    }
+
+    scale->n_rows++;
+}
+
+void iwii_scale_box_finish(iwii_scale_t *scale, uint8_t *dst) {
+    uint64_t *sums   = scale->sums;
+    unsigned  n_rows = scale->n_rows ? scale->n_rows : 1;
+
+    /* Output rows only ever cover one of two numbers of source rows */
+    if(n_rows != scale->inv_rows) {
+        for(unsigned x = 0; x < scale->dst_w; x++) {
+            uint64_t n = (uint64_t)(scale->x1[x] - scale->x0[x]) * n_rows;
+            scale->inv[x] = (n <= BOX_MAX_RECIP) ? _recip(n) : 0;
+        }
+        scale->inv_rows = n_rows;
+    }
+
+    for(unsigned x = 0; x < scale->dst_w; x++, sums += 3, dst += 3) {
+        uint64_t n   = (uint64_t)(scale->x1[x] - scale->x0[x]) * n_rows;
+        uint64_t inv = scale->inv[x];
+        for(unsigned c = 0; c < 3; c++) {
+            /* Rounded to nearest, (2 * sum + n) / (2 * n) */
+            uint64_t num = (2 * sums[c]) + n;
+            dst[c]  = inv ? ((num * inv) >> 48) : (num / (2 * n));
+            sums[c] = 0;
+        }
+    }
+
+    scale->n_rows = 0;
+}
+
+int iwii_scale_parse_kernel(const char *name) {
+    if(!strcasecmp(name, "nearest")) {
+        return IWII_RESAMPLE_NEAREST;
+    } else if(!strcasecmp(name, "box") || !strcasecmp(name, "area")) {
+        return IWII_RESAMPLE_BOX;
+    }
+
+    return -1;
+}
@@ -0,0 +1,433 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iwii.h"
+#include "iwii_spool.h"
+
+#define FNV_OFFSET (0xcbf29ce484222325ULL)
+#define FNV_PRIME  (0x00000100000001b3ULL)
+
+static uint64_t _fnv1a(uint64_t hash, const void *data, size_t len) {
+    const uint8_t *ptr = data;
+    for(size_t i = 0; i < len; i++) {
+        hash ^= ptr[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Hash the running executable, identifying the build
+ *
+ * Any object file changing changes the linked binary, whereas a timestamp
+ * compiled into one object only changes when that object is rebuilt.
+ *
+ * @param hash Receives hash of executable
+ * @return 0 on success, < 0 if the executable cannot be read
+ */
+static int _build_hash(uint64_t *hash) {
+    static uint64_t build_hash  = 0;
+    static int      build_known = 0;
+
+    if(!build_known) {
+        int fd = open("/proc/self/exe", O_RDONLY);
+        if(fd < 0) {
+            return -1;
+        }
+        struct stat st;
+        if(fstat(fd, &st) || !st.st_size) {
+            close(fd);
+            return -1;
+        }
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(map == MAP_FAILED) {
+            return -1;
+        }
+        build_hash  = _fnv1a(FNV_OFFSET, map, st.st_size);
+        build_known = 1;
+        munmap(map, st.st_size);
+    }
+
+    *hash = build_hash;
+    return 0;
+}
+
+int iwii_spool_key(const void *data, size_t len, const iwii_gfx_params_t *params, uint64_t *key) {
+    uint32_t fields[] = { IWII_SPOOL_VERSION, params->flags, params->h_dpi, params->v_dpi, params->h_pos, params->dither,
+                          params->width, params->height, params->resample };
+
+    uint64_t hash;
+    if(_build_hash(&hash)) {
+        return -1;
+    }
+    hash = _fnv1a(hash, fields, sizeof(fields));
+
+    *key = _fnv1a(hash, data, len);
+    return 0;
+}
+
+/**
+ * @brief Join two path components into a newly allocated string
+ */
+static char *_join(const char *a, const char *b) {
+    size_t len  = strlen(a) + strlen(b) + 2;
+    char  *path = malloc(len);
+    if(path != NULL) {
+        snprintf(path, len, "%s/%s", a, b);
+    }
+
+    return path;
+}
+
+char *iwii_spool_cache_dir(void) {
+    const char *env;
+    char       *dir = NULL;
+
+    if((env = getenv("IWII_CACHE_DIR")) && env[0]) {
+        dir = strdup(env);
+    } else if((env = getenv("XDG_CACHE_HOME")) && env[0]) {
+        mkdir(env, 0700);
+        dir = _join(env, "iwiitool");
+    } else if((env = getenv("HOME")) && env[0]) {
+        char *cache = _join(env, ".cache");
+        if(cache == NULL) {
+            return NULL;
+        }
+        mkdir(cache, 0700);
+        dir = _join(cache, "iwiitool");
+        free(cache);
+    }
+    if(dir == NULL) {
+        return NULL;
+    }
+
+    if(mkdir(dir, 0700) && (errno != EEXIST)) {
+        free(dir);
+        return NULL;
+    }
+
+    return dir;
+}
+
+char *iwii_spool_cache_path(const char *dir, uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 IWII_SPOOL_EXT, key);
+
+    return _join(dir, name);
+}
+
+/**
+ * @brief A file in the cache, @see iwii_spool_trim
+ */
+typedef struct {
+    char    *name;  /**< File name */
+    off_t    size;  /**< Size, in bytes */
+    time_t   mtime; /**< Last modification, or last use of a cached job */
+} _cache_ent_t;
+
+static int _cache_ent_cmp(const void *a, const void *b) {
+    time_t ta = ((const _cache_ent_t *)a)->mtime;
+    time_t tb = ((const _cache_ent_t *)b)->mtime;
+
+    return (ta > tb) - (ta < tb);
+}
+
+void iwii_spool_trim(const char *dir, uint64_t max_sz) {
+    DIR *d = opendir(dir);
+    if(d == NULL) {
+        return;
+    }
+
+    _cache_ent_t  *ents  = NULL;
+    size_t         n     = 0, cap = 0;
+    uint64_t       total = 0;
+    time_t         now   = time(NULL);
+    struct dirent *de;
+    while((de = readdir(d)) != NULL) {
+        const char *ext = strstr(de->d_name, IWII_SPOOL_EXT);
+        struct stat st;
+        if((ext == NULL) ||
+           fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if(ext[strlen(IWII_SPOOL_EXT)] != '\0') {
+            /* Temporary file, only removed once nothing can still be writing it */
+            if((now - st.st_mtime) >= IWII_SPOOL_TMP_AGE) {
+                unlinkat(dirfd(d), de->d_name, 0);
+            }
+            continue;
+        }
+
+        if(n == cap) {
+            size_t       new_cap = cap ? (cap * 2) : 64;
+            _cache_ent_t *tmp    = realloc(ents, new_cap * sizeof(*ents));
+            if(tmp == NULL) {
+                break;
+            }
+            ents = tmp;
+            cap  = new_cap;
+        }
+        ents[n].name = strdup(de->d_name);
+        if(ents[n].name == NULL) {
+            break;
+        }
+        ents[n].size  = st.st_size;
+        ents[n].mtime = st.st_mtime;
+        total += st.st_size;
+        n++;
+    }
+
+    /* Least recently used first */
+    qsort(ents, n, sizeof(*ents), _cache_ent_cmp);
+    for(size_t i = 0; (i < n) && (total > max_sz); i++) {
+        if(unlinkat(dirfd(d), ents[i].name, 0) == 0) {
+            total -= ents[i].size;
+        }
+    }
+
+    for(size_t i = 0; i < n; i++) {
+        free(ents[i].name);
+    }
+    free(ents);
+    closedir(d);
+}
+
+/**
+ * @brief Write exactly len bytes, retrying on short writes
+ *
+ * @return 0 on success, else < 0
+ */
+static int _write_full(int fd, const void *buf, size_t len) {
+    const uint8_t *ptr = buf;
+    while(len) {
+        ssize_t wr = write(fd, ptr, len);
+        if(wr < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += wr;
+        len -= wr;
+    }
+
+    return 0;
+}
+
+int iwii_spool_create(iwii_spool_writer_t *wr, const char *path) {
+    memset(wr, 0, sizeof(*wr));
+    wr->fd = -1;
+
+    size_t len = strlen(path) + 32;
+    wr->path     = strdup(path);
+    wr->tmp_path = malloc(len);
+    if((wr->path == NULL) || (wr->tmp_path == NULL)) {
+        iwii_spool_destroy(wr);
+        return -1;
+    }
+    snprintf(wr->tmp_path, len, "%s.tmp.%ld", path, (long)getpid());
+
+    wr->fd = open(wr->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(wr->fd < 0) {
+        fprintf(stderr, "SPOOL: Could not create `%s`: %s\n", wr->tmp_path, strerror(errno));
+        iwii_spool_destroy(wr);
+        return -1;
+    }
+
+    /* Header is filled in once everything else is known */
+    if(lseek(wr->fd, sizeof(iwii_spool_header_t), SEEK_SET) < 0) {
+        iwii_spool_destroy(wr);
+        return -1;
+    }
+
+    return 0;
+}
+
+int iwii_spool_sink(void *arg, const void *data, size_t len) {
+    iwii_spool_writer_t *wr = arg;
+
+    if(wr->err || _write_full(wr->fd, data, len)) {
+        if(!wr->err) {
+            fprintf(stderr, "SPOOL: Could not write spool: %s\n", strerror(errno));
+        }
+        wr->err = 1;
+        return -1;
+    }
+    wr->len += len;
+
+    return 0;
+}
+
+void iwii_spool_mark(void *arg, uint64_t pos) {
+    iwii_spool_writer_t *wr = arg;
+
+    if(wr->n_bands == wr->cap) {
+        unsigned  cap   = wr->cap ? (wr->cap * 2) : 64;
+        uint64_t *bands = realloc(wr->bands, cap * sizeof(uint64_t));
+        if(bands == NULL) {
+            wr->err = 1;
+            return;
+        }
+        wr->bands = bands;
+        wr->cap   = cap;
+    }
+
+    wr->bands[wr->n_bands++] = pos;
+}
+
+int iwii_spool_finish(iwii_spool_writer_t *wr, uint64_t key, const iwii_gfx_params_t *params) {
+    if(wr->err) {
+        return -1;
+    }
+
+    iwii_spool_header_t head = {
+        .magic     = IWII_SPOOL_MAGIC,
+        .version   = IWII_SPOOL_VERSION,
+        .n_bands   = wr->n_bands,
+        .key       = key,
+        .data_off  = sizeof(iwii_spool_header_t),
+        .data_len  = wr->len,
+        .flags     = params->flags,
+        .h_dpi     = params->h_dpi,
+        .v_dpi     = params->v_dpi,
+        .h_pos     = params->h_pos
+    };
+
+    /* Keep the band index aligned, so it can be used in-place from the mapping */
+    static const uint8_t pad[8] = { 0 };
+    uint64_t end     = head.data_off + head.data_len;
+    size_t   pad_len = (8 - (end % 8)) % 8;
+    head.index_off   = end + pad_len;
+
+    if(_write_full(wr->fd, pad, pad_len) ||
+       _write_full(wr->fd, wr->bands, wr->n_bands * sizeof(uint64_t)) ||
+       (pwrite(wr->fd, &head, sizeof(head), 0) != (ssize_t)sizeof(head))) {
+        fprintf(stderr, "SPOOL: Could not write spool: %s\n", strerror(errno));
+        wr->err = 1;
+        return -1;
+    }
+
+    if(close(wr->fd)) {
+        wr->fd  = -1;
+        wr->err = 1;
+        return -1;
+    }
+    wr->fd = -1;
+
+    if(rename(wr->tmp_path, wr->path)) {
+        fprintf(stderr, "SPOOL: Could not move spool into place: %s\n", strerror(errno));
+        wr->err = 1;
+        return -1;
+    }
+
+    /* Nothing left to clean up */
+    free(wr->tmp_path);
+    wr->tmp_path = NULL;
+
+    return 0;
+}
+
+void iwii_spool_destroy(iwii_spool_writer_t *wr) {
+    if(wr->fd >= 0) {
+        close(wr->fd);
+        wr->fd = -1;
+    }
+    if(wr->tmp_path) {
+        unlink(wr->tmp_path);
+    }
+    free(wr->tmp_path);
+    free(wr->path);
+    free(wr->bands);
+    wr->tmp_path = NULL;
+    wr->path     = NULL;
+    wr->bands    = NULL;
+}
+
+int iwii_spool_detect(const void *data, size_t len) {
+    return (len >= sizeof(iwii_spool_header_t)) &&
+           !memcmp(data, IWII_SPOOL_MAGIC, sizeof(IWII_SPOOL_MAGIC));
+}
+
+int iwii_spool_open(iwii_spool_t *spool, int fd) {
+    memset(spool, 0, sizeof(*spool));
+
+    struct stat st;
+    if(fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+       ((size_t)st.st_size < sizeof(iwii_spool_header_t))) {
+        return -1;
+    }
+
+    spool->map_sz = st.st_size;
+    spool->map    = mmap(NULL, spool->map_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(spool->map == MAP_FAILED) {
+        spool->map = NULL;
+        return -1;
+    }
+    madvise(spool->map, spool->map_sz, MADV_SEQUENTIAL);
+
+    const iwii_spool_header_t *head = spool->map;
+    if(!iwii_spool_detect(head, spool->map_sz) ||
+       (head->version != IWII_SPOOL_VERSION) ||
+       (head->data_off > spool->map_sz) ||
+       (head->data_len > (spool->map_sz - head->data_off)) ||
+       (head->index_off % 8) ||
+       (head->index_off > spool->map_sz) ||
+       (head->n_bands > ((spool->map_sz - head->index_off) / sizeof(uint64_t)))) {
+        fprintf(stderr, "SPOOL: Invalid or incomplete spool file\n");
+        iwii_spool_close(spool);
+        return -1;
+    }
+
+    const uint64_t *bands = (const uint64_t *)((const uint8_t *)spool->map + head->index_off);
+    for(unsigned i = 0; i < head->n_bands; i++) {
+        if((bands[i] > head->data_len) || (i && (bands[i] < bands[i - 1]))) {
+            fprintf(stderr, "SPOOL: Invalid band index\n");
+            iwii_spool_close(spool);
+            return -1;
+        }
+    }
+
+    spool->head  = head;
+    spool->data  = (const uint8_t *)spool->map + head->data_off;
+    spool->bands = bands;
+
+    return 0;
+}
+
+void iwii_spool_close(iwii_spool_t *spool) {
+    if(spool->map) {
+        munmap(spool->map, spool->map_sz);
+    }
+    memset(spool, 0, sizeof(*spool));
+}
+
+int iwii_spool_replay(const iwii_spool_t *spool, iwii_out_t *out) {
+    uint64_t pos = 0;
+
+    for(unsigned i = 0; i <= spool->head->n_bands; i++) {
+        uint64_t end = (i < spool->head->n_bands) ? spool->bands[i] : spool->head->data_len;
+
+        if(iwii_out_write(out, &spool->data[pos], end - pos) ||
+           iwii_out_yield(out)) {
+            return -1;
+        }
+        pos = end;
+    }
+
+    /* Whatever the job left the printer in is not known here */
+    iwii_state_invalidate(out);
+
+    return iwii_out_flush(out);
+}
+
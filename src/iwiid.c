@@ -0,0 +1,751 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "iwii.h"
+#include "iwii_est.h"
+#include "iwii_job.h"
+#include "iwii_out.h"
+#include "iwiitool.h"
+
+
+typedef struct opts_struct {
+/* I/O Config */
+    int      fd_out;    /**< Printer file descriptor */
+    unsigned baud;      /**< Baud rate to use */
+    uint8_t  flow;      /**< Flow control method to use */
+    char    *socket;    /**< Path of socket to accept jobs on, NULL for default */
+    int      quiet;     /**< Do not log jobs */
+} opts_t;
+
+static opts_t opts = {
+/* I/O Config */
+    .fd_out    = STDOUT_FILENO,
+    .flow      = IWII_FLOW_XONXOFF,
+    .baud      = 9600,
+    .socket    = NULL,
+    .quiet     = 0
+};
+
+/**
+ * @brief Queued print job
+ */
+typedef struct _job_struct {
+    struct _job_struct *next;     /**< Next job in queue */
+    uint32_t            id;       /**< Job ID */
+    unsigned            priority; /**< Job priority */
+    uint8_t            *data;     /**< Printer data */
+    size_t              len;      /**< Length of data, in bytes */
+} _job_t;
+
+/**
+ * @brief Printer settings that are remembered between jobs
+ *
+ * Each slot holds the last command that set it, if known.
+ */
+enum {
+    _SLOT_FONT = 0,
+    _SLOT_QUALITY,
+    _SLOT_COLOR,
+    _SLOT_SPACING,
+    _SLOT_MARGIN,
+    _SLOT_PAGELEN,
+    _SLOT_PROPSPACING,
+    _SLOT_DIRECTION,
+    _SLOT_FEED,
+    _SLOT_WIDTH,
+    _SLOT_MAX
+};
+
+typedef struct {
+    uint8_t cmd[8]; /**< Command that set the slot */
+    uint8_t len;    /**< Length of cmd, 0 if the setting is unknown */
+} _slot_t;
+
+/**
+ * @brief Daemon state
+ */
+typedef struct {
+    pthread_mutex_t lock;        /**< Protects the queue */
+    pthread_cond_t  cond;        /**< Signalled when a job is queued, or when stopping */
+    _job_t         *queue;       /**< Queued jobs, in the order they will be printed */
+    uint32_t        next_id;     /**< ID of next job */
+    int             stop;        /**< Set when the daemon is shutting down */
+
+    iwii_out_t      out;         /**< Printer output stream */
+    iwii_est_t      est;         /**< Tracks printer state and timing of everything sent */
+    _slot_t         slots[_SLOT_MAX]; /**< Known printer settings */
+    uint16_t        sw_known;    /**< Software switches with known state, @see `ESC D`/`ESC Z` */
+    uint16_t        sw_value;    /**< State of known software switches */
+} _daemon_t;
+
+static _daemon_t _daemon;
+
+static volatile sig_atomic_t _quit = 0;
+
+/** Signals stopping the daemon, blocked in every thread but the main one */
+static sigset_t _quit_sigs;
+
+static int _handle_args(int argc, char **const argv);
+
+/**
+ * @brief Find which setting a command changes
+ *
+ * @return Slot index, < 0 if the command does not change a tracked setting
+ */
+static int _slot(const uint8_t *cmd, size_t len) {
+    if((cmd[0] == 0x0e) || (cmd[0] == 0x0f)) {
+        return _SLOT_WIDTH;
+    }
+    if((cmd[0] != '\033') || (len < 2)) {
+        return -1;
+    }
+
+    switch(cmd[1]) {
+        case 'n': case 'N': case 'E': case 'e':
+        case 'q': case 'Q': case 'p': case 'P':
+        case '\'':
+            return _SLOT_FONT;
+        case 'a':
+            return _SLOT_QUALITY;
+        case 'K':
+            return _SLOT_COLOR;
+        case 'T': case 'A': case 'B':
+            return _SLOT_SPACING;
+        case 'L':
+            return _SLOT_MARGIN;
+        case 'H':
+            return _SLOT_PAGELEN;
+        case 's':
+            return _SLOT_PROPSPACING;
+        case '>': case '<':
+            return _SLOT_DIRECTION;
+        case 'r': case 'f':
+            return _SLOT_FEED;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * @brief Bits of the software switches changed by `ESC D`/`ESC Z`
+ */
+static uint16_t _switch_bits(const uint8_t *cmd) {
+    return ((uint16_t)cmd[2] << 8) | cmd[3];
+}
+
+/**
+ * @brief Update known printer settings from a command sent to the printer, @see iwii_est_cmd_t
+ */
+static void _track(void *arg, const iwii_est_t *est, const uint8_t *hdr, unsigned len) {
+    (void)est;
+    _daemon_t *d = arg;
+
+    if((len == 2) && (hdr[0] == '\033') && (hdr[1] == 'c')) {
+        /* Software reset, nothing is known anymore */
+        memset(d->slots, 0, sizeof(d->slots));
+        d->sw_known = 0;
+        return;
+    }
+
+    if((len == 4) && (hdr[0] == '\033') && ((hdr[1] == 'D') || (hdr[1] == 'Z'))) {
+        uint16_t bits = _switch_bits(hdr);
+        d->sw_known |= bits;
+        if(hdr[1] == 'D') {
+            d->sw_value |= bits;
+        } else {
+            d->sw_value &= ~bits;
+        }
+        return;
+    }
+
+    int slot = _slot(hdr, len);
+    if((slot >= 0) && (len <= sizeof(d->slots[slot].cmd))) {
+        memcpy(d->slots[slot].cmd, hdr, len);
+        d->slots[slot].len = len;
+    }
+}
+
+/**
+ * @brief Get the length of a setup command at the start of data
+ *
+ * Setup commands only change printer settings, and are what the tools send
+ * at the start of each job.
+ *
+ * @return Length of command, 0 if data does not start with a complete setup command
+ */
+static size_t _setup_len(const uint8_t *data, size_t len) {
+    if((data[0] == 0x0e) || (data[0] == 0x0f)) {
+        return 1;
+    }
+    if((data[0] != '\033') || (len < 2)) {
+        return 0;
+    }
+
+    uint8_t cmd = data[1];
+    if((_slot(data, len) < 0) &&
+       (cmd != 'D') && (cmd != 'Z') &&
+       (cmd != '(') && (cmd != ')')) {
+        return 0;
+    }
+
+    int args = iwii_esc_args(cmd);
+    if(args < 0) {
+        const uint8_t *end = memchr(&data[2], '.', len - 2);
+        return end ? (size_t)(end - data) + 1 : 0;
+    }
+
+    return ((size_t)args + 2 <= len) ? (size_t)args + 2 : 0;
+}
+
+/**
+ * @brief Check whether a setup command would leave the printer as it is
+ */
+static int _is_redundant(const _daemon_t *d, const uint8_t *cmd, size_t len) {
+    if((cmd[0] == '\033') && ((cmd[1] == 'D') || (cmd[1] == 'Z'))) {
+        uint16_t bits = _switch_bits(cmd);
+        uint16_t want = (cmd[1] == 'D') ? bits : 0;
+        return ((d->sw_known & bits) == bits) &&
+               ((d->sw_value & bits) == want);
+    }
+
+    int slot = _slot(cmd, len);
+    if(slot < 0) {
+        /* Tab stops are not tracked */
+        return 0;
+    }
+
+    return (d->slots[slot].len == len) &&
+           !memcmp(d->slots[slot].cmd, cmd, len);
+}
+
+/**
+ * @brief Send data to the printer, keeping track of its state
+ */
+static int _send(_daemon_t *d, const uint8_t *data, size_t len) {
+    iwii_est_feed(&d->est, data, len);
+
+    return iwii_out_write(&d->out, data, len);
+}
+
+/**
+ * @brief Print a job, skipping setup commands that would not change anything
+ */
+static int _print(_daemon_t *d, const _job_t *job) {
+    uint64_t start_us = d->est.stats.total_us;
+    size_t   pos      = 0;
+    size_t   skipped  = 0;
+
+    while(pos < job->len) {
+        size_t len = _setup_len(&job->data[pos], job->len - pos);
+        if(len == 0) {
+            break;
+        }
+
+        if(_is_redundant(d, &job->data[pos], len)) {
+            skipped += len;
+        } else if(_send(d, &job->data[pos], len)) {
+            return -1;
+        }
+        pos += len;
+    }
+
+    if(_send(d, &job->data[pos], job->len - pos) ||
+       iwii_out_flush(&d->out)) {
+        return -1;
+    }
+
+    if(!opts.quiet) {
+        uint64_t us = d->est.stats.total_us - start_us;
+        fprintf(stderr, "iwiid: Job %u printed, %zu bytes (%zu setup bytes skipped), ~%u.%01us\n",
+                job->id, job->len - skipped, skipped,
+                (unsigned)(us / 1000000), (unsigned)((us / 100000) % 10));
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Printer thread, prints queued jobs one at a time
+ */
+static void *_printer(void *arg) {
+    _daemon_t *d = arg;
+
+    pthread_mutex_lock(&d->lock);
+    while(1) {
+        while((d->queue == NULL) && !d->stop) {
+            pthread_cond_wait(&d->cond, &d->lock);
+        }
+        if(d->stop) {
+            break;
+        }
+
+        _job_t *job = d->queue;
+        d->queue    = job->next;
+        pthread_mutex_unlock(&d->lock);
+
+        int ret = _print(d, job);
+        free(job->data);
+        free(job);
+
+        if(ret) {
+            fprintf(stderr, "iwiid: Could not write to printer, stopping\n");
+            /* Wake up main thread, which is waiting in accept(), and is
+             * the only thread not blocking SIGTERM */
+            kill(getpid(), SIGTERM);
+            return NULL;
+        }
+        pthread_mutex_lock(&d->lock);
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Add a job to the queue, after all jobs of the same or higher priority
+ */
+static uint32_t _enqueue(_daemon_t *d, _job_t *job) {
+    pthread_mutex_lock(&d->lock);
+    job->id = d->next_id++;
+
+    _job_t **pos = &d->queue;
+    while(*pos && ((*pos)->priority >= job->priority)) {
+        pos = &(*pos)->next;
+    }
+    job->next = *pos;
+    *pos      = job;
+
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+
+    return job->id;
+}
+
+/**
+ * @brief Read exactly len bytes
+ *
+ * @return 0 on success, else < 0
+ */
+static int _read_full(int fd, void *buf, size_t len) {
+    uint8_t *ptr = buf;
+    while(len) {
+        ssize_t rd = read(fd, ptr, len);
+        if(rd < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if(rd == 0) {
+            return -1;
+        }
+        ptr += rd;
+        len -= rd;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read the rest of a job from a client
+ *
+ * @return Job, NULL on failure
+ */
+static _job_t *_receive(int fd, const iwii_job_header_t *head) {
+    _job_t *job = calloc(1, sizeof(_job_t));
+    if(job == NULL) {
+        return NULL;
+    }
+    job->priority = head->priority;
+
+    size_t cap = 0;
+    while(1) {
+        if(job->len == cap) {
+            cap = cap ? (cap * 2) : 16384;
+            uint8_t *data = realloc(job->data, cap);
+            if(data == NULL) {
+                break;
+            }
+            job->data = data;
+        }
+
+        ssize_t rd = read(fd, &job->data[job->len], cap - job->len);
+        if(rd < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        } else if(rd == 0) {
+            return job;
+        }
+        job->len += rd;
+    }
+
+    free(job->data);
+    free(job);
+
+    return NULL;
+}
+
+/**
+ * @brief Client thread, receives a single job
+ */
+static void *_client(void *arg) {
+    int fd = (int)(intptr_t)arg;
+
+    iwii_job_header_t head;
+    iwii_job_reply_t  reply = { .status = -1, .id = 0 };
+    _job_t           *job   = NULL;
+
+    if(_read_full(fd, &head, sizeof(head))) {
+        /* Nothing sent, such as another iwiid checking if the socket is live */
+    } else if((head.magic    != IWII_JOB_MAGIC) ||
+              (head.version  != IWII_JOB_VERSION) ||
+              (head.priority >  IWII_JOB_PRIORITY_MAX)) {
+        fprintf(stderr, "iwiid: Rejecting client with invalid job header\n");
+    } else if((job = _receive(fd, &head)) == NULL) {
+        fprintf(stderr, "iwiid: Could not receive job\n");
+    } else {
+        reply.status = 0;
+        reply.id     = _enqueue(&_daemon, job);
+        if(!opts.quiet) {
+            fprintf(stderr, "iwiid: Job %u queued, priority %u, %zu bytes\n",
+                    reply.id, head.priority, job->len);
+        }
+    }
+
+    /* Client may already be gone, nothing to be done about it */
+    if(write(fd, &reply, sizeof(reply)) < 0) {}
+    close(fd);
+
+    return NULL;
+}
+
+/**
+ * @brief Create the listening socket, replacing a stale one left behind
+ *
+ * @return Socket file descriptor, < 0 on error
+ */
+static int _listen(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "iwiid: Socket path `%s` is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        fprintf(stderr, "iwiid: Could not create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if(!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "iwiid: Already running on `%s`\n", path);
+        close(fd);
+        return -1;
+    }
+
+    /* Nothing is listening, but only ever remove a socket, never a file
+     * the path was pointed at by mistake */
+    struct stat st;
+    if(!lstat(path, &st)) {
+        if(!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "iwiid: `%s` exists and is not a socket\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+    }
+
+    /* Only the owner may submit jobs */
+    mode_t mask = umask(0077);
+    int    ret  = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if(ret || listen(fd, 16)) {
+        fprintf(stderr, "iwiid: Could not listen on `%s`: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void _signal(int sig) {
+    (void)sig;
+    _quit = 1;
+}
+
+int iwiid(int argc, char **argv) {
+    if(_handle_args(argc, argv)) {
+        return -1;
+    }
+
+    char *path = opts.socket ? strdup(opts.socket) : iwii_job_socket_path();
+    if(path == NULL) {
+        close(opts.fd_out);
+        return -1;
+    }
+
+    _daemon_t *d = &_daemon;
+    memset(d, 0, sizeof(*d));
+    d->next_id = 1;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->cond, NULL);
+
+    /* The printer session is set up once, and kept open for all jobs */
+    if(iwii_serial_init(opts.fd_out, opts.flow, opts.baud) ||
+       iwii_est_init(&d->est, opts.baud, opts.flow)) {
+        free(path);
+        close(opts.fd_out);
+        return -1;
+    }
+    d->est.cmd     = _track;
+    d->est.cmd_arg = d;
+
+    if(iwii_out_init(&d->out, opts.fd_out, 0)) {
+        iwii_est_destroy(&d->est);
+        free(path);
+        close(opts.fd_out);
+        return -1;
+    }
+
+    /* Threads inherit the signal mask, so SIGINT and SIGTERM are blocked
+     * while starting them. Only the main thread then receives them, as a
+     * process-directed signal may go to any thread not blocking it. */
+    sigemptyset(&_quit_sigs);
+    sigaddset(&_quit_sigs, SIGINT);
+    sigaddset(&_quit_sigs, SIGTERM);
+    sigset_t mask;
+
+    pthread_sigmask(SIG_BLOCK, &_quit_sigs, &mask);
+    int err = iwii_out_start_writer(&d->out, 0);
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+    if(err) {
+        goto main_fail_noout;
+    }
+
+    int sock = _listen(path);
+    if(sock < 0) {
+        goto main_fail_noout;
+    }
+
+    /* No SA_RESTART, so accept() is interrupted */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t printer;
+    pthread_sigmask(SIG_BLOCK, &_quit_sigs, &mask);
+    err = pthread_create(&printer, NULL, _printer, d);
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+    if(err) {
+        fprintf(stderr, "iwiid: Could not start printer thread\n");
+        goto main_fail;
+    }
+
+    if(!opts.quiet) {
+        fprintf(stderr, "iwiid: Accepting jobs on `%s`\n", path);
+    }
+
+    while(!_quit) {
+        int fd = accept(sock, NULL, NULL);
+        if(fd < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "iwiid: accept: %s\n", strerror(errno));
+            break;
+        }
+
+        pthread_t      client;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_sigmask(SIG_BLOCK, &_quit_sigs, &mask);
+        err = pthread_create(&client, &attr, _client, (void *)(intptr_t)fd);
+        pthread_sigmask(SIG_SETMASK, &mask, NULL);
+        if(err) {
+            fprintf(stderr, "iwiid: Could not start client thread\n");
+            close(fd);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    /* Let the current job finish, anything still queued is dropped */
+    close(sock);
+    unlink(path);
+    pthread_mutex_lock(&d->lock);
+    d->stop = 1;
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    pthread_join(printer, NULL);
+
+    unsigned dropped = 0;
+    while(d->queue) {
+        _job_t *job = d->queue;
+        d->queue    = job->next;
+        free(job->data);
+        free(job);
+        dropped++;
+    }
+    if(dropped) {
+        fprintf(stderr, "iwiid: %u queued job(s) were not printed\n", dropped);
+    }
+
+    free(path);
+    iwii_est_destroy(&d->est);
+    int ret = iwii_out_destroy(&d->out);
+    close(opts.fd_out);
+
+    return ret;
+
+main_fail:
+    close(sock);
+    unlink(path);
+main_fail_noout:
+    free(path);
+    iwii_est_destroy(&d->est);
+    iwii_out_destroy(&d->out);
+    close(opts.fd_out);
+
+    return -1;
+}
+
+
+static void _help(void) {
+    puts("iwiid: Queue print jobs for an ImageWriter II\n");
+
+    puts("Accepts jobs from ansi2iwii and iwiigfx (using --daemon) over a Unix domain\n"
+         "socket, and prints them one at a time while keeping the printer session open.\n"
+         "Setup commands at the start of a job are skipped if the printer is already set\n"
+         "up that way. Run one instance for each printer.\n");
+
+    puts("Basic Options:\n"
+         "  -o, --output=FILE         Write jobs to FILE, use `-` for stdout (default)\n"
+         "  -b, --baud=RATE           Set baud rate to use when output is set to the printer's serial\n"
+         "                            port. Values 300, 1200, 2400, and 9600 (default) are accepted\n"
+         "  -F, --flow=MODE           Set flow control mode when using serial as output\n"
+         "                              0: None\n"
+         "                              1: XON/XOFF (default)\n"
+         "                              2: RTS/CTS\n"
+         "  -s, --socket=PATH         Accept jobs on PATH, defaults to $IWII_SOCKET,\n"
+         "                            $XDG_RUNTIME_DIR/iwiid.sock, or /tmp/iwiid-<uid>.sock\n"
+         "  -q, --quiet               Do not log jobs on stderr\n"
+         "\n"
+         "Miscellaneous:\n"
+         "  -h, --help                Display this help message\n"
+        );
+
+    exit(0);
+}
+
+static const struct option prog_options[] = {
+    /* Basic Options */
+    { "output",           required_argument, NULL, 'o' },
+    { "baud",             required_argument, NULL, 'b' },
+    { "flow",             required_argument, NULL, 'F' },
+    { "socket",           required_argument, NULL, 's' },
+    { "quiet",            no_argument,       NULL, 'q' },
+    /* Miscellaneous */
+    { "help",             no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static int __get_number(const char *arg, unsigned min, unsigned max, const char *msg) {
+    if(!isdigit(arg[0])) {
+        fprintf(stderr, "%s must be a number between %u and %u!\r\n", msg, min, max);
+        return -1;
+    }
+
+    unsigned val = strtoul(optarg, NULL, 10);
+    if((val < min) || (val > max)) {
+        fprintf(stderr, "%s must be a number between %u and %u!\r\n", msg, min, max);
+        return -1;
+    }
+
+    return val;
+}
+
+#define _get_number(min, max, msg, var) { \
+    int val = __get_number(optarg, min, max, msg); \
+    if(val < 0) { \
+        return -1; \
+    } \
+    var = val; \
+}
+
+static int _handle_args(int argc, char **const argv) {
+    int c;
+    while ((c = getopt_long(argc, argv, "o:b:F:s:q"
+                                        "h", prog_options, NULL)) >= 0) {
+        switch(c) {
+            case 'o':
+                if(!strcmp(optarg, "-")) {
+                    opts.fd_out = STDOUT_FILENO;
+                } else {
+                    opts.fd_out = open(optarg, O_WRONLY | O_NOCTTY);
+                    if(opts.fd_out < 0) {
+                        fprintf(stderr, "Could not open output `%s`: %s\n", optarg, strerror(errno));
+                        return -1;
+                    }
+                }
+                break;
+            case 'b': {
+                if(!isdigit(optarg[0])) {
+                    fprintf(stderr, "Baud rate selection must 300, 1200, 2400, or 9600!\n");
+                    return -1;
+                }
+                unsigned baud = strtoul(optarg, NULL, 10);
+                switch(baud) {
+                    case 300:
+                    case 1200:
+                    case 2400:
+                    case 9600:
+                        opts.baud = baud;
+                        break;
+                    default:
+                        fprintf(stderr, "Baud rate selection must 300, 1200, 2400, or 9600!\n");
+                        return -1;
+                }
+            } break;
+            case 'F':
+                _get_number(0, 2, "Flow control selection", opts.flow);
+                break;
+            case 's':
+                opts.socket = optarg;
+                break;
+            case 'q':
+                opts.quiet = 1;
+                break;
+
+            case 'h':
+                _help();
+                break;
+
+            case '?':
+                return -1;
+            default:
+                fprintf(stderr, "Unhandled argument: %c\n", c);
+                return -1;
+        }
+    }
+
+    return 0;
+}
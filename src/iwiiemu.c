@@ -0,0 +1,387 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bmp.h"
+#include "iwii.h"
+#include "iwii_est.h"
+#include "iwii_gfx.h"
+#include "iwiitool.h"
+
+
+typedef struct opts_struct {
+/* I/O Config */
+    int      fd_in;     /**< Command stream file descriptor */
+    int      fd_out;    /**< Rendered image file descriptor */
+    unsigned baud;      /**< Baud rate to assume for timing */
+    uint8_t  flow;      /**< Flow control method to assume for timing */
+
+/* Render Config */
+    unsigned dpi;       /**< Horizontal resolution of rendered image */
+    unsigned width;     /**< Width of rendered page, in inches */
+    int      quiet;     /**< Do not report statistics */
+} opts_t;
+
+static opts_t opts = {
+/* I/O Config */
+    .fd_in     = STDIN_FILENO,
+    .fd_out    = STDOUT_FILENO,
+    .flow      = IWII_FLOW_XONXOFF,
+    .baud      = 9600,
+
+/* Render Config */
+    .dpi       = 144,
+    .width     = 8,
+    .quiet     = 0
+};
+
+/**
+ * @brief Rendered page
+ *
+ * Each pixel holds the set of ribbons that have struck it. Vertically, pixels
+ * are 1/144 of an inch apart, the finest paper motion of the printer.
+ */
+typedef struct {
+    uint8_t  *masks;   /**< Ribbon mask of each pixel, row by row */
+    unsigned  width;   /**< Width of page, in pixels */
+    unsigned  dpi;     /**< Horizontal resolution, in pixels per inch */
+    size_t    cap;     /**< Number of rows allocated */
+    size_t    height;  /**< Number of rows containing dots */
+    uint64_t  dropped; /**< Number of dots that fell outside of the page */
+    int       err;     /**< Set if memory could not be allocated */
+} _page_t;
+
+static int _handle_args(int argc, char **const argv);
+
+#define BUFF_SZ 4096
+
+/**
+ * @brief Make sure rows up to and including y are allocated
+ */
+static int _page_reserve(_page_t *page, size_t y) {
+    if(y < page->cap) {
+        return 0;
+    }
+
+    size_t cap = page->cap ? page->cap : 1024;
+    while(cap <= y) {
+        cap *= 2;
+    }
+
+    uint8_t *masks = realloc(page->masks, cap * page->width);
+    if(masks == NULL) {
+        fprintf(stderr, "EMU: Could not allocate memory for page\n");
+        page->err = 1;
+        return -1;
+    }
+    memset(&masks[page->cap * page->width], 0, (cap - page->cap) * page->width);
+    page->masks = masks;
+    page->cap   = cap;
+
+    return 0;
+}
+
+/**
+ * @brief Strike a single column of dots, @see iwii_est_render_t
+ */
+static void _render(void *arg, const iwii_est_t *est, uint64_t x, uint8_t col) {
+    _page_t *page = arg;
+    if((col == 0) || page->err) {
+        return;
+    }
+
+    /* Mixed colors strike more than one ribbon band */
+    uint8_t  mask = iwii_gfx_color_ribbons[est->color];
+    uint64_t x0   = (x * page->dpi) / IWII_EST_HEAD_UNITS;
+    uint64_t x1   = ((x + (IWII_EST_HEAD_UNITS / est->h_dpi)) * page->dpi) / IWII_EST_HEAD_UNITS;
+    if(x1 <= x0) {
+        x1 = x0 + 1;
+    }
+    if(x1 > page->width) {
+        x1 = page->width;
+    }
+
+    for(unsigned bit = 0; bit < 8; bit++) {
+        if(!(col & (1U << bit))) {
+            continue;
+        }
+
+        /* Pins are 1/72 of an inch apart */
+        int64_t y = est->v_pos + (2 * bit);
+        if((y < 0) || (x0 >= page->width)) {
+            page->dropped++;
+            continue;
+        }
+        if(_page_reserve(page, y)) {
+            return;
+        }
+
+        uint8_t *row = &page->masks[(size_t)y * page->width];
+        for(uint64_t px = x0; px < x1; px++) {
+            row[px] |= mask;
+        }
+        if((size_t)y >= page->height) {
+            page->height = y + 1;
+        }
+    }
+}
+
+#define RIBBON(r) (1U << IWII_RIBBON_##r)
+
+/** Resulting color of each combination of ribbons */
+static const uint8_t _mask_color[1U << IWII_RIBBON_MAX] = {
+    [0]                                      = IWII_COLOR_MAX,
+    [RIBBON(YELLOW)]                         = IWII_COLOR_YELLOW,
+    [RIBBON(RED)]                            = IWII_COLOR_RED,
+    [RIBBON(BLUE)]                           = IWII_COLOR_BLUE,
+    [RIBBON(YELLOW) | RIBBON(RED)]           = IWII_COLOR_ORANGE,
+    [RIBBON(YELLOW) | RIBBON(BLUE)]          = IWII_COLOR_GREEN,
+    [RIBBON(RED)    | RIBBON(BLUE)]          = IWII_COLOR_PURPLE,
+    [RIBBON(YELLOW) | RIBBON(RED) | RIBBON(BLUE)] = IWII_COLOR_BLACK
+    /* Everything including black is black */
+};
+
+/**
+ * @brief Write out page as a BMP, using the same palette iwiigfx accepts
+ */
+static int _page_write(_page_t *page, int fd) {
+    bmp_color_entry_t palette[IWII_COLOR_MAX + 1];
+    for(unsigned i = 0; i <= IWII_COLOR_MAX; i++) {
+        palette[i] = (bmp_color_entry_t){
+            .blue  = (iwii_gfx_color_rgb[i] >>  0) & 0xff,
+            .green = (iwii_gfx_color_rgb[i] >>  8) & 0xff,
+            .red   = (iwii_gfx_color_rgb[i] >> 16) & 0xff
+        };
+    }
+
+    /* An empty page is still written out as a single blank row */
+    if(_page_reserve(page, 0)) {
+        return -1;
+    }
+    size_t height = page->height ? page->height : 1;
+
+    for(size_t i = 0; i < (height * page->width); i++) {
+        uint8_t mask = page->masks[i];
+        page->masks[i] = (mask & RIBBON(BLACK)) ? IWII_COLOR_BLACK : _mask_color[mask];
+    }
+
+    return bmp_write(fd, page->masks, page->width, height, palette, IWII_COLOR_MAX + 1);
+}
+
+int iwiiemu(int argc, char **argv) {
+    if(_handle_args(argc, argv)) {
+        return -1;
+    }
+
+    int ret = -1;
+
+    _page_t page = {
+        .width = opts.width * opts.dpi,
+        .dpi   = opts.dpi
+    };
+
+    iwii_est_t est;
+    if(iwii_est_init(&est, opts.baud, opts.flow)) {
+        goto emu_noest;
+    }
+    est.render     = _render;
+    est.render_arg = &page;
+
+    uint8_t *buff = malloc(BUFF_SZ);
+    if(buff == NULL) {
+        fprintf(stderr, "Could not allocate space for input buffer: %s\n", strerror(errno));
+        goto emu_nobuff;
+    }
+
+    while(1) {
+        ssize_t rd = read(opts.fd_in, buff, BUFF_SZ);
+        if(rd > 0) {
+            iwii_est_feed(&est, buff, rd);
+            if(page.err) {
+                goto emu_fail;
+            }
+        } else if(rd < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error reading from input: %s\n", strerror(errno));
+            goto emu_fail;
+        } else {
+            /* EOF */
+            break;
+        }
+    }
+
+    if(_page_write(&page, opts.fd_out)) {
+        goto emu_fail;
+    }
+
+    if(!opts.quiet) {
+        iwii_est_report(&est, stderr);
+        if(page.dropped) {
+            fprintf(stderr, "%-18s %llu\n", "Dots off page:", (unsigned long long)page.dropped);
+        }
+    }
+
+    ret = 0;
+
+emu_fail:
+    free(buff);
+emu_nobuff:
+    iwii_est_destroy(&est);
+emu_noest:
+    free(page.masks);
+    close(opts.fd_in);
+    close(opts.fd_out);
+
+    return ret;
+}
+
+
+static void _help(void) {
+    puts("iwiiemu: Render ImageWriter II command streams to an image\n");
+
+    puts("Basic Options:\n"
+         "  -i, --input=FILE          Read command stream from FILE, use `-` for stdin (default)\n"
+         "  -o, --output=FILE         Write rendered page to FILE, use `-` for stdout (default)\n"
+         "                            The page is written as a BMP image using the colors in\n"
+         "                            palette.bmp, so it can be printed again using iwiigfx.\n"
+         "  -b, --baud=RATE           Baud rate to assume when estimating print time. Values 300,\n"
+         "                            1200, 2400, and 9600 (default) are accepted\n"
+         "  -F, --flow=MODE           Flow control mode to assume when estimating print time\n"
+         "                              0: None\n"
+         "                              1: XON/XOFF (default)\n"
+         "                              2: RTS/CTS\n"
+         "\n"
+         "Render Options:\n"
+         "  -H, --hdpi=DPI            Horizontal resolution of rendered page, 72 to 1440 (default\n"
+         "                            144). Vertical resolution is always 144 dpi. Only graphics\n"
+         "                            are rendered, text is accounted for but not drawn.\n"
+         "  -w, --width=INCHES        Width of rendered page, in inches (default 8)\n"
+         "  -q, --quiet               Do not report statistics on stderr\n"
+         "\n"
+         "Miscellaneous:\n"
+         "  -h, --help                Display this help message\n"
+        );
+
+    exit(0);
+}
+
+static const struct option prog_options[] = {
+    /* Basic Options */
+    { "input",            required_argument, NULL, 'i' },
+    { "output",           required_argument, NULL, 'o' },
+    { "baud",             required_argument, NULL, 'b' },
+    { "flow",             required_argument, NULL, 'F' },
+    /* Render Options */
+    { "hdpi",             required_argument, NULL, 'H' },
+    { "width",            required_argument, NULL, 'w' },
+    { "quiet",            no_argument,       NULL, 'q' },
+    /* Miscellaneous */
+    { "help",             no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static int __get_number(const char *arg, unsigned min, unsigned max, const char *msg) {
+    if(!isdigit(arg[0])) {
+        fprintf(stderr, "%s must be a number between %u and %u!\r\n", msg, min, max);
+        return -1;
+    }
+
+    unsigned val = strtoul(optarg, NULL, 10);
+    if((val < min) || (val > max)) {
+        fprintf(stderr, "%s must be a number between %u and %u!\r\n", msg, min, max);
+        return -1;
+    }
+
+    return val;
+}
+
+#define _get_number(min, max, msg, var) { \
+    int val = __get_number(optarg, min, max, msg); \
+    if(val < 0) { \
+        return -1; \
+    } \
+    var = val; \
+}
+
+static int _handle_args(int argc, char **const argv) {
+    int c;
+    while ((c = getopt_long(argc, argv, "i:o:b:F:"
+                                        "H:w:q"
+                                        "h", prog_options, NULL)) >= 0) {
+        switch(c) {
+            case 'i':
+                if(!strcmp(optarg, "-")) {
+                    opts.fd_in = STDIN_FILENO;
+                } else {
+                    opts.fd_in = open(optarg, O_RDONLY);
+                    if(opts.fd_in < 0) {
+                        fprintf(stderr, "Could not open input `%s`: %s\n", optarg, strerror(errno));
+                        return -1;
+                    }
+                }
+                break;
+            case 'o':
+                if(!strcmp(optarg, "-")) {
+                    opts.fd_out = STDOUT_FILENO;
+                } else {
+                    opts.fd_out = open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                    if(opts.fd_out < 0) {
+                        fprintf(stderr, "Could not open output `%s`: %s\n", optarg, strerror(errno));
+                        return -1;
+                    }
+                }
+                break;
+            case 'b': {
+                if(!isdigit(optarg[0])) {
+                    fprintf(stderr, "Baud rate selection must 300, 1200, 2400, or 9600!\n");
+                    return -1;
+                }
+                unsigned baud = strtoul(optarg, NULL, 10);
+                switch(baud) {
+                    case 300:
+                    case 1200:
+                    case 2400:
+                    case 9600:
+                        opts.baud = baud;
+                        break;
+                    default:
+                        fprintf(stderr, "Baud rate selection must 300, 1200, 2400, or 9600!\n");
+                        return -1;
+                }
+            } break;
+            case 'F':
+                _get_number(0, 2, "Flow control selection", opts.flow);
+                break;
+
+            case 'H':
+                _get_number(72, 1440, "Horizontal resolution", opts.dpi);
+                break;
+            case 'w':
+                _get_number(1, 15, "Page width", opts.width);
+                break;
+            case 'q':
+                opts.quiet = 1;
+                break;
+
+            case 'h':
+                _help();
+                break;
+
+            case '?':
+                return -1;
+            default:
+                fprintf(stderr, "Unhandled argument: %c\n", c);
+                return -1;
+        }
+    }
+
+    return 0;
+}
@@ -7,10 +7,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "iwii.h"
+#include "iwii_est.h"
 #include "iwii_gfx.h"
+#include "iwii_job.h"
+#include "iwii_out.h"
+#include "iwii_quant.h"
+#include "iwii_scale.h"
+#include "iwii_spool.h"
 #include "iwiitool.h"
 
 
@@ -20,6 +28,15 @@ typedef struct opts_struct {
     int      fd_out;    /**< Output file descriptor */
     unsigned baud;      /**< Baud rate to use */
     uint8_t  flow;      /**< Flow control method to use */
+    int      estimate;  /**< Only estimate print time, do not write output */
+    char    *compile;   /**< Write compiled print job to this path instead of printing */
+    char    *cache_dir; /**< Directory to cache compiled print jobs in, NULL for default */
+    int      no_cache;  /**< Do not use cache of compiled print jobs */
+    int      daemon;    /**< Submit job to iwiid instead of writing output */
+    char    *socket;    /**< Path of iwiid socket, NULL for default */
+    unsigned priority;  /**< Priority of job submitted to iwiid */
+    double   width_in;  /**< Width to print image at, in inches, 0 if not given in inches */
+    double   height_in; /**< Height to print image at, in inches, 0 if not given in inches */
 
     iwii_gfx_params_t gfx_cfg; /**< iwii_gfx configuration */
 } opts_t;
@@ -30,13 +47,16 @@ static opts_t opts = {
     .fd_out    = STDOUT_FILENO,
     .flow      = IWII_FLOW_XONXOFF,
     .baud      = 9600,
+    .priority  = IWII_JOB_PRIORITY_DEFAULT,
 
 /* GFX config */
     .gfx_cfg = {
         .flags     = 0,
         .h_dpi     = 72,
         .v_dpi     = 72,
-        .h_pos     = 0
+        .h_pos     = 0,
+        .dither    = IWII_DITHER_FS,
+        .resample  = IWII_RESAMPLE_NEAREST
     }
 };
 
@@ -44,45 +64,351 @@ static int _handle_args(int argc, char **const argv);
 
 #define BUFF_SZ 64
 
+static int _examine_image(uint64_t *key);
+static int _compile(const char *path, uint64_t key);
+static int _load_spool(iwii_spool_t *spool, char **dir, uint64_t *key);
+static int _cache_start(iwii_spool_writer_t *wr, iwii_out_t *out, const char *dir, uint64_t key);
+static void _cache_finish(iwii_spool_writer_t *wr, const char *dir, uint64_t key);
+
 int iwiigfx(int argc, char **argv) {
     if(_handle_args(argc, argv)) {
         return -1;
     }
 
-    if(iwii_serial_init(opts.fd_out, opts.flow, opts.baud)) {
+    if(opts.compile) {
+        uint64_t key = 0;
+        if(_examine_image(&key) > 0) {
+            fprintf(stderr, "Image is already a compiled print job\n");
+            close(opts.fd_img);
+            close(opts.fd_out);
+            return -1;
+        }
+        int ret = _compile(opts.compile, key);
         close(opts.fd_img);
         close(opts.fd_out);
-        return -1;
+        return ret;
     }
 
-    if(iwii_gfx_init(opts.fd_out, &opts.gfx_cfg)) {
-        goto main_fail;
+    if(opts.daemon) {
+        if(opts.estimate) {
+            fprintf(stderr, "Cannot submit to iwiid while estimating!\n");
+            close(opts.fd_img);
+            close(opts.fd_out);
+            return -1;
+        }
+
+        int sock = iwii_job_connect(opts.socket, opts.priority);
+        if(sock < 0) {
+            close(opts.fd_img);
+            close(opts.fd_out);
+            return -1;
+        }
+        close(opts.fd_out);
+        opts.fd_out = sock;
     }
-    
-    if(iwii_gfx_print_bmp(opts.fd_out, opts.fd_img)) {
+
+    iwii_est_t est;
+    iwii_out_t out;
+    if(opts.estimate) {
+        if(iwii_est_init(&est, opts.baud, opts.flow)) {
+            close(opts.fd_img);
+            close(opts.fd_out);
+            return -1;
+        }
+        if(iwii_out_init_sink(&out, iwii_est_feed, &est, 0)) {
+            iwii_est_destroy(&est);
+            close(opts.fd_img);
+            close(opts.fd_out);
+            return -1;
+        }
+    } else {
+        /* iwiid owns the serial port */
+        if(!opts.daemon && iwii_serial_init(opts.fd_out, opts.flow, opts.baud)) {
+            close(opts.fd_img);
+            close(opts.fd_out);
+            return -1;
+        }
+
+        if(iwii_out_init(&out, opts.fd_out, 0)) {
+            close(opts.fd_img);
+            close(opts.fd_out);
+            return -1;
+        }
+
+        /* Convert while previous bands are still being sent */
+        if(iwii_out_start_writer(&out, 0)) {
+            iwii_out_destroy(&out);
+            close(opts.fd_img);
+            close(opts.fd_out);
+            return -1;
+        }
+    }
+
+    iwii_spool_t        spool;
+    iwii_spool_writer_t wr;
+    char               *cache_dir = NULL;
+    uint64_t            key       = 0;
+    int                 caching   = 0;
+    int ret = _load_spool(&spool, &cache_dir, &key);
+    if(ret < 0) {
         goto main_fail;
+    } else if(ret == 0) {
+        if(opts.gfx_cfg.verbose) {
+            fprintf(stderr, "Printing compiled job\n");
+        }
+        ret = iwii_spool_replay(&spool, &out);
+        iwii_spool_close(&spool);
+        if(ret) {
+            goto main_fail;
+        }
+    } else {
+        /* Not in the cache yet, keep a copy while printing */
+        caching = cache_dir && !_cache_start(&wr, &out, cache_dir, key);
+
+        if(iwii_gfx_init(&out, &opts.gfx_cfg)) {
+            goto main_fail;
+        }
+
+        if(iwii_gfx_print_bmp(&out, opts.fd_img)) {
+            goto main_fail;
+        }
     }
 
+    if(iwii_out_destroy(&out)) {
+        if(caching) {
+            iwii_spool_destroy(&wr);
+        }
+        free(cache_dir);
+        if(opts.estimate) {
+            iwii_est_destroy(&est);
+        }
+        close(opts.fd_img);
+        close(opts.fd_out);
+        return -1;
+    }
+    if(caching) {
+        _cache_finish(&wr, cache_dir, key);
+    }
+    free(cache_dir);
+    if(opts.estimate) {
+        iwii_est_report(&est, stdout);
+        iwii_est_destroy(&est);
+    }
+    if(opts.daemon) {
+        uint32_t id;
+        if(iwii_job_finish(opts.fd_out, &id)) {
+            close(opts.fd_img);
+            close(opts.fd_out);
+            return -1;
+        }
+        fprintf(stderr, "Queued as job %u\n", id);
+    }
     close(opts.fd_img);
     close(opts.fd_out);
 
     return 0;
 
 main_fail:
+    iwii_out_destroy(&out);
+    if(caching) {
+        iwii_spool_destroy(&wr);
+    }
+    free(cache_dir);
+    if(opts.estimate) {
+        iwii_est_destroy(&est);
+    }
     close(opts.fd_img);
     close(opts.fd_out);
 
     return -1;
 }
 
+/**
+ * @brief Look at the image without consuming it, if it is a regular file
+ *
+ * @param key Where to store the cache key of the image
+ * @return 1 if image is a compiled print job, 0 if key was set, < 0 if the image cannot be examined
+ *         or the build cannot be identified
+ */
+static int _examine_image(uint64_t *key) {
+    struct stat st;
+    if(fstat(opts.fd_img, &st) || !S_ISREG(st.st_mode) || !st.st_size) {
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, opts.fd_img, 0);
+    if(map == MAP_FAILED) {
+        return -1;
+    }
+
+    int ret = 0;
+    if(iwii_spool_detect(map, st.st_size)) {
+        ret = 1;
+    } else if(iwii_spool_key(map, st.st_size, &opts.gfx_cfg, key)) {
+        ret = -1;
+    }
+    munmap(map, st.st_size);
+
+    return ret;
+}
+
+/**
+ * @brief Compile the image into a spool file
+ *
+ * @param path Path of spool file
+ * @param key Cache key to store in spool file
+ * @return 0 on success, else < 0
+ */
+static int _compile(const char *path, uint64_t key) {
+    iwii_spool_writer_t wr;
+    if(iwii_spool_create(&wr, path)) {
+        return -1;
+    }
+
+    iwii_out_t out;
+    if(iwii_out_init_sink(&out, iwii_spool_sink, &wr, 0)) {
+        iwii_spool_destroy(&wr);
+        return -1;
+    }
+    out.mark     = iwii_spool_mark;
+    out.mark_arg = &wr;
+
+    int ret = 0;
+    if(iwii_gfx_init(&out, &opts.gfx_cfg) ||
+       iwii_gfx_print_bmp(&out, opts.fd_img)) {
+        ret = -1;
+    }
+    if(iwii_out_destroy(&out)) {
+        ret = -1;
+    }
+    if(!ret) {
+        ret = iwii_spool_finish(&wr, key, &opts.gfx_cfg);
+    }
+    iwii_spool_destroy(&wr);
+
+    return ret;
+}
+
+/**
+ * @brief Open a spool file at path, if it exists and has the expected key
+ *
+ * @return 0 if opened, else < 0
+ */
+static int _open_cached(iwii_spool_t *spool, const char *path, uint64_t key) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return -1;
+    }
+
+    /* Mapping stays valid once the descriptor is closed */
+    int ret = iwii_spool_open(spool, fd);
+    if(!ret) {
+        /* Mark as recently used, @see iwii_spool_trim */
+        futimens(fd, NULL);
+    }
+    close(fd);
+    if(ret) {
+        return -1;
+    }
+
+    if(spool->head->key != key) {
+        iwii_spool_close(spool);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Get a compiled print job for the image
+ *
+ * If the image is a compiled print job, it is used directly. Otherwise, the
+ * job is looked up in the cache, unless only estimating, which must leave no
+ * trace.
+ *
+ * @param spool Spool to open
+ * @param dir Receives the cache directory, newly allocated, if the job should be added to the cache
+ * @param key Receives the cache key of the job
+ * @return 0 if spool was opened, 1 if the image should be printed directly, < 0 on error
+ */
+static int _load_spool(iwii_spool_t *spool, char **dir, uint64_t *key) {
+    int ret = _examine_image(key);
+    if(ret > 0) {
+        return iwii_spool_open(spool, opts.fd_img);
+    } else if(ret < 0 || opts.no_cache || opts.estimate) {
+        return 1;
+    }
+
+    char *cache;
+    if(opts.cache_dir) {
+        mkdir(opts.cache_dir, 0700);
+        cache = strdup(opts.cache_dir);
+    } else {
+        cache = iwii_spool_cache_dir();
+    }
+    char *path = cache ? iwii_spool_cache_path(cache, *key) : NULL;
+    if(path == NULL) {
+        free(cache);
+        return 1;
+    }
+
+    ret = _open_cached(spool, path, *key);
+    free(path);
+    if(ret) {
+        *dir = cache;
+        return 1;
+    }
+    free(cache);
+
+    return 0;
+}
+
+/**
+ * @brief Start keeping a copy of everything sent to out, to add to the cache
+ *
+ * The job is written to a temporary file as it is printed, so printing
+ * starts right away, and only moved into the cache once complete.
+ *
+ * @return 0 on success, else < 0
+ */
+static int _cache_start(iwii_spool_writer_t *wr, iwii_out_t *out, const char *dir, uint64_t key) {
+    char *path = iwii_spool_cache_path(dir, key);
+    if(path == NULL) {
+        return -1;
+    }
+    int ret = iwii_spool_create(wr, path);
+    free(path);
+    if(ret) {
+        return -1;
+    }
+
+    out->tee      = iwii_spool_sink;
+    out->tee_arg  = wr;
+    out->mark     = iwii_spool_mark;
+    out->mark_arg = wr;
+
+    return 0;
+}
+
+/**
+ * @brief Add the job copied by _cache_start() to the cache, keeping the cache within its size
+ */
+static void _cache_finish(iwii_spool_writer_t *wr, const char *dir, uint64_t key) {
+    if(!iwii_spool_finish(wr, key, &opts.gfx_cfg)) {
+        iwii_spool_trim(dir, IWII_SPOOL_CACHE_SZ);
+    }
+    iwii_spool_destroy(wr);
+}
 
 static void _help(void) {
     puts("iwiigfx: Print B&W and color images using an ImageWriter II\n");
 
     puts("Basic Options:\n"
          "  -i, --image=FILE          Read image from FILE, use `-` for stdin (default)\n"
-         "                            Image must be in BMP format, with no more than 8 used colors,\n"
-         "                            which must match those in the provided palette.bmp.\n"
+         "                            Image must be in BMP (uncompressed or RLE) or Netpbm (PBM, PGM,\n"
+         "                            PPM, or PAM) format. Indexed (1, 4, or 8 bpp) BMP images and PBM\n"
+         "                            images using only the colors in the provided palette.bmp are\n"
+         "                            printed as-is, others are quantized to those colors, see --dither\n"
          "  -o, --output=FILE         Write output to FILE, use `-` for stdout (default)\n"
          "  -b, --baud=RATE           Set baud rate to use when output is set to the printer's serial\n"
          "                            port. Values 300, 1200, 2400, and 9600 (default) are accepted\n"
@@ -90,19 +416,53 @@ static void _help(void) {
          "                              0: None\n"
          "                              1: XON/XOFF (default)\n"
          "                              2: RTS/CTS\n"
+         "  -E, --estimate            Do not print, instead report the size of the print job and an\n"
+         "                            estimate of how long it would take with the given settings\n"
+         "  -c, --compile=FILE        Do not print, instead write the compiled print job to FILE. A\n"
+         "                            compiled job can later be printed by passing it as the image\n"
+         "  -C, --cache-dir=DIR       Cache compiled print jobs in DIR, defaults to $IWII_CACHE_DIR,\n"
+         "                            $XDG_CACHE_HOME/iwiitool, or ~/.cache/iwiitool. Jobs are stored\n"
+         "                            as they are first printed, and the least recently used are\n"
+         "                            removed once the cache exceeds 256 MiB\n"
+         "  -N, --no-cache            Do not look up or store compiled print jobs in the cache\n"
+         "  -d, --daemon[=SOCKET]     Submit the job to iwiid instead of writing output. SOCKET\n"
+         "                            defaults to that of iwiid, see `iwiid --help`\n"
+         "  -Q, --priority=PRIO       Priority of job submitted to iwiid, 0 to 9 (default 5). Jobs\n"
+         "                            with higher priority are printed first\n"
          "\n"
          "Graphics Options:\n"
          "  -H, --hdpi=DPI            Horizontal DPI, values of 72 (default), 80, 96, 107, 120,\n"
          "                            136, 144, and 160 are supported\n"
          "  -V, --vdpi=DPI            Vertical DPI, values of 72 (default), and 144 are supported.\n"
          "  -O, --hoff=OFFSET         Set horizontal offset in dots\n"
+         "  -D, --dither=MODE         Dithering used when quantizing images to the printable colors\n"
+         "                              fs:      Floyd-Steinberg error diffusion (default)\n"
+         "                              ordered: 8x8 Bayer matrix\n"
+         "                              none:    Nearest color\n"
+         "  -x, --width=SIZE          Scale image to SIZE wide, in dots, or in inches if followed by\n"
+         "                            `in` (e.g. `4.5in`). If only one of width or height is given,\n"
+         "                            the other keeps the image's aspect ratio\n"
+         "  -y, --height=SIZE         Scale image to SIZE high, in dots or inches as for --width\n"
+         "  -r, --resample=KERNEL     Resampling used when scaling images\n"
+         "                              nearest: Nearest pixel, keeps exact colors as-is (default)\n"
+         "                              box:     Average of the pixels covered, images are then\n"
+         "                                       quantized, see --dither\n"
          "  -R, --return-to-top       Return to top of image after completion\n"
          "  -s, --sequential-color    Print image one color at a time. This can potentially reduce\n"
          "                            color bleed or ribbon staining when printing at 144 dpi vertical\n"
          "                            resulution.\n"
+         "  -Y, --relax-yellow        Only print yellow before the other colors in bands where it\n"
+         "                            touches them, elsewhere letting the order of color passes\n"
+         "                            alternate from band to band to save ribbon shifts\n"
+         "  -j, --jobs=N              Number of threads converting images, up to 64, or 0 (default) to\n"
+         "                            use one per CPU, capped at 8. Output is the same however many\n"
+         "                            are used\n"
          "\n"
          "Miscellaneous:\n"
          "  -h, --help                Display this help message\n"
+         "  -v, --verbose[=LEVEL]     Increase verbosity, can be supplied multiple times, or desired\n"
+         "                            verbosity can be directly supplied. Reports which ribbons the\n"
+         "                            image uses and how it is printed, and at level 2 every band\n"
         );
 
     exit(0);
@@ -114,14 +474,27 @@ static const struct option prog_options[] = {
     { "output",           required_argument, NULL, 'o' },
     { "baud",             required_argument, NULL, 'b' },
     { "flow",             required_argument, NULL, 'F' },
+    { "estimate",         no_argument,       NULL, 'E' },
+    { "compile",          required_argument, NULL, 'c' },
+    { "cache-dir",        required_argument, NULL, 'C' },
+    { "no-cache",         no_argument,       NULL, 'N' },
+    { "daemon",           optional_argument, NULL, 'd' },
+    { "priority",         required_argument, NULL, 'Q' },
     /* Graphics Options */
     { "hdpi",             required_argument, NULL, 'H' },
     { "vdpi",             required_argument, NULL, 'V' },
     { "hoff",             required_argument, NULL, 'O' },
+    { "dither",           required_argument, NULL, 'D' },
+    { "width",            required_argument, NULL, 'x' },
+    { "height",           required_argument, NULL, 'y' },
+    { "resample",         required_argument, NULL, 'r' },
     { "return-to-top",    no_argument,       NULL, 'R' },
     { "sequential-color", no_argument,       NULL, 'S' },
+    { "relax-yellow",     no_argument,       NULL, 'Y' },
+    { "jobs",             required_argument, NULL, 'j' },
     /* Miscellaneous */
     { "help",             no_argument,       NULL, 'h' },
+    { "verbose",          optional_argument, NULL, 'v' },
     { NULL, 0, NULL, 0 }
 };
 
@@ -140,6 +513,34 @@ static int __get_number(const char *arg, unsigned min, unsigned max, const char
     return val;
 }
 
+/**
+ * @brief Parse an image size, either in dots or in inches (suffixed with `in`)
+ *
+ * @param arg Argument to parse
+ * @param msg Name of option, for error messages
+ * @param dots Receives size in dots, or 0 if given in inches
+ * @param inches Receives size in inches, or 0 if given in dots
+ * @return 0 on success, else < 0
+ */
+static int _get_size(const char *arg, const char *msg, unsigned *dots, double *inches) {
+    char  *end;
+    double val = strtod(arg, &end);
+
+    *dots   = 0;
+    *inches = 0;
+    if(isdigit(arg[0]) && !strcmp(end, "in") && (val > 0) && (val <= 100)) {
+        *inches = val;
+        return 0;
+    }
+    if(isdigit(arg[0]) && (end[0] == '\0') && (val == (unsigned)val) && (val >= 1) && (val <= 9999)) {
+        *dots = val;
+        return 0;
+    }
+
+    fprintf(stderr, "%s must be a number of dots between 1 and 9999, or of inches followed by `in`!\n", msg);
+    return -1;
+}
+
 #define _get_number(min, max, msg, var) { \
     int val = __get_number(optarg, min, max, msg); \
     if(val < 0) { \
@@ -166,9 +567,9 @@ static int __get_number(const char *arg, unsigned min, unsigned max, const char
 
 static int _handle_args(int argc, char **const argv) {
     int c;
-    while ((c = getopt_long(argc, argv, "i:o:b:F:"
-                                        "H:V:O:RS"
-                                        "h", prog_options, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "i:o:b:F:Ec:C:Nd::Q:"
+                                        "H:V:O:D:x:y:r:RSYj:"
+                                        "hv::", prog_options, NULL)) >= 0) {
         switch(c) {
             case 'i':
                 if(!strcmp(optarg, "-")) {
@@ -213,6 +614,25 @@ static int _handle_args(int argc, char **const argv) {
             case 'F':
                 _get_number(0, 2, "Flow control selection", opts.flow);
                 break;
+            case 'E':
+                opts.estimate = 1;
+                break;
+            case 'c':
+                opts.compile = optarg;
+                break;
+            case 'C':
+                opts.cache_dir = optarg;
+                break;
+            case 'N':
+                opts.no_cache = 1;
+                break;
+            case 'd':
+                opts.daemon = 1;
+                opts.socket = optarg;
+                break;
+            case 'Q':
+                _get_number(0, IWII_JOB_PRIORITY_MAX, "Job priority", opts.priority);
+                break;
             
             case 'H': {
                 if(!isdigit(optarg[0])) {
@@ -255,16 +675,59 @@ static int _handle_args(int argc, char **const argv) {
             case 'O':
                 _get_number(0, 9999, "Horizontal offset", opts.gfx_cfg.h_pos);
                 break;
+            case 'D': {
+                int dither = iwii_quant_parse_dither(optarg);
+                if(dither < 0) {
+                    fprintf(stderr, "Dithering mode must be fs, ordered, or none!\n");
+                    return -1;
+                }
+                opts.gfx_cfg.dither = dither;
+            } break;
+            case 'x':
+                if(_get_size(optarg, "Width", &opts.gfx_cfg.width, &opts.width_in)) {
+                    return -1;
+                }
+                break;
+            case 'y':
+                if(_get_size(optarg, "Height", &opts.gfx_cfg.height, &opts.height_in)) {
+                    return -1;
+                }
+                break;
+            case 'r': {
+                int kernel = iwii_scale_parse_kernel(optarg);
+                if(kernel < 0) {
+                    fprintf(stderr, "Resampling kernel must be nearest or box!\n");
+                    return -1;
+                }
+                opts.gfx_cfg.resample = kernel;
+            } break;
             case 'R':
                 opts.gfx_cfg.flags |= IWII_GFX_FLAG_RETURNTOTOP;
                 break;
             case 'S':
                 opts.gfx_cfg.flags |= IWII_GFX_FLAG_SEQCOLORS;
                 break;
+            case 'Y':
+                opts.gfx_cfg.flags |= IWII_GFX_FLAG_RELAXYELLOW;
+                break;
+            case 'j':
+                _get_number(0, 64, "Number of threads", opts.gfx_cfg.threads);
+                break;
 
             case 'h':
                 _help();
                 break;
+            case 'v':
+                if(optarg) {
+                    if(!isdigit(optarg[0])) {
+                        fprintf(stderr, "Verbosity level must be a number >= 0!\n");
+                        return -1;
+                    }
+                    opts.gfx_cfg.verbose = strtoul(optarg, NULL, 10);
+                } else {
+                    opts.gfx_cfg.verbose++;
+                }
+                break;
 
             case '?':
                 return -1;
@@ -274,6 +737,24 @@ static int _handle_args(int argc, char **const argv) {
         }
     }
 
+    /* Sizes in inches depend on the DPI, which may come later */
+    if(opts.width_in > 0) {
+        opts.gfx_cfg.width = (unsigned)((opts.width_in * opts.gfx_cfg.h_dpi) + 0.5);
+        if(opts.gfx_cfg.width == 0) {
+            opts.gfx_cfg.width = 1;
+        }
+    }
+    if(opts.height_in > 0) {
+        opts.gfx_cfg.height = (unsigned)((opts.height_in * opts.gfx_cfg.v_dpi) + 0.5);
+        if(opts.gfx_cfg.height == 0) {
+            opts.gfx_cfg.height = 1;
+        }
+    }
+    if((opts.gfx_cfg.h_pos + opts.gfx_cfg.width) > IWII_GFX_MAX_DOTS) {
+        fprintf(stderr, "Horizontal offset and width must not exceed %u dots!\n", IWII_GFX_MAX_DOTS);
+        return -1;
+    }
+
     return 0;
 }
 
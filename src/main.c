@@ -10,12 +10,18 @@ int main(int argc, char **argv) {
         return ansi2iwii(argc, argv);
     } else if(!strcmp(prog, "iwiigfx")) {
         return iwiigfx(argc, argv);
+    } else if(!strcmp(prog, "iwiiemu")) {
+        return iwiiemu(argc, argv);
+    } else if(!strcmp(prog, "iwiid")) {
+        return iwiid(argc, argv);
     }
 
     if(argc < 2) {
         fprintf(stderr, "Tool name required! Available tools:\n"
                         "  ansi2iwii: Reformat ANSI-formatted text to send to an ImageWriter II\n"
-                        "  iwiigfx:   Print B&W and color images on an ImageWriter II\n");
+                        "  iwiigfx:   Print B&W and color images on an ImageWriter II\n"
+                        "  iwiiemu:   Render ImageWriter II command streams to an image\n"
+                        "  iwiid:     Queue print jobs for an ImageWriter II\n");
         return -1;
     }
 
@@ -23,6 +29,10 @@ int main(int argc, char **argv) {
         return ansi2iwii(argc - 1, &argv[1]);
     } else if(!strcmp(argv[1], "iwiigfx")) {
         return iwiigfx(argc - 1, &argv[1]);
+    } else if(!strcmp(argv[1], "iwiiemu")) {
+        return iwiiemu(argc - 1, &argv[1]);
+    } else if(!strcmp(argv[1], "iwiid")) {
+        return iwiid(argc - 1, &argv[1]);
     } else {
         fprintf(stderr, "Unrecognized tool name `%s`!\n", argv[1]);
         return -1;
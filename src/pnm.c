@@ -0,0 +1,528 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pnm.h"
+
+/**
+ * @brief Netpbm reader state
+ */
+struct pnm_reader_struct {
+    char      format;      /**< Format digit, '1' to '7' */
+    unsigned  depth;       /**< Samples per pixel */
+    unsigned  maxval;      /**< Largest sample value */
+    int       alpha;       /**< Last sample of each pixel is its opacity */
+    size_t    raw_sz;      /**< Size of a row in the file, for binary formats */
+    uint64_t  raster_off;  /**< Offset of first row within file */
+    uint8_t  *raw;         /**< Row as read from the file, for binary formats */
+    uint16_t *samples;     /**< Row of samples, width * depth */
+
+    uint8_t   buf[4096];   /**< Read buffer */
+    size_t    pos;         /**< Next unread byte in buf */
+    size_t    len;         /**< Number of bytes held in buf */
+    uint64_t  consumed;    /**< Number of bytes of file consumed so far */
+};
+
+/**
+ * @brief Get the next byte of the file
+ *
+ * @return Byte, < 0 on EOF or error
+ */
+static int _getc(bmp_hand_t *hand) {
+    struct pnm_reader_struct *rd = hand->pnm;
+
+    while(rd->pos == rd->len) {
+        ssize_t n = read(hand->fd, rd->buf, sizeof(rd->buf));
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if(n == 0) {
+            return -1;
+        }
+        rd->pos = 0;
+        rd->len = n;
+    }
+
+    rd->consumed++;
+    return rd->buf[rd->pos++];
+}
+
+/**
+ * @brief Read exactly len bytes, first from the read buffer, then straight from the file
+ *
+ * @return 0 on success, else < 0
+ */
+static int _read_bytes(bmp_hand_t *hand, uint8_t *dst, size_t len) {
+    struct pnm_reader_struct *rd = hand->pnm;
+
+    size_t n = rd->len - rd->pos;
+    if(n > len) {
+        n = len;
+    }
+    memcpy(dst, &rd->buf[rd->pos], n);
+    rd->pos      += n;
+    rd->consumed += n;
+    dst          += n;
+    len          -= n;
+
+    while(len) {
+        ssize_t got = read(hand->fd, dst, len);
+        if(got < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if(got == 0) {
+            return -1;
+        }
+        rd->consumed += got;
+        dst          += got;
+        len          -= got;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Skip whitespace and comments
+ *
+ * @return First byte following them, < 0 on EOF or error
+ */
+static int _skip_space(bmp_hand_t *hand) {
+    int c;
+    for(;;) {
+        c = _getc(hand);
+        if(c == '#') {
+            while((c >= 0) && (c != '\n') && (c != '\r')) {
+                c = _getc(hand);
+            }
+        }
+        if((c < 0) || !isspace(c)) {
+            return c;
+        }
+    }
+}
+
+/**
+ * @brief Read an unsigned decimal number, consuming the single character that follows it
+ *
+ * @param val Where to store the number
+ * @param end Where to store the character following the number, may be NULL
+ * @return 0 on success, else < 0
+ */
+static int _read_uint(bmp_hand_t *hand, unsigned *val, int *end) {
+    int c = _skip_space(hand);
+    if((c < 0) || !isdigit(c)) {
+        return -1;
+    }
+
+    uint64_t v = 0;
+    while((c >= 0) && isdigit(c)) {
+        v = (v * 10) + (c - '0');
+        if(v > UINT32_MAX) {
+            return -1;
+        }
+        c = _getc(hand);
+    }
+
+    *val = v;
+    if(end) {
+        *end = c;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read a PAM header, following the P7 signature
+ *
+ * @return 0 on success, else < 0
+ */
+static int _read_pam_header(bmp_hand_t *hand, unsigned *width, unsigned *height) {
+    struct pnm_reader_struct *rd = hand->pnm;
+    char     line[256];
+    char     tupltype[64] = "";
+    unsigned have = 0;
+
+    for(;;) {
+        size_t len = 0;
+        int    c;
+        while(((c = _getc(hand)) >= 0) && (c != '\n')) {
+            if(len < (sizeof(line) - 1)) {
+                line[len++] = c;
+            }
+        }
+        if(c < 0) {
+            return -1;
+        }
+        line[len] = '\0';
+
+        char *key = strtok(line, " \t\r");
+        char *val = strtok(NULL, " \t\r");
+        if((key == NULL) || (key[0] == '#')) {
+            continue;
+        } else if(!strcmp(key, "ENDHDR")) {
+            break;
+        } else if(val == NULL) {
+            continue;
+        }
+
+        if(!strcmp(key, "WIDTH")) {
+            *width = strtoul(val, NULL, 10);
+            have  |= 1;
+        } else if(!strcmp(key, "HEIGHT")) {
+            *height = strtoul(val, NULL, 10);
+            have   |= 2;
+        } else if(!strcmp(key, "DEPTH")) {
+            rd->depth = strtoul(val, NULL, 10);
+            have     |= 4;
+        } else if(!strcmp(key, "MAXVAL")) {
+            rd->maxval = strtoul(val, NULL, 10);
+            have      |= 8;
+        } else if(!strcmp(key, "TUPLTYPE")) {
+            snprintf(tupltype, sizeof(tupltype), "%s", val);
+        }
+    }
+
+    if(have != 0x0f) {
+        fprintf(stderr, "PNM: PAM header is missing WIDTH, HEIGHT, DEPTH, or MAXVAL\n");
+        return -1;
+    }
+    if((rd->depth < 1) || (rd->depth > 4)) {
+        fprintf(stderr, "PNM: Unsupported PAM depth: %u\n", rd->depth);
+        return -1;
+    }
+    /* GRAYSCALE_ALPHA and RGB_ALPHA, or anything else with an extra sample */
+    rd->alpha = (rd->depth == 2) || (rd->depth == 4) || (strstr(tupltype, "_ALPHA") != NULL);
+    if(rd->alpha && ((rd->depth & 1) != 0)) {
+        fprintf(stderr, "PNM: Unsupported PAM tuple type: %s\n", tupltype);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Scale a sample to 8 bits
+ */
+static inline uint8_t _scale(const struct pnm_reader_struct *rd, unsigned v) {
+    if(v > rd->maxval) {
+        v = rd->maxval;
+    }
+    return ((v * 255) + (rd->maxval / 2)) / rd->maxval;
+}
+
+/**
+ * @brief Composite a sample over white paper
+ */
+static inline unsigned _over_white(const struct pnm_reader_struct *rd, unsigned v, unsigned a) {
+    if(a > rd->maxval) {
+        a = rd->maxval;
+    }
+    return ((v * a) + (rd->maxval * (rd->maxval - a)) + (rd->maxval / 2)) / rd->maxval;
+}
+
+/**
+ * @brief Read a row of samples, @see pnm_reader_struct.samples
+ *
+ * @param raw Raw row, for binary formats
+ * @return 0 on success, else < 0
+ */
+static int _read_samples(bmp_hand_t *hand, const uint8_t *raw) {
+    struct pnm_reader_struct *rd = hand->pnm;
+    size_t n = (size_t)hand->dib_head.width * rd->depth;
+
+    if(raw == NULL) {
+        for(size_t i = 0; i < n; i++) {
+            unsigned v;
+            if(_read_uint(hand, &v, NULL)) {
+                return -1;
+            }
+            rd->samples[i] = v;
+        }
+    } else if(rd->maxval > 255) {
+        for(size_t i = 0; i < n; i++) {
+            rd->samples[i] = (raw[2 * i] << 8) | raw[(2 * i) + 1];
+        }
+    } else {
+        for(size_t i = 0; i < n; i++) {
+            rd->samples[i] = raw[i];
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read and decode the next row of the file
+ *
+ * @param dst Row buffer, in the layout of the equivalent BMP row
+ * @param raw Raw row, if already read from a seekable file, else NULL
+ * @return 0 on success, else < 0
+ */
+static int _read_row(bmp_hand_t *hand, uint8_t *dst, const uint8_t *raw) {
+    struct pnm_reader_struct *rd    = hand->pnm;
+    unsigned                  width = hand->dib_head.width;
+
+    if((raw == NULL) && (rd->format >= '4')) {
+        if(_read_bytes(hand, rd->raw, rd->raw_sz)) {
+            return -1;
+        }
+        raw = rd->raw;
+    }
+
+    if(rd->format == '4') {
+        /* Same layout as a 1 bpp BMP row, with 1 being black */
+        memcpy(dst, raw, rd->raw_sz);
+        return 0;
+    } else if(rd->format == '1') {
+        memset(dst, 0, hand->row_sz);
+        for(unsigned x = 0; x < width; x++) {
+            int c = _skip_space(hand);
+            if((c != '0') && (c != '1')) {
+                return -1;
+            }
+            if(c == '1') {
+                dst[x / 8] |= 0x80 >> (x % 8);
+            }
+        }
+        return 0;
+    }
+
+    if(_read_samples(hand, raw)) {
+        return -1;
+    }
+
+    const uint16_t *s = rd->samples;
+    if(rd->depth <= 2) {
+        for(unsigned x = 0; x < width; x++, s += rd->depth) {
+            unsigned v = rd->alpha ? _over_white(rd, s[0], s[1]) : s[0];
+            dst[x] = _scale(rd, v);
+        }
+    } else {
+        for(unsigned x = 0; x < width; x++, s += rd->depth) {
+            unsigned r = s[0], g = s[1], b = s[2];
+            if(rd->alpha) {
+                r = _over_white(rd, r, s[3]);
+                g = _over_white(rd, g, s[3]);
+                b = _over_white(rd, b, s[3]);
+            }
+            dst[(3 * x) + 0] = _scale(rd, b);
+            dst[(3 * x) + 1] = _scale(rd, g);
+            dst[(3 * x) + 2] = _scale(rd, r);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Ensure data can hold at least the given number of rows
+ */
+static int _reserve_rows(bmp_hand_t *hand, size_t rows) {
+    if(rows <= hand->data_cap) {
+        return 0;
+    }
+
+    uint8_t *data = realloc(hand->data, rows * hand->row_sz);
+    if(data == NULL) {
+        fprintf(stderr, "PNM: Could not allocate memory for pixel data\n");
+        return -1;
+    }
+    hand->data     = data;
+    hand->data_cap = rows;
+
+    return 0;
+}
+
+int pnm_detect(const uint8_t *magic) {
+    return (magic[0] == 'P') && (magic[1] >= '1') && (magic[1] <= '7');
+}
+
+int pnm_open(bmp_hand_t *hand, const uint8_t *magic) {
+    struct pnm_reader_struct *rd = calloc(1, sizeof(*rd));
+    if(rd == NULL) {
+        return -1;
+    }
+    hand->pnm     = rd;
+    rd->format    = magic[1];
+    rd->consumed  = 2;
+
+    unsigned width  = 0;
+    unsigned height = 0;
+    if(rd->format == '7') {
+        if(_read_pam_header(hand, &width, &height)) {
+            fprintf(stderr, "PNM: Could not read PAM header\n");
+            goto pnm_fail;
+        }
+    } else {
+        int end = 0;
+        rd->depth  = ((rd->format == '3') || (rd->format == '6')) ? 3 : 1;
+        rd->maxval = 1;
+        if(_read_uint(hand, &width, &end) ||
+           _read_uint(hand, &height, &end) ||
+           (((rd->format != '1') && (rd->format != '4')) && _read_uint(hand, &rd->maxval, &end)) ||
+           ((end < 0) || !isspace(end))) {
+            fprintf(stderr, "PNM: Could not read header\n");
+            goto pnm_fail;
+        }
+    }
+    if((width == 0) || (height == 0) || (width > 65535) || (height > 65535) ||
+       (rd->maxval == 0) || (rd->maxval > 65535)) {
+        fprintf(stderr, "PNM: Unsupported image dimensions or maxval\n");
+        goto pnm_fail;
+    }
+    rd->raster_off = rd->consumed;
+
+    /* Present the image as the equivalent top-down BMP */
+    hand->dib_head.width       = width;
+    hand->dib_head.height      = -(int32_t)height;
+    hand->dib_head.n_planes    = 1;
+    hand->dib_head.compression = BMP_COMPRESSION_RGB;
+    hand->height               = height;
+    hand->flags               |= BMP_FLAG_TOPDOWN | BMP_FLAG_PNM;
+
+    size_t sample_sz = (rd->maxval > 255) ? 2 : 1;
+    if((rd->format == '1') || (rd->format == '4')) {
+        static const bmp_color_entry_t bw[2] = {
+            { .blue = 0xff, .green = 0xff, .red = 0xff },
+            { .blue = 0x00, .green = 0x00, .red = 0x00 }
+        };
+        hand->dib_head.bpp      = 1;
+        hand->dib_head.n_colors = 2;
+        hand->palette           = malloc(sizeof(bw));
+        if(hand->palette) {
+            memcpy(hand->palette, bw, sizeof(bw));
+        }
+        rd->raw_sz = (width + 7) / 8;
+    } else {
+        if(rd->depth <= 2) {
+            hand->dib_head.bpp      = 8;
+            hand->dib_head.n_colors = 256;
+            hand->palette           = malloc(256 * sizeof(bmp_color_entry_t));
+            for(unsigned i = 0; hand->palette && (i < 256); i++) {
+                hand->palette[i] = (bmp_color_entry_t){ .blue = i, .green = i, .red = i };
+            }
+        } else {
+            hand->dib_head.bpp      = 24;
+            hand->dib_head.n_colors = 0;
+        }
+        rd->raw_sz  = (size_t)width * rd->depth * sample_sz;
+        rd->samples = malloc((size_t)width * rd->depth * sizeof(uint16_t));
+        if(rd->samples == NULL) {
+            goto pnm_nomem;
+        }
+    }
+    if((hand->dib_head.n_colors && (hand->palette == NULL))) {
+        goto pnm_nomem;
+    }
+    if(rd->format >= '4') {
+        rd->raw = malloc(rd->raw_sz);
+        if(rd->raw == NULL) {
+            goto pnm_nomem;
+        }
+    }
+
+    hand->row_sz  = ((hand->dib_head.bpp * width + 31) / 32) * 4;
+    hand->data_sz = hand->row_sz * height;
+
+    /* Rows of binary formats are all the same size, so can be read in any order */
+    struct stat st;
+    if((rd->format >= '4') && !fstat(hand->fd, &st) && S_ISREG(st.st_mode)) {
+        if((uint64_t)st.st_size < (rd->raster_off + ((uint64_t)rd->raw_sz * height))) {
+            fprintf(stderr, "PNM: File too small for pixel data\n");
+            goto pnm_fail;
+        }
+        hand->flags |= BMP_FLAG_SEEKABLE;
+        return 0;
+    }
+
+    return 0;
+
+pnm_nomem:
+    fprintf(stderr, "PNM: Could not allocate memory\n");
+pnm_fail:
+    pnm_close(hand);
+    free(hand->palette);
+    hand->palette = NULL;
+    return -1;
+}
+
+int pnm_load_band(bmp_hand_t *hand, uint32_t y, uint32_t rows) {
+    struct pnm_reader_struct *rd = hand->pnm;
+
+    if(_reserve_rows(hand, rows)) {
+        return -1;
+    }
+
+    if(hand->flags & BMP_FLAG_SEEKABLE) {
+        for(uint32_t i = 0; i < rows; i++) {
+            off_t    off = rd->raster_off + ((off_t)(y + i) * rd->raw_sz);
+            size_t   len = rd->raw_sz;
+            uint8_t *ptr = rd->raw;
+            while(len) {
+                ssize_t got = pread(hand->fd, ptr, len, off);
+                if(got < 0) {
+                    if(errno == EINTR) {
+                        continue;
+                    }
+                    break;
+                } else if(got == 0) {
+                    break;
+                }
+                ptr += got;
+                off += got;
+                len -= got;
+            }
+            if(len || _read_row(hand, &hand->data[i * hand->row_sz], rd->raw)) {
+                fprintf(stderr, "PNM: Could not read pixel data\n");
+                return -1;
+            }
+        }
+    } else {
+        /* Streaming, rows can only be read in order. Rows still held from
+         * the previous band may be asked for again. */
+        if(y < hand->next_fy) {
+            if(y < hand->band_fy) {
+                fprintf(stderr, "PNM: Cannot rewind non-seekable input\n");
+                return -1;
+            }
+            uint32_t keep = hand->next_fy - y;
+            if(keep > rows) {
+                keep = rows;
+            }
+            memmove(hand->data, &hand->data[(y - hand->band_fy) * hand->row_sz], keep * hand->row_sz);
+        }
+        for(; hand->next_fy < (y + rows); hand->next_fy++) {
+            /* Rows before the band are decoded into its first row, and discarded */
+            uint32_t i = (hand->next_fy < y) ? 0 : (hand->next_fy - y);
+            if(_read_row(hand, &hand->data[i * hand->row_sz], NULL)) {
+                fprintf(stderr, "PNM: Could not read pixel data\n");
+                return -1;
+            }
+        }
+    }
+
+    hand->band_fy = y;
+    hand->band_n  = rows;
+
+    return 0;
+}
+
+void pnm_close(bmp_hand_t *hand) {
+    struct pnm_reader_struct *rd = hand->pnm;
+    if(rd) {
+        free(rd->samples);
+        free(rd->raw);
+        free(rd);
+    }
+    free(hand->data);
+    hand->pnm  = NULL;
+    hand->data = NULL;
+}